@@ -24,6 +24,7 @@
 #define IBUS_TYPE_ZHUYIN_ENGINE (ibus_zhuyin_engine_get_type ())
 
 GType   ibus_zhuyin_engine_get_type    (void);
+void    ibus_zhuyin_engine_flush_config (void);
 
 #endif
 
@@ -0,0 +1,87 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ZHUYIN_BACKEND_H__
+#define __ZHUYIN_BACKEND_H__
+
+#include <glib.h>
+#include "zhuyin.h"
+
+__BEGIN_DECLS
+
+/*
+ * A backend answers the lookups behind zhuyin_candidate(),
+ * zhuyin_association(), zhuyin_toneless() and zhuyin_prefix().  Every
+ * backend is a struct starting with ZhuyinBackend, created by the open
+ * function of its class:
+ *
+ *   builtin  the tables compiled into the engine, path and base unused
+ *   mapped   a dictionary file from zhuyin-dict-compile, mapped read-only
+ *   overlay  a text file in the zhuyin-dict-compile format, keyed by
+ *            syllables or characters, whose candidates go first and the
+ *            base backend's follow; the overlay owns base once open
+ *
+ * The views returned by a backend stay valid until it is closed.
+ */
+typedef struct _ZhuyinBackend ZhuyinBackend;
+typedef struct _ZhuyinBackendClass ZhuyinBackendClass;
+
+/* Called by foreach with every stanza that has candidates, in key order. */
+typedef void (*ZhuyinBackendFunc) (guint, const ZhuyinCandidates*, gpointer);
+
+struct _ZhuyinBackendClass {
+    const gchar *name;
+    ZhuyinBackend* (*open) (const gchar *path, ZhuyinBackend *base, GError **error);
+    guint (*candidate) (ZhuyinBackend *backend, unsigned int stanza, ZhuyinCandidates *list);
+    guint (*association) (ZhuyinBackend *backend, const gchar *text, ZhuyinCandidates *list);
+    guint (*toneless) (ZhuyinBackend *backend, unsigned int stanza, ZhuyinCandidates *list);
+    guint (*prefix) (ZhuyinBackend *backend, unsigned int stanza, ZhuyinCandidates *list);
+    void (*foreach) (ZhuyinBackend *backend, ZhuyinBackendFunc func, gpointer user_data);
+    void (*close) (ZhuyinBackend *backend);
+};
+
+struct _ZhuyinBackend {
+    const ZhuyinBackendClass *klass;
+};
+
+#define zhuyin_backend_candidate(backend, stanza, list) \
+    ((backend)->klass->candidate((backend), (stanza), (list)))
+#define zhuyin_backend_association(backend, text, list) \
+    ((backend)->klass->association((backend), (text), (list)))
+#define zhuyin_backend_toneless(backend, stanza, list) \
+    ((backend)->klass->toneless((backend), (stanza), (list)))
+#define zhuyin_backend_prefix(backend, stanza, list) \
+    ((backend)->klass->prefix((backend), (stanza), (list)))
+#define zhuyin_backend_foreach(backend, func, user_data) \
+    ((backend)->klass->foreach((backend), (func), (user_data)))
+#define zhuyin_backend_close(backend) \
+    ((backend)->klass->close((backend)))
+
+extern const ZhuyinBackendClass zhuyin_backend_builtin;
+extern const ZhuyinBackendClass zhuyin_backend_mapped;
+extern const ZhuyinBackendClass zhuyin_backend_overlay;
+
+extern const ZhuyinBackendClass* zhuyin_backend_find(const gchar*);
+extern ZhuyinBackend* zhuyin_backend_open(const ZhuyinBackendClass*, const gchar*, ZhuyinBackend*, GError**);
+extern void zhuyin_use(ZhuyinBackend*);
+extern ZhuyinBackend* zhuyin_get_backend(void);
+
+__END_DECLS
+#endif // __ZHUYIN_BACKEND_H__
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
@@ -0,0 +1,79 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ZHUYIN_CONFIG_H__
+#define __ZHUYIN_CONFIG_H__
+
+#include <glib.h>
+
+__BEGIN_DECLS
+
+/*
+ * The config file, parsed once and shared by every engine.
+ *
+ * A ZhuyinConfig is never changed once it is made current: a reload parses
+ * a new one and swaps it in, and whoever holds a reference to the old one
+ * keeps reading it.  Each current config gets a new generation, so an engine
+ * can tell whether there is anything to apply.  Settings the file does not
+ * have are left unset.
+ */
+#define ZHUYIN_CONFIG_UNSET G_MININT
+
+typedef struct {
+    gint ref_count;
+    guint generation;
+    gchar *layout;              /* NULL if unset */
+    gint association;           /* TRUE, FALSE or ZHUYIN_CONFIG_UNSET */
+    gint quick_match;
+    gint tone_inference;
+    gchar **fuzzy;              /* names of the rules, NULL if unset */
+    gint punctuation_window_x;  /* ZHUYIN_CONFIG_UNSET if unset */
+    gint punctuation_window_y;
+} ZhuyinConfig;
+
+extern ZhuyinConfig* zhuyin_config_parse(const gchar*, gsize, GError**);
+extern ZhuyinConfig* zhuyin_config_ref(ZhuyinConfig*);
+extern void zhuyin_config_unref(ZhuyinConfig*);
+extern ZhuyinConfig* zhuyin_config_get(void);
+extern guint zhuyin_config_generation(void);
+extern void zhuyin_config_set(ZhuyinConfig*);
+extern gboolean zhuyin_config_load(const gchar*, GError**);
+extern gboolean zhuyin_config_reload(const gchar*, GError**);
+extern void zhuyin_config_watch(const gchar*);
+
+/*
+ * Writes the config file off the main loop.
+ *
+ * Every zhuyin_config_writer_save() replaces what is waiting to be written,
+ * so a burst of changes costs one write.  A thread writes the last of them
+ * once none came for the quiet period, creating the directory first if
+ * need be, and zhuyin_config_writer_flush() writes it at once.
+ */
+#define ZHUYIN_CONFIG_QUIET_MS 500
+
+typedef struct _ZhuyinConfigWriter ZhuyinConfigWriter;
+
+extern ZhuyinConfigWriter* zhuyin_config_writer_new(const gchar*, guint);
+extern void zhuyin_config_writer_free(ZhuyinConfigWriter*);
+extern void zhuyin_config_writer_save(ZhuyinConfigWriter*, gchar*, gsize);
+extern void zhuyin_config_writer_flush(ZhuyinConfigWriter*);
+
+__END_DECLS
+#endif // __ZHUYIN_CONFIG_H__
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
@@ -0,0 +1,145 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ZHUYIN_DICT_H__
+#define __ZHUYIN_DICT_H__
+
+#include <glib.h>
+#include "zhuyin.h"
+
+__BEGIN_DECLS
+
+/*
+ * A dictionary holds four tables of the same shape:
+ *
+ *   syllable     keyed by ZHUYIN_STANZA_KEY()
+ *   association  keyed by codepoint - ZHUYIN_ASSOCIATION_FIRST
+ *   toneless     keyed by ZHUYIN_STANZA_KEY() of a stanza without its tone,
+ *                the syllable lists of every tone merged, sharing their pool
+ *   prefix       keyed by ZHUYIN_STANZA_KEY() of what is typed of a syllable
+ *                up to some slot, the best ZHUYIN_PREFIX_LIMIT candidates of
+ *                every syllable it starts, sharing the syllable pool too
+ *
+ * index[key] is the list position plus one, or 0 when the key has no
+ * list.  The candidates of list n are offset[first[n]] .. offset[first[n + 1] - 1],
+ * each one a NUL-terminated string inside pool.
+ */
+typedef struct {
+    const guint16 *index;
+    guint index_number;
+    const guint32 *first;
+    guint list_number;
+    const guint32 *offset;
+    guint offset_number;
+    const gchar *pool;
+    guint pool_size;
+} ZhuyinDictTable;
+
+/* Toneless stanzas have tone 0, which puts their keys first. */
+#define ZHUYIN_TONELESS_NUMBER (ZHUYIN_STANZA_NUMBER / ZHUYIN_TONE_NUMBER)
+
+/* The most candidates a prefix lists, two pages of nine. */
+#define ZHUYIN_PREFIX_LIMIT 18
+
+typedef struct {
+    ZhuyinDictTable syllable;
+    ZhuyinDictTable association;
+    ZhuyinDictTable toneless;
+    ZhuyinDictTable prefix;
+} ZhuyinDict;
+
+/*
+ * On disk, as written by zhuyin-dict-compile, a dictionary is a
+ * ZhuyinDictHeader followed by the arrays it points at, the pools of the
+ * toneless and prefix tables being the one of the syllable table.  Every array
+ * starts on a 4 byte boundary and is stored in host byte order;
+ * byte_order tells a foreign file apart.  That makes the file specific to
+ * the architecture, so it is installed in pkglibdir, not pkgdatadir.
+ */
+#define ZHUYIN_DICT_MAGIC       "ZHUYDICT"
+#define ZHUYIN_DICT_VERSION     3
+#define ZHUYIN_DICT_BYTE_ORDER  0x01020304
+
+typedef struct {
+    guint32 offset;     /* bytes from the start of the file */
+    guint32 length;     /* number of elements */
+} ZhuyinDictSection;
+
+typedef struct {
+    ZhuyinDictSection index;
+    ZhuyinDictSection first;
+    ZhuyinDictSection offset;
+    ZhuyinDictSection pool;
+} ZhuyinDictTableHeader;
+
+typedef struct {
+    gchar magic[8];
+    guint32 version;
+    guint32 byte_order;
+    ZhuyinDictTableHeader syllable;
+    ZhuyinDictTableHeader association;
+    ZhuyinDictTableHeader toneless;
+    ZhuyinDictTableHeader prefix;
+} ZhuyinDictHeader;
+
+/*
+ * A table under construction.  zhuyin_dict_builder_finish() turns it into
+ * a ZhuyinDictTable that points into the builder, so the builder has to
+ * outlive it.
+ */
+typedef struct {
+    GArray *index;      /* guint16 per key */
+    GArray *first;      /* guint32 per list, plus the end */
+    GArray *offset;     /* guint32 per candidate */
+    GString *pool;
+} ZhuyinDictBuilder;
+
+/* Gets the list of a stanza key, for zhuyin_dict_rank_prefixes(). */
+typedef guint (*ZhuyinDictLookupFunc) (gpointer, guint, ZhuyinCandidates*);
+
+/* Called by zhuyin_dict_rank_prefixes() with a prefix key and its best candidates. */
+typedef void (*ZhuyinDictPrefixFunc) (guint, const gchar**, guint, gpointer);
+
+/* Called by zhuyin_dict_read_text() with the key and candidates of a line. */
+typedef gboolean (*ZhuyinDictLineFunc) (const gchar*, const gchar*, gpointer, GError**);
+
+extern gboolean zhuyin_dict_table_check(const ZhuyinDictTable*, GError**);
+extern gboolean zhuyin_dict_parse(const gchar*, gsize, ZhuyinDict*, GError**);
+extern guint zhuyin_dict_table_lookup(const ZhuyinDictTable*, guint, ZhuyinCandidates*);
+extern guint zhuyin_dict_candidate(const ZhuyinDict*, unsigned int, ZhuyinCandidates*);
+extern guint zhuyin_dict_association(const ZhuyinDict*, const gchar*, ZhuyinCandidates*);
+extern guint zhuyin_dict_toneless(const ZhuyinDict*, unsigned int, ZhuyinCandidates*);
+extern guint zhuyin_dict_prefix(const ZhuyinDict*, unsigned int, ZhuyinCandidates*);
+extern void zhuyin_dict_builder_init(ZhuyinDictBuilder*, guint);
+extern gboolean zhuyin_dict_builder_add(ZhuyinDictBuilder*, guint, const gchar*, guint*, GError**);
+extern void zhuyin_dict_builder_finish(ZhuyinDictBuilder*, ZhuyinDictTable*);
+extern void zhuyin_dict_builder_clear(ZhuyinDictBuilder*);
+extern void zhuyin_dict_count(GHashTable*, const gchar*, gsize, guint);
+extern void zhuyin_dict_builder_rank(ZhuyinDictBuilder*, GHashTable*);
+extern void zhuyin_dict_merge_tones(const ZhuyinDictTable*, ZhuyinDictBuilder*, ZhuyinDictTable*);
+extern void zhuyin_dict_rank_prefixes(ZhuyinDictLookupFunc, gpointer, ZhuyinDictPrefixFunc, gpointer);
+extern void zhuyin_dict_merge_prefixes(const ZhuyinDictTable*, ZhuyinDictBuilder*, ZhuyinDictTable*);
+extern const gchar* zhuyin_dict_symbol(guint, guint);
+extern gboolean zhuyin_dict_parse_syllable(const gchar*, guint*);
+extern gboolean zhuyin_dict_parse_character(const gchar*, guint*);
+extern gboolean zhuyin_dict_read_text(const gchar*, ZhuyinDictLineFunc, gpointer, GError**);
+
+__END_DECLS
+#endif // __ZHUYIN_DICT_H__
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
@@ -0,0 +1,70 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ZHUYIN_KEYBOARD_H__
+#define __ZHUYIN_KEYBOARD_H__
+
+#include <glib.h>
+#include "zhuyin.h"
+
+__BEGIN_DECLS
+
+/* Keyvals below this are looked up, everything else types nothing. */
+#define ZHUYIN_KEYBOARD_SIZE 128
+
+/* What one key types: a symbol and where it goes in the stanza. */
+typedef struct {
+    const gchar *symbol;    /* NULL if the key types nothing */
+    guint8 slot;            /* ZHUYIN_SLOT_INITIAL .. ZHUYIN_SLOT_TONE, 0 for none */
+    guint8 index;           /* value of the slot inside the stanza */
+} ZhuyinKey;
+
+/*
+ * A keyboard layout expanded into keyval-indexed arrays.
+ *
+ * key[] is what a key types on its own.  Some layouts, such as Hsu's,
+ * put an initial and a final on the same key; alternate[] then holds the
+ * final, for use once an initial has been typed, and ambiguous is set.
+ * index[slot][] is the slot value of a key already placed in slot.
+ */
+typedef struct {
+    const gchar *name;      /* as saved in the config */
+    const gchar *label;     /* as shown in the menu, before translation */
+    gboolean ambiguous;
+    ZhuyinKey key[ZHUYIN_KEYBOARD_SIZE];
+    ZhuyinKey alternate[ZHUYIN_KEYBOARD_SIZE];
+    guint8 index[ZHUYIN_SLOT_NUMBER][ZHUYIN_KEYBOARD_SIZE];
+} ZhuyinKeyboard;
+
+#define zhuyin_keyboard_key(keyboard, keyval, prefer_final) \
+    ((keyval) < ZHUYIN_KEYBOARD_SIZE ? \
+     &((prefer_final) ? (keyboard)->alternate : (keyboard)->key)[keyval] : NULL)
+#define zhuyin_keyboard_index(keyboard, keyval, slot) \
+    ((keyval) < ZHUYIN_KEYBOARD_SIZE ? (keyboard)->index[slot][keyval] : 0)
+
+extern gboolean zhuyin_keyboard_compile(const gchar*, const gchar* const*, ZhuyinKeyboard*, GError**);
+extern const ZhuyinKeyboard* zhuyin_keyboard_find(const gchar*);
+extern guint zhuyin_keyboard_get_number(void);
+extern const ZhuyinKeyboard* zhuyin_keyboard_get_nth(guint);
+extern gboolean zhuyin_keyboard_load(const gchar*, GError**);
+extern guint zhuyin_keyboard_load_dir(const gchar*);
+
+__END_DECLS
+#endif // __ZHUYIN_KEYBOARD_H__
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
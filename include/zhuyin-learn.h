@@ -0,0 +1,95 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ZHUYIN_LEARN_H__
+#define __ZHUYIN_LEARN_H__
+
+#include <glib.h>
+#include "zhuyin.h"
+
+__BEGIN_DECLS
+
+/*
+ * What a user picks, learned per syllable.
+ *
+ * A candidate is known by the key of its stanza and zhuyin_learn_id() of its
+ * text, so what was learned still means the same characters after the
+ * dictionary, its order or an overlay changes.  In memory they live in a table of
+ * ZHUYIN_LEARN_SLOTS records; the records of a stanza stay within
+ * ZHUYIN_LEARN_PROBES slots of where its key hashes to, and once those are
+ * taken a new pick replaces the weakest of them.
+ *
+ * Counts saturate at G_MAXUINT16 and halve for every ZHUYIN_LEARN_HALF_LIFE
+ * days since the candidate was last picked.
+ *
+ * On disk the table is a journal: a ZhuyinLearnHeader followed by
+ * ZhuyinLearnEntry records, each adding count picks on its day, replayed in
+ * order at open.  A pick appends one entry, never rewriting the file.  Each
+ * entry carries a checksum, so a torn write at the end loses that entry
+ * alone; replay stops there and the journal is cut back to the last good
+ * one.  Past ZHUYIN_LEARN_JOURNAL_LIMIT bytes, a thread rewrites the
+ * journal as one entry per record of the table and renames it into place.
+ *
+ * Since that rewrite only knows its own table, a journal is opened once
+ * per process: opening it again shares the store and takes a reference,
+ * and the last zhuyin_learn_close() closes it.
+ */
+#define ZHUYIN_LEARN_MAGIC      "ZHUYLERN"
+#define ZHUYIN_LEARN_VERSION    3
+#define ZHUYIN_LEARN_SLOTS      4096    /* a power of two */
+#define ZHUYIN_LEARN_PROBES     16
+#define ZHUYIN_LEARN_HALF_LIFE  30
+#define ZHUYIN_LEARN_JOURNAL_LIMIT (256 * 1024)
+
+/* The most candidates moved to the front of a list, one page. */
+#define ZHUYIN_LEARN_PROMOTED   9
+
+typedef struct {
+    guint16 key;        /* ZHUYIN_STANZA_KEY() plus one, 0 for a free slot */
+    guint16 count;
+    guint16 day;        /* day of the last pick, counted from the epoch */
+    guint16 reserved;   /* 0 */
+    guint32 candidate;  /* zhuyin_learn_id() of the candidate */
+} ZhuyinLearnRecord;
+
+typedef struct {
+    ZhuyinLearnRecord record;
+    guint32 check;      /* zhuyin_learn_check() of record */
+} ZhuyinLearnEntry;
+
+typedef struct {
+    gchar magic[8];     /* ZHUYIN_LEARN_MAGIC, not NUL-terminated */
+    guint32 version;
+    guint32 entry_size; /* sizeof (ZhuyinLearnEntry) */
+} ZhuyinLearnHeader;
+
+typedef struct _ZhuyinLearn ZhuyinLearn;
+
+extern ZhuyinLearn* zhuyin_learn_open(const gchar*, GError**);
+extern void zhuyin_learn_close(ZhuyinLearn*);
+extern guint zhuyin_learn_today(void);
+extern guint32 zhuyin_learn_check(const ZhuyinLearnRecord*);
+extern guint32 zhuyin_learn_id(const gchar*);
+extern void zhuyin_learn_pick(ZhuyinLearn*, unsigned int, const gchar*, guint);
+extern guint zhuyin_learn_count(const ZhuyinLearn*, unsigned int, const gchar*, guint);
+extern void zhuyin_learn_sort(const ZhuyinLearn*, unsigned int, ZhuyinCandidates*, guint32*, guint);
+
+__END_DECLS
+#endif // __ZHUYIN_LEARN_H__
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
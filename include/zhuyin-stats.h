@@ -0,0 +1,74 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ZHUYIN_STATS_H__
+#define __ZHUYIN_STATS_H__
+
+#include <glib.h>
+
+__BEGIN_DECLS
+
+/*
+ * How long the engine takes over a key, by phase.
+ *
+ * Each phase keeps a histogram of its times in buckets of powers of two
+ * nanoseconds, counted with atomic adds so any thread may time and read
+ * without a lock.  Until zhuyin_stats_enable() is called the timing macros
+ * cost a load and a branch.
+ */
+typedef enum {
+    ZHUYIN_STATS_KEY,           /* all of process_key_event */
+    ZHUYIN_STATS_PREEDIT,       /* the phase of the mode the key came in */
+    ZHUYIN_STATS_CANDIDATE,
+    ZHUYIN_STATS_LEADING,
+    ZHUYIN_STATS_PHRASE,
+    ZHUYIN_STATS_LOOKUP,        /* finding the candidates */
+    ZHUYIN_STATS_NUMBER
+} ZhuyinStatsPhase;
+
+/* Bucket i holds the times from 2^(i-1) up to 2^i nanoseconds, the last all longer. */
+#define ZHUYIN_STATS_BUCKETS 40
+
+typedef struct {
+    guint count;
+    gint64 p50;                 /* nanoseconds, to the bucket */
+    gint64 p99;
+    gint64 max;                 /* to the microsecond above */
+} ZhuyinStatsSummary;
+
+extern gint zhuyin_stats_enabled;
+
+/* The time to pass to ZHUYIN_STATS_STOP(), 0 if not timing. */
+#define ZHUYIN_STATS_START() (G_UNLIKELY (zhuyin_stats_enabled) ? zhuyin_stats_now () : 0)
+#define ZHUYIN_STATS_STOP(phase, start) G_STMT_START { \
+    if (G_UNLIKELY ((start) != 0)) \
+        zhuyin_stats_add ((phase), zhuyin_stats_now () - (start)); \
+} G_STMT_END
+
+extern void zhuyin_stats_enable(gboolean);
+extern gint64 zhuyin_stats_now(void);
+extern void zhuyin_stats_add(ZhuyinStatsPhase, gint64);
+extern void zhuyin_stats_summary(ZhuyinStatsPhase, ZhuyinStatsSummary*);
+extern void zhuyin_stats_reset(void);
+extern gchar* zhuyin_stats_report(void);
+extern gboolean zhuyin_stats_write(const gchar*, GError**);
+
+__END_DECLS
+#endif // __ZHUYIN_STATS_H__
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
@@ -0,0 +1,70 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ZHUYIN_TRACE_H__
+#define __ZHUYIN_TRACE_H__
+
+#include <glib.h>
+
+__BEGIN_DECLS
+
+/*
+ * The last keys the engine handled, to see what happened when it lagged.
+ *
+ * Events go into a ring of ZHUYIN_TRACE_SIZE slots, claimed with an atomic
+ * add and stamped once written, so recording takes no lock and allocates
+ * nothing.  Redacted, a trace keeps the editing, moving and modifier keys
+ * and drops what was typed, and how many candidates it had.
+ */
+typedef struct {
+    gint64 time;                /* monotonic nanoseconds the key came */
+    gint64 duration;            /* nanoseconds to handle it */
+    guint keyval;               /* ZHUYIN_TRACE_REDACTED if redacted */
+    guint modifiers;
+    guint stanza;               /* 0 if redacted */
+    guint candidates;           /* 0 if redacted */
+    guint8 mode_before;
+    guint8 mode_after;
+    guint8 emitted;             /* messages to IBus */
+    guint8 calls;               /* the kinds of them, ZHUYIN_TRACE_COMMIT... */
+    guint8 handled;
+} ZhuyinTraceEvent;
+
+#define ZHUYIN_TRACE_SIZE 256
+#define ZHUYIN_TRACE_REDACTED 0
+
+#define ZHUYIN_TRACE_COMMIT     (1 << 0)
+#define ZHUYIN_TRACE_PREEDIT    (1 << 1)
+#define ZHUYIN_TRACE_TABLE_SHOW (1 << 2)
+#define ZHUYIN_TRACE_TABLE_HIDE (1 << 3)
+#define ZHUYIN_TRACE_AUX        (1 << 4)
+
+extern gint zhuyin_trace_enabled;
+
+extern void zhuyin_trace_enable(gboolean, gboolean);
+extern void zhuyin_trace_dump_slow(gint64, const gchar*);
+extern void zhuyin_trace_record(const ZhuyinTraceEvent*);
+extern guint zhuyin_trace_snapshot(ZhuyinTraceEvent*, guint);
+extern void zhuyin_trace_reset(void);
+extern gchar* zhuyin_trace_report(void);
+extern gboolean zhuyin_trace_write(const gchar*, GError**);
+
+__END_DECLS
+#endif // __ZHUYIN_TRACE_H__
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
@@ -20,8 +20,91 @@
 #define __ZHUYIN_H__
 __BEGIN_DECLS
 
+/*
+ * A stanza packs one Zhuyin syllable into an unsigned int, one byte per
+ * slot: initial | medial << 8 | final << 16 | tone << 24.  Zero means the
+ * slot is empty, so every slot value is bounded by the numbers below.
+ */
+#define ZHUYIN_INITIAL_NUMBER 22    /* ㄅ .. ㄙ */
+#define ZHUYIN_MEDIAL_NUMBER   4    /* ㄧ ㄨ ㄩ */
+#define ZHUYIN_FINAL_NUMBER   14    /* ㄚ .. ㄦ */
+#define ZHUYIN_TONE_NUMBER     5    /* ˊ ˇ ˋ ˙ */
+
+/* The slots in typing order, also the byte of the stanza they use plus one. */
+#define ZHUYIN_SLOT_INITIAL 1
+#define ZHUYIN_SLOT_MEDIAL  2
+#define ZHUYIN_SLOT_FINAL   3
+#define ZHUYIN_SLOT_TONE    4
+#define ZHUYIN_SLOT_NUMBER  5
+
+#define ZHUYIN_INITIAL(stanza) ((stanza) & 0xff)
+#define ZHUYIN_MEDIAL(stanza)  (((stanza) >> 8) & 0xff)
+#define ZHUYIN_FINAL(stanza)   (((stanza) >> 16) & 0xff)
+#define ZHUYIN_TONE(stanza)    (((stanza) >> 24) & 0xff)
+
+#define ZHUYIN_STANZA_IN_RANGE(stanza) \
+    (ZHUYIN_INITIAL(stanza) < ZHUYIN_INITIAL_NUMBER && \
+     ZHUYIN_MEDIAL(stanza) < ZHUYIN_MEDIAL_NUMBER && \
+     ZHUYIN_FINAL(stanza) < ZHUYIN_FINAL_NUMBER && \
+     ZHUYIN_TONE(stanza) < ZHUYIN_TONE_NUMBER)
+
+/* Dense key of an in-range stanza, used to index the generated tables. */
+#define ZHUYIN_STANZA_KEY(stanza) \
+    (((ZHUYIN_TONE(stanza) * ZHUYIN_FINAL_NUMBER + ZHUYIN_FINAL(stanza)) * \
+      ZHUYIN_MEDIAL_NUMBER + ZHUYIN_MEDIAL(stanza)) * \
+     ZHUYIN_INITIAL_NUMBER + ZHUYIN_INITIAL(stanza))
+
+/* The stanza a dense key stands for, the inverse of ZHUYIN_STANZA_KEY(). */
+#define ZHUYIN_KEY_STANZA(key) \
+    ((key) % ZHUYIN_INITIAL_NUMBER | \
+     (key) / ZHUYIN_INITIAL_NUMBER % ZHUYIN_MEDIAL_NUMBER << 8 | \
+     (key) / (ZHUYIN_INITIAL_NUMBER * ZHUYIN_MEDIAL_NUMBER) % ZHUYIN_FINAL_NUMBER << 16 | \
+     (key) / (ZHUYIN_INITIAL_NUMBER * ZHUYIN_MEDIAL_NUMBER * ZHUYIN_FINAL_NUMBER) << 24)
+
+#define ZHUYIN_STANZA_NUMBER \
+    (ZHUYIN_INITIAL_NUMBER * ZHUYIN_MEDIAL_NUMBER * \
+     ZHUYIN_FINAL_NUMBER * ZHUYIN_TONE_NUMBER)
+
+/*
+ * Fuzzy rules for zhuyin_set_fuzzy(), each making a pair of symbols
+ * that many speakers merge stand for each other.
+ */
+#define ZHUYIN_FUZZY_EN_ENG (1 << 0)    /* ㄣ ㄥ */
+#define ZHUYIN_FUZZY_ZH_Z   (1 << 1)    /* ㄓ ㄗ */
+#define ZHUYIN_FUZZY_CH_C   (1 << 2)    /* ㄔ ㄘ */
+#define ZHUYIN_FUZZY_SH_S   (1 << 3)    /* ㄕ ㄙ */
+#define ZHUYIN_FUZZY_NUMBER 4
+
+/* Association keys are single characters from the CJK unified block. */
+#define ZHUYIN_ASSOCIATION_FIRST 0x4E00
+#define ZHUYIN_ASSOCIATION_LAST  0x9FFF
+#define ZHUYIN_ASSOCIATION_NUMBER \
+    (ZHUYIN_ASSOCIATION_LAST - ZHUYIN_ASSOCIATION_FIRST + 1)
+
+/*
+ * A read-only view of a candidate list.  The candidates sit back to back
+ * in pool, each NUL-terminated, and offset[i] is where the i-th starts.
+ */
+typedef struct {
+    const gchar *pool;
+    const guint32 *offset;
+    guint number;
+} ZhuyinCandidates;
+
+#define zhuyin_candidates_get(list, i) ((list)->pool + (list)->offset[i])
+
 extern void zhuyin_init(void);
-extern gchar** zhuyin_candidate(unsigned int, unsigned int*);
+extern gboolean zhuyin_load(const gchar*, GError**);
+extern gboolean zhuyin_is_valid(unsigned int);
+extern guint32 zhuyin_reachable(unsigned int, guint);
+extern guint zhuyin_tones(unsigned int);
+extern guint zhuyin_candidate(unsigned int, ZhuyinCandidates*);
+extern guint zhuyin_association(const gchar*, ZhuyinCandidates*);
+extern guint zhuyin_toneless(unsigned int, ZhuyinCandidates*);
+extern guint zhuyin_prefix(unsigned int, ZhuyinCandidates*);
+extern void zhuyin_set_fuzzy(guint);
+extern guint zhuyin_get_fuzzy(void);
+extern guint zhuyin_fuzzy_candidate(unsigned int, ZhuyinCandidates*);
 
 __END_DECLS
 #endif // __ZHUYIN_H__
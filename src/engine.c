@@ -18,8 +18,12 @@
 
 #include "engine.h"
 #include "zhuyin.h"
+#include "zhuyin-config.h"
+#include "zhuyin-keyboard.h"
+#include "zhuyin-learn.h"
+#include "zhuyin-stats.h"
+#include "zhuyin-trace.h"
 #include "punctuation.h"
-#include "phrases.h"
 
 #include <glib/gi18n.h>
 
@@ -27,43 +31,74 @@
 #define G_UNICHAR_MAX_BYTES 6
 #endif
 
+#include <string.h>
 #include <glib.h>
 #include <gtk/gtk.h>
 
 typedef struct _IBusZhuyinEngine IBusZhuyinEngine;
 typedef struct _IBusZhuyinEngineClass IBusZhuyinEngineClass;
 
-typedef enum {
-    LAYOUT_STANDARD = 0,
-    LAYOUT_HSU      = 1,
-    LAYOUT_ETEN     = 2,
-} ZhuyinLayout;
-
 struct _IBusZhuyinEngine {
     IBusEngine parent;
 
     /* members */
     GString *preedit;
+    IBusText *preedit_text;     /* shows preedit, sent again for every key */
+    IBusAttribute *preedit_underline;
+    IBusText *aux_text;         /* shows aux_str */
+    gchar aux_str[128];
+    IBusText *commit_text;
+
+    /* what IBus is to show, sent once at the end of a key */
+    guint dirty;                /* UI_* */
+    gboolean in_key_event;
+    gboolean table_visible;
+    gboolean aux_visible;
+    guint table_serial;         /* changes with table */
+    /* and what it was last sent */
+    GString *sent_preedit;
+    guint sent_preedit_cursor;
+    gboolean sent_table_visible;
+    guint sent_table_serial;
+    guint sent_table_cursor;
+    gchar sent_aux[128];
+    gboolean sent_aux_visible;
+    guint emitted;              /* messages to IBus for the last key */
+    guint calls;                /* ZHUYIN_TRACE_COMMIT... the last key sent */
+    gint64 key_time;            /* of the last key pressed */
+    gint64 burst_time;          /* keys closer than this are a burst, 0 for none */
+    GSource *flush_source;      /* ready when a burst changed the UI */
     gint mode;
     gint page_max;
     gint page_size;
-    gchar* display[4];
+    const gchar* display[4];
     gchar input[4];
     gboolean valid;
-    gchar** candidate_member;
-    gchar** punctuation_candidate;
-    gchar** phrase_candidate;
+    ZhuyinCandidates candidates;
+    GString *split_pool;
+    GArray *split_offset;
     guint candidate_number;
-
-    IBusLookupTable *table;
+    ZhuyinLearn *learn;
+    GArray *learn_offset;
+    guint learn_stanza;
+
+    IBusLookupTable *table;     /* the page of candidates shown */
+    guint cursor;               /* among all the candidates */
+    guint table_page;           /* of the table, G_MAXUINT if stale */
+    guint64 table_key;          /* TABLE_KEY() of the candidates, 0 if not cached */
     
-    ZhuyinLayout layout;
+    const ZhuyinKeyboard *keyboard;
     IBusProperty *prop_menu;
     IBusProperty *prop_association;
     IBusProperty *prop_quick;
+    IBusProperty *prop_tone;
+    IBusProperty *prop_fuzzy;
     IBusConfig *config;
     gboolean enable_association;
     gboolean enable_quick_match;
+    gboolean enable_tone_inference;
+    gint inferred_tone;
+    guint config_generation;   /* of the shared config last applied */
 };
 
 struct _IBusZhuyinEngineClass {
@@ -72,6 +107,39 @@ struct _IBusZhuyinEngineClass {
 
 static GtkWidget *punctuation_window = NULL;
 static IBusEngine *engine_instance = NULL;
+static ZhuyinConfigWriter *config_writer = NULL;
+
+/*
+ * Pages of candidates built before, shared by all the engines and kept in
+ * the order last shown, so the common syllables go out again without new
+ * IBusLookupTable or IBusText objects.  The size is what the tables take
+ * in memory, near enough.
+ */
+#define TABLE_CACHE_LIMIT (256 * 1024)
+
+enum {
+    TABLE_KEY_NONE,
+    TABLE_KEY_PREFIX,
+    TABLE_KEY_TONELESS,
+    TABLE_KEY_STANZA,
+    TABLE_KEY_ASSOCIATION,
+    TABLE_KEY_PUNCTUATION,
+    TABLE_KEY_LEADING
+};
+
+#define TABLE_KEY(kind, value) ((guint64) (kind) << 32 | (guint32) (value))
+
+typedef struct {
+    guint64 key;                /* TABLE_KEY() << 16 | page */
+    IBusLookupTable *table;
+    gsize size;
+    GList link;                 /* in table_cache_lru */
+} TableCacheEntry;
+
+static GHashTable *table_cache = NULL;
+static GQueue table_cache_lru = G_QUEUE_INIT;
+static gsize table_cache_size = 0;
+static guint table_cache_built = 0;     /* pages built, cached or not */
 
 // Variables for punctuation window dragging
 static gint punctuation_window_x = -1;
@@ -80,6 +148,16 @@ static gboolean punctuation_window_dragging = FALSE;
 static gint punctuation_window_drag_start_x = 0;
 static gint punctuation_window_drag_start_y = 0;
 
+/* One frame at 60 Hz, in microseconds. */
+#define BURST_FRAME_TIME (G_USEC_PER_SEC / 60)
+
+/* The parts of the UI that may need sending to IBus. */
+enum {
+    UI_PREEDIT = 1 << 0,
+    UI_TABLE   = 1 << 1,
+    UI_AUX     = 1 << 2
+};
+
 enum {
     IBUS_ZHUYIN_MODE_NORMAL,
     IBUS_ZHUYIN_MODE_CANDIDATE,
@@ -87,6 +165,14 @@ enum {
     IBUS_ZHUYIN_MODE_PHRASE
 };
 
+/* The phase each mode's keys are timed under */
+static const ZhuyinStatsPhase stats_phases[] = {
+    [IBUS_ZHUYIN_MODE_NORMAL] = ZHUYIN_STATS_PREEDIT,
+    [IBUS_ZHUYIN_MODE_CANDIDATE] = ZHUYIN_STATS_CANDIDATE,
+    [IBUS_ZHUYIN_MODE_LEADING] = ZHUYIN_STATS_LEADING,
+    [IBUS_ZHUYIN_MODE_PHRASE] = ZHUYIN_STATS_PHRASE,
+};
+
 // Global Declarations for Punctuation Window
 static const gchar *global_physical_keys[4][14] = {
     {"`", "1", "2", "3", "4", "5", "6", "7", "8", "9", "0", "-", "=", "\\"},
@@ -102,6 +188,23 @@ static const gchar *global_punctuation_keys[4][14] = {
     {"─", "│", "◎", "§", "←", "→", "。", "，", "．", "？"}
 };
 
+/* The fuzzy rules offered in the menu, with their property and config names. */
+static const struct {
+    guint rule;
+    const gchar *prop_name;
+    const gchar *name;
+    const gchar *label;
+} fuzzy_rules[ZHUYIN_FUZZY_NUMBER] = {
+    { ZHUYIN_FUZZY_EN_ENG, "Fuzzy.EnEng", "en_eng", "ㄣ = ㄥ" },
+    { ZHUYIN_FUZZY_ZH_Z,   "Fuzzy.ZhZ",   "zh_z",   "ㄓ = ㄗ" },
+    { ZHUYIN_FUZZY_CH_C,   "Fuzzy.ChC",   "ch_c",   "ㄔ = ㄘ" },
+    { ZHUYIN_FUZZY_SH_S,   "Fuzzy.ShS",   "sh_s",   "ㄕ = ㄙ" },
+};
+
+/* The key caps of the punctuation window, lit when they can go on with the preedit. */
+static GtkWidget *global_physical_labels[4][14];
+static gint global_physical_lit[4][14];    /* 1 lit, 0 not, -1 not drawn yet */
+
 /* functions prototype */
 static void ibus_zhuyin_engine_class_init (IBusZhuyinEngineClass *klass);
 static void ibus_zhuyin_engine_init (IBusZhuyinEngine *engine);
@@ -114,6 +217,7 @@ static gboolean ibus_zhuyin_engine_process_key_event
 static void ibus_zhuyin_engine_reset       (IBusEngine             *engine);
 static void ibus_zhuyin_engine_enable      (IBusEngine             *engine);
 static void ibus_zhuyin_engine_disable     (IBusEngine             *engine);
+static void ibus_zhuyin_engine_focus_in    (IBusEngine             *engine);
 static void ibus_engine_set_cursor_location (IBusEngine             *engine,
                                              gint                    x,
                                              gint                    y,
@@ -133,9 +237,18 @@ static gboolean ibus_zhuyin_engine_commit_candidate (IBusZhuyinEngine *zhuyin, g
 static void ibus_zhuyin_engine_commit_string (IBusZhuyinEngine      *zhuyin,
                                               const gchar            *string);
 static void ibus_zhuyin_engine_update_aux_text(IBusZhuyinEngine *zhuyin);
+static void ibus_zhuyin_engine_hide_lookup_table (IBusZhuyinEngine *zhuyin);
+static void ibus_zhuyin_engine_changed (IBusZhuyinEngine *zhuyin, guint parts);
 static void _update_lookup_table_and_aux_text(IBusZhuyinEngine *zhuyin);
+static void ibus_zhuyin_engine_set_cursor(IBusZhuyinEngine *zhuyin, guint cursor);
+static void ibus_zhuyin_engine_cursor_up(IBusZhuyinEngine *zhuyin);
+static void ibus_zhuyin_engine_cursor_down(IBusZhuyinEngine *zhuyin);
+static void ibus_zhuyin_engine_page_up_cursor(IBusZhuyinEngine *zhuyin);
+static void ibus_zhuyin_engine_page_down_cursor(IBusZhuyinEngine *zhuyin);
 static void ibus_zhuyin_engine_update      (IBusZhuyinEngine      *zhuyin);
 static guint get_zhuyin_index(IBusZhuyinEngine *zhuyin, guint keyval, gint type);
+static void update_punctuation_key_hints(IBusZhuyinEngine *zhuyin);
+static void ibus_zhuyin_engine_reload_config (IBusEngine *engine);
 
 
 static gboolean ibus_zhuyin_preedit_phase (IBusZhuyinEngine *zhuyin,
@@ -157,9 +270,17 @@ static gboolean ibus_zhuyin_phrase_phase (IBusZhuyinEngine *zhuyin,
 
 G_DEFINE_TYPE (IBusZhuyinEngine, ibus_zhuyin_engine, IBUS_TYPE_ENGINE)
 
+/* "InputMode.Hsu" for the layout named "hsu". */
+static gchar*
+get_keyboard_prop_name (const ZhuyinKeyboard *keyboard)
+{
+    return g_strdup_printf ("InputMode.%c%s",
+                            g_ascii_toupper (keyboard->name[0]), keyboard->name + 1);
+}
+
 #ifndef IBUS_ZHUYIN_TEST_BUILD
 static gchar*
-get_config_file_path (void)
+get_user_file_path (const gchar *name)
 {
     const gchar *config_dir = g_get_user_config_dir();
     gchar *ibus_dir = g_build_filename(config_dir, "ibus", NULL);
@@ -168,10 +289,34 @@ get_config_file_path (void)
         g_mkdir_with_parents(ibus_dir, 0700);
     }
     
-    gchar *config_file = g_build_filename(ibus_dir, "ibus-zhuyin.conf", NULL);
+    gchar *user_file = g_build_filename(ibus_dir, name, NULL);
     g_free(ibus_dir);
     
-    return config_file;
+    return user_file;
+}
+
+/* Left to the config writer to create the directory, off the main loop. */
+static gchar*
+get_config_file_path (void)
+{
+    return g_build_filename(g_get_user_config_dir(), "ibus", "ibus-zhuyin.conf", NULL);
+}
+
+/* The candidates picked, kept next to the config file and shared by every engine. */
+static ZhuyinLearn*
+open_learn_file (void)
+{
+    gchar *learn_file = get_user_file_path("ibus-zhuyin.learn");
+    GError *error = NULL;
+    ZhuyinLearn *learn = zhuyin_learn_open(learn_file, &error);
+
+    if (learn == NULL) {
+        g_warning("%s", error->message);
+        g_error_free(error);
+    }
+    g_free(learn_file);
+
+    return learn;
 }
 
 static void
@@ -180,95 +325,122 @@ save_config_to_file (IBusZhuyinEngine *zhuyin)
     if (!zhuyin) return;
     
     GKeyFile *key_file = g_key_file_new();
-    gchar *config_file = get_config_file_path();
-    
-    const gchar *layout_str = "standard";
-    if (zhuyin->layout == LAYOUT_HSU) {
-        layout_str = "hsu";
-    } else if (zhuyin->layout == LAYOUT_ETEN) {
-        layout_str = "eten";
-    }
     
-    g_key_file_set_string(key_file, "engine", "layout", layout_str);
+    g_key_file_set_string(key_file, "engine", "layout", zhuyin->keyboard->name);
     g_key_file_set_boolean(key_file, "engine", "association", zhuyin->enable_association);
     g_key_file_set_boolean(key_file, "engine", "quick_match", zhuyin->enable_quick_match);
+    g_key_file_set_boolean(key_file, "engine", "tone_inference", zhuyin->enable_tone_inference);
+
+    const gchar *fuzzy[ZHUYIN_FUZZY_NUMBER];
+    gsize fuzzy_number = 0;
+    for (guint i = 0; i < ZHUYIN_FUZZY_NUMBER; i++) {
+        if (zhuyin_get_fuzzy() & fuzzy_rules[i].rule)
+            fuzzy[fuzzy_number++] = fuzzy_rules[i].name;
+    }
+    g_key_file_set_string_list(key_file, "engine", "fuzzy", fuzzy, fuzzy_number);
     g_key_file_set_integer(key_file, "engine", "punctuation_window_x", punctuation_window_x);
     g_key_file_set_integer(key_file, "engine", "punctuation_window_y", punctuation_window_y);
     
     gsize length;
     gchar *data = g_key_file_to_data(key_file, &length, NULL);
     
+    /* the writer takes data and writes it once changes stop coming */
     if (data) {
-        g_file_set_contents(config_file, data, length, NULL);
-        g_free(data);
+        ZhuyinConfig *config = zhuyin_config_parse(data, length, NULL);
+        if (config) {
+            zhuyin_config_set(config);
+            zhuyin->config_generation = config->generation;
+        }
+        if (config_writer == NULL) {
+            gchar *config_file = get_config_file_path();
+            config_writer = zhuyin_config_writer_new(config_file, ZHUYIN_CONFIG_QUIET_MS);
+            g_free(config_file);
+        }
+        zhuyin_config_writer_save(config_writer, data, length);
     }
     
     g_key_file_free(key_file);
-    g_free(config_file);
 }
 
+#else
+static void save_config_to_file (IBusZhuyinEngine *zhuyin) { }
+static ZhuyinLearn* open_learn_file (void) { return NULL; }
+#endif
+
+/*
+ * Apply the shared config, if it changed since this engine last did.
+ * Returns whether it did, to show the menus what it changed.
+ */
+static gboolean
+apply_config (IBusZhuyinEngine *zhuyin)
+{
+    if (zhuyin_config_generation() == zhuyin->config_generation)
+        return FALSE;
+
+    ZhuyinConfig *config = zhuyin_config_get();
+    if (config == NULL)
+        return FALSE;
+    if (config->generation == zhuyin->config_generation) {
+        zhuyin_config_unref(config);
+        return FALSE;
+    }
+    zhuyin->config_generation = config->generation;
+
+    if (config->layout) {
+        const ZhuyinKeyboard *keyboard = zhuyin_keyboard_find(config->layout);
+        zhuyin->keyboard = keyboard ? keyboard : zhuyin_keyboard_find("standard");
+    }
+    if (config->association != ZHUYIN_CONFIG_UNSET)
+        zhuyin->enable_association = config->association;
+    if (config->quick_match != ZHUYIN_CONFIG_UNSET)
+        zhuyin->enable_quick_match = config->quick_match;
+    if (config->tone_inference != ZHUYIN_CONFIG_UNSET)
+        zhuyin->enable_tone_inference = config->tone_inference;
+    if (config->fuzzy) {
+        guint rules = 0;
+        for (guint i = 0; i < ZHUYIN_FUZZY_NUMBER; i++) {
+            if (g_strv_contains((const gchar * const *) config->fuzzy, fuzzy_rules[i].name))
+                rules |= fuzzy_rules[i].rule;
+        }
+        zhuyin_set_fuzzy(rules);
+    }
+    if (config->punctuation_window_x != ZHUYIN_CONFIG_UNSET)
+        punctuation_window_x = config->punctuation_window_x;
+    if (config->punctuation_window_y != ZHUYIN_CONFIG_UNSET)
+        punctuation_window_y = config->punctuation_window_y;
+
+    zhuyin_config_unref(config);
+    return TRUE;
+}
+
+/* Watch the config file and apply what it says. */
 static void
 load_config_from_file (IBusZhuyinEngine *zhuyin)
 {
     if (!zhuyin) return;
-    
-    GKeyFile *key_file = g_key_file_new();
+
+#ifndef IBUS_ZHUYIN_TEST_BUILD
     gchar *config_file = get_config_file_path();
-    
-    if (g_file_test(config_file, G_FILE_TEST_EXISTS)) {
-        GError *error = NULL;
-        if (g_key_file_load_from_file(key_file, config_file, G_KEY_FILE_NONE, &error)) {
-            gchar *layout_str = g_key_file_get_string(key_file, "engine", "layout", NULL);
-            if (layout_str) {
-                if (g_strcmp0(layout_str, "hsu") == 0) {
-                    zhuyin->layout = LAYOUT_HSU;
-                } else if (g_strcmp0(layout_str, "eten") == 0) {
-                    zhuyin->layout = LAYOUT_ETEN;
-                } else {
-                    zhuyin->layout = LAYOUT_STANDARD;
-                }
-                g_free(layout_str);
-            }
-            
-            GError *err = NULL;
-            gboolean association = g_key_file_get_boolean(key_file, "engine", "association", &err);
-            if (!err) {
-                zhuyin->enable_association = association;
-            }
-            if (err) g_error_free(err);
-            
-            err = NULL;
-            gboolean quick_match = g_key_file_get_boolean(key_file, "engine", "quick_match", &err);
-            if (!err) {
-                zhuyin->enable_quick_match = quick_match;
-            }
-            if (err) g_error_free(err);
-            
-            err = NULL;
-            gint x = g_key_file_get_integer(key_file, "engine", "punctuation_window_x", &err);
-            if (!err) {
-                punctuation_window_x = x;
-            }
-            if (err) g_error_free(err);
-            
-            err = NULL;
-            gint y = g_key_file_get_integer(key_file, "engine", "punctuation_window_y", &err);
-            if (!err) {
-                punctuation_window_y = y;
-            }
-            if (err) g_error_free(err);
-        }
-        if (error) g_error_free(error);
-    }
-    
-    g_key_file_free(key_file);
+    zhuyin_config_watch(config_file);
     g_free(config_file);
-}
-#else
-static void save_config_to_file (IBusZhuyinEngine *zhuyin) { }
-static void load_config_from_file (IBusZhuyinEngine *zhuyin) { }
 #endif
 
+    apply_config(zhuyin);
+}
+
+/**
+ * Write the config still waiting for its quiet period and stop the writer.
+ * Called once the main loop is done.
+ */
+void
+ibus_zhuyin_engine_flush_config (void)
+{
+    if (config_writer) {
+        zhuyin_config_writer_free(config_writer);
+        config_writer = NULL;
+    }
+}
+
 static void on_punctuation_button_clicked(GtkButton *button, gpointer user_data) {
     const gchar *symbol = (const gchar *)user_data;
     if (engine_instance && symbol) {
@@ -344,10 +516,9 @@ static gboolean create_punctuation_window_idle(gpointer user_data) {
             GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
             
             GtkWidget *phys_label = gtk_label_new(NULL);
-            gchar *phys_markup = g_strdup_printf("<span size='x-small' foreground='#888888'>%s</span>", global_physical_keys[i][j]);
-            gtk_label_set_markup(GTK_LABEL(phys_label), phys_markup);
-            g_free(phys_markup);
             gtk_label_set_xalign(GTK_LABEL(phys_label), 0.0);
+            global_physical_labels[i][j] = phys_label;
+            global_physical_lit[i][j] = -1;
 
             GtkWidget *punc_label = gtk_label_new(NULL);
             gchar *punc_markup = g_strdup_printf("<span size='xx-large' weight='bold'>%s</span>", global_punctuation_keys[i][j]);
@@ -372,6 +543,7 @@ static gboolean create_punctuation_window_idle(gpointer user_data) {
             gtk_grid_attach(GTK_GRID(grid), button, j + j_offset, i, 1, 1);
         }
     }
+    update_punctuation_key_hints((IBusZhuyinEngine *)engine);
     gtk_widget_show_all(grid);
 
     // After creation, show the window
@@ -409,6 +581,8 @@ static gboolean create_punctuation_window_idle(gpointer user_data) {
 
 static gboolean show_punctuation_window_idle(gpointer user_data) {
     if (punctuation_window) {
+        if (engine_instance)
+            update_punctuation_key_hints((IBusZhuyinEngine *)engine_instance);
         if (punctuation_window_x != -1 && punctuation_window_y != -1) {
             gtk_window_move(GTK_WINDOW(punctuation_window), punctuation_window_x, punctuation_window_y);
         } else {
@@ -457,7 +631,7 @@ ibus_zhuyin_engine_page_down (IBusEngine *engine)
     if (zhuyin->mode == IBUS_ZHUYIN_MODE_CANDIDATE ||
         zhuyin->mode == IBUS_ZHUYIN_MODE_PHRASE ||
         (zhuyin->mode == IBUS_ZHUYIN_MODE_NORMAL && zhuyin->valid)) {
-        ibus_lookup_table_page_down(zhuyin->table);
+        ibus_zhuyin_engine_page_down_cursor(zhuyin);
         _update_lookup_table_and_aux_text (zhuyin);
     }
 }
@@ -470,49 +644,343 @@ ibus_zhuyin_engine_page_up (IBusEngine *engine)
     if (zhuyin->mode == IBUS_ZHUYIN_MODE_CANDIDATE ||
         zhuyin->mode == IBUS_ZHUYIN_MODE_PHRASE ||
         (zhuyin->mode == IBUS_ZHUYIN_MODE_NORMAL && zhuyin->valid)) {
-        ibus_lookup_table_page_up(zhuyin->table);
+        ibus_zhuyin_engine_page_up_cursor(zhuyin);
         _update_lookup_table_and_aux_text (zhuyin);
     }
 }
 
+/*
+ * An IBusText kept for the life of the engine, whose text points at a
+ * buffer of the engine instead of a copy.  Sending it does not free it,
+ * so the keys go by without allocating one each.
+ */
+static IBusText *
+new_static_text (void)
+{
+    IBusText *text = ibus_text_new_from_static_string ("");
+
+    return g_object_ref_sink (text);
+}
+
+static void
+set_static_text (IBusText *text, const gchar *str)
+{
+    text->is_static = TRUE;
+    text->text = (gchar *) str;
+}
+
 static void
 ibus_zhuyin_engine_update_aux_text(IBusZhuyinEngine *zhuyin)
 {
-    gchar *aux_str = NULL;
     gboolean visible = FALSE;
 
     if (zhuyin->mode == IBUS_ZHUYIN_MODE_PHRASE ||
         (zhuyin->mode == IBUS_ZHUYIN_MODE_NORMAL && zhuyin->valid && zhuyin->enable_quick_match)) {
         if (zhuyin->candidate_number > zhuyin->page_size) {
-            gint pos = ibus_lookup_table_get_cursor_pos(zhuyin->table);
+            gint pos = zhuyin->cursor;
             gint page = pos / zhuyin->page_size;
-            aux_str = g_strdup_printf(_("%d / %d (Shift to select)"), page + 1, zhuyin->page_max + 1);
+            g_snprintf(zhuyin->aux_str, sizeof (zhuyin->aux_str), _("%d / %d (Shift to select)"), page + 1, zhuyin->page_max + 1);
         } else {
-            aux_str = g_strdup(_("(Shift to select)"));
+            g_strlcpy(zhuyin->aux_str, _("(Shift to select)"), sizeof (zhuyin->aux_str));
         }
         visible = TRUE;
     } else if (zhuyin->mode == IBUS_ZHUYIN_MODE_CANDIDATE && zhuyin->candidate_number > zhuyin->page_size) {
-        gint pos = ibus_lookup_table_get_cursor_pos(zhuyin->table);
+        gint pos = zhuyin->cursor;
         gint page = pos / zhuyin->page_size;
-        aux_str = g_strdup_printf("%d / %d", page + 1, zhuyin->page_max + 1);
+        g_snprintf(zhuyin->aux_str, sizeof (zhuyin->aux_str), "%d / %d", page + 1, zhuyin->page_max + 1);
         visible = TRUE;
     }
 
-    if (visible) {
-        IBusText *text = ibus_text_new_from_string(aux_str);
-        ibus_engine_update_auxiliary_text((IBusEngine *)zhuyin, text, TRUE);
-        g_free(aux_str);
-    } else {
-        ibus_engine_update_auxiliary_text((IBusEngine *)zhuyin, ibus_text_new_from_string(""), FALSE);
+    if (!visible)
+        zhuyin->aux_str[0] = '\0';
+    zhuyin->aux_visible = visible;
+    ibus_zhuyin_engine_changed(zhuyin, UI_AUX);
+}
+
+static IBusLookupTable *
+new_lookup_table (guint page_size)
+{
+    IBusLookupTable *table = ibus_lookup_table_new (page_size, 0, TRUE, TRUE);
+
+    ibus_lookup_table_set_orientation (table, IBUS_ORIENTATION_HORIZONTAL);
+    return g_object_ref_sink (table);
+}
+
+static void
+table_cache_drop (TableCacheEntry *entry)
+{
+    g_queue_unlink (&table_cache_lru, &entry->link);
+    g_hash_table_remove (table_cache, &entry->key);
+    table_cache_size -= entry->size;
+    g_object_unref (entry->table);
+    g_free (entry);
+}
+
+/* TRUE if the table holds the candidates from start to end, in order. */
+static gboolean
+table_cache_match (IBusLookupTable *table, const ZhuyinCandidates *candidates, guint start, guint end)
+{
+    guint i;
+
+    if (ibus_lookup_table_get_number_of_candidates (table) != end - start)
+        return FALSE;
+    for (i = start; i < end; i++) {
+        IBusText *text = ibus_lookup_table_get_candidate (table, i - start);
+        if (strcmp (text->text, zhuyin_candidates_get (candidates, i)) != 0)
+            return FALSE;
     }
+    return TRUE;
 }
+
+/*
+ * Get the page cached for key.  A learned order or fuzzy rules may have
+ * changed the list under the same key since, so a page that no longer
+ * matches is dropped.
+ */
+static IBusLookupTable *
+table_cache_lookup (guint64 key, const ZhuyinCandidates *candidates, guint start, guint end)
+{
+    TableCacheEntry *entry;
+
+    if (table_cache == NULL || (entry = g_hash_table_lookup (table_cache, &key)) == NULL)
+        return NULL;
+
+    if (!table_cache_match (entry->table, candidates, start, end)) {
+        table_cache_drop (entry);
+        return NULL;
+    }
+    g_queue_unlink (&table_cache_lru, &entry->link);
+    g_queue_push_head_link (&table_cache_lru, &entry->link);
+    return entry->table;
+}
+
+static void
+table_cache_insert (guint64 key, IBusLookupTable *table)
+{
+    TableCacheEntry *entry = g_new0 (TableCacheEntry, 1);
+    guint i, number = ibus_lookup_table_get_number_of_candidates (table);
+
+    entry->key = key;
+    entry->table = g_object_ref (table);
+    entry->size = sizeof (TableCacheEntry) + sizeof (IBusLookupTable);
+    for (i = 0; i < number; i++) {
+        IBusText *text = ibus_lookup_table_get_candidate (table, i);
+        entry->size += sizeof (gpointer) + sizeof (IBusText) + strlen (text->text) + 1;
+    }
+    entry->link.data = entry;
+
+    if (table_cache == NULL)
+        table_cache = g_hash_table_new (g_int64_hash, g_int64_equal);
+    g_hash_table_insert (table_cache, &entry->key, entry);
+    g_queue_push_head_link (&table_cache_lru, &entry->link);
+    table_cache_size += entry->size;
+
+    while (table_cache_size > TABLE_CACHE_LIMIT && table_cache_lru.length > 1)
+        table_cache_drop (g_queue_peek_tail_link (&table_cache_lru)->data);
+}
+
+/*
+ * Only the page of the cursor goes into the lookup table, so a syllable
+ * with hundreds of candidates costs a page of IBusText per update, and
+ * the engine does the paging.  It is put together when the table is sent,
+ * not for every key of a burst.
+ */
+static void
+ibus_zhuyin_engine_update_page (IBusZhuyinEngine *zhuyin)
+{
+    guint page = zhuyin->cursor / zhuyin->page_size;
+
+    if (page != zhuyin->table_page) {
+        guint start = page * zhuyin->page_size;
+        guint end = MIN (start + zhuyin->page_size, zhuyin->candidate_number);
+        guint64 key = zhuyin->table_key << 16 | page;
+        gboolean cached = zhuyin->table_key != 0 && page <= 0xffff;
+        IBusLookupTable *table = NULL;
+        guint i;
+
+        if (cached)
+            table = table_cache_lookup (key, &zhuyin->candidates, start, end);
+        if (table != NULL) {
+            g_object_ref (table);
+        } else {
+            table = new_lookup_table (zhuyin->page_size);
+            table_cache_built++;
+            for (i = start; i < end; i++) {
+                ibus_lookup_table_append_candidate (table,
+                        ibus_text_new_from_string (zhuyin_candidates_get (&zhuyin->candidates, i)));
+            }
+            if (cached)
+                table_cache_insert (key, table);
+        }
+        g_object_unref (zhuyin->table);
+        zhuyin->table = table;
+        zhuyin->table_page = page;
+        zhuyin->table_serial++;
+    }
+    ibus_lookup_table_set_cursor_pos (zhuyin->table, zhuyin->cursor % zhuyin->page_size);
+}
+
 static void
 _update_lookup_table_and_aux_text(IBusZhuyinEngine *zhuyin)
 {
-    ibus_engine_update_lookup_table((IBusEngine *)zhuyin, zhuyin->table, TRUE);
+    zhuyin->table_visible = TRUE;
+    ibus_zhuyin_engine_changed (zhuyin, UI_TABLE);
     ibus_zhuyin_engine_update_aux_text(zhuyin);
 }
 
+static void
+ibus_zhuyin_engine_hide_lookup_table (IBusZhuyinEngine *zhuyin)
+{
+    zhuyin->table_visible = FALSE;
+    ibus_zhuyin_engine_changed (zhuyin, UI_TABLE);
+}
+
+/* Count a message sent to IBus, and what kind it was, for the trace. */
+static void
+ibus_zhuyin_engine_emitted (IBusZhuyinEngine *zhuyin,
+                            guint             call)
+{
+    zhuyin->emitted++;
+    zhuyin->calls |= call;
+}
+
+/*
+ * Send IBus the parts of the UI that changed since they were last sent.
+ * A key may go through reset, redraw and a new list of candidates, each
+ * updating the same parts, so only what they come to at the end is sent,
+ * and nothing if that is what IBus shows already.
+ */
+static void
+ibus_zhuyin_engine_flush (IBusZhuyinEngine *zhuyin)
+{
+    IBusEngine *engine = (IBusEngine *) zhuyin;
+
+    if ((zhuyin->dirty & UI_PREEDIT) &&
+        (!g_string_equal (zhuyin->preedit, zhuyin->sent_preedit) ||
+         zhuyin->cursor != zhuyin->sent_preedit_cursor)) {
+        g_string_assign (zhuyin->sent_preedit, zhuyin->preedit->str);
+        zhuyin->sent_preedit_cursor = zhuyin->cursor;
+        set_static_text (zhuyin->preedit_text, zhuyin->preedit->str);
+        zhuyin->preedit_underline->end_index = zhuyin->preedit->len;
+        ibus_engine_update_preedit_text (engine, zhuyin->preedit_text, zhuyin->cursor, TRUE);
+        ibus_zhuyin_engine_emitted (zhuyin, ZHUYIN_TRACE_PREEDIT);
+    }
+
+    g_source_set_ready_time (zhuyin->flush_source, -1);
+
+    if (zhuyin->dirty & UI_TABLE) {
+        guint cursor;
+
+        if (zhuyin->table_visible)
+            ibus_zhuyin_engine_update_page (zhuyin);
+        cursor = ibus_lookup_table_get_cursor_pos (zhuyin->table);
+
+        if (zhuyin->table_visible &&
+            (!zhuyin->sent_table_visible || zhuyin->table_serial != zhuyin->sent_table_serial ||
+             cursor != zhuyin->sent_table_cursor)) {
+            ibus_engine_update_lookup_table (engine, zhuyin->table, TRUE);
+            ibus_zhuyin_engine_emitted (zhuyin, ZHUYIN_TRACE_TABLE_SHOW);
+        } else if (!zhuyin->table_visible && zhuyin->sent_table_visible) {
+            ibus_engine_hide_lookup_table (engine);
+            ibus_zhuyin_engine_emitted (zhuyin, ZHUYIN_TRACE_TABLE_HIDE);
+        }
+        zhuyin->sent_table_visible = zhuyin->table_visible;
+        zhuyin->sent_table_serial = zhuyin->table_serial;
+        zhuyin->sent_table_cursor = cursor;
+    }
+
+    if ((zhuyin->dirty & UI_AUX) &&
+        (zhuyin->aux_visible != zhuyin->sent_aux_visible || strcmp (zhuyin->aux_str, zhuyin->sent_aux) != 0)) {
+        g_strlcpy (zhuyin->sent_aux, zhuyin->aux_str, sizeof (zhuyin->sent_aux));
+        zhuyin->sent_aux_visible = zhuyin->aux_visible;
+        set_static_text (zhuyin->aux_text, zhuyin->aux_str);
+        ibus_engine_update_auxiliary_text (engine, zhuyin->aux_text, zhuyin->aux_visible);
+        ibus_zhuyin_engine_emitted (zhuyin, ZHUYIN_TRACE_AUX);
+    }
+
+    zhuyin->dirty = 0;
+}
+
+static gboolean
+ibus_zhuyin_engine_flush_timeout (gpointer user_data)
+{
+    ibus_zhuyin_engine_flush ((IBusZhuyinEngine *) user_data);
+    return TRUE;
+}
+
+/*
+ * The source stays with the engine and is only made ready for the next
+ * frame, a burst does not add a timeout to the main loop for every frame.
+ */
+static gboolean
+flush_source_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+    g_source_set_ready_time (source, -1);
+    return callback (user_data);
+}
+
+static GSourceFuncs flush_source_funcs = { NULL, NULL, flush_source_dispatch, NULL };
+
+/* Mark parts of the UI to send, right away unless a key is being handled. */
+static void
+ibus_zhuyin_engine_changed (IBusZhuyinEngine *zhuyin, guint parts)
+{
+    zhuyin->dirty |= parts;
+    if (!zhuyin->in_key_event)
+        ibus_zhuyin_engine_flush (zhuyin);
+}
+
+static void
+ibus_zhuyin_engine_set_cursor (IBusZhuyinEngine *zhuyin, guint cursor)
+{
+    zhuyin->cursor = MIN (cursor, zhuyin->candidate_number ? zhuyin->candidate_number - 1 : 0);
+}
+
+static void
+ibus_zhuyin_engine_cursor_up (IBusZhuyinEngine *zhuyin)
+{
+    if (zhuyin->cursor > 0)
+        zhuyin->cursor--;
+    else if (zhuyin->candidate_number > 0)
+        zhuyin->cursor = zhuyin->candidate_number - 1;
+}
+
+static void
+ibus_zhuyin_engine_cursor_down (IBusZhuyinEngine *zhuyin)
+{
+    if (zhuyin->cursor + 1 < zhuyin->candidate_number)
+        zhuyin->cursor++;
+    else
+        zhuyin->cursor = 0;
+}
+
+/* Keep the place in the page, going round at either end. */
+static void
+ibus_zhuyin_engine_page_up_cursor (IBusZhuyinEngine *zhuyin)
+{
+    guint page = zhuyin->cursor / zhuyin->page_size;
+    guint in_page = zhuyin->cursor % zhuyin->page_size;
+    guint pages = (zhuyin->candidate_number + zhuyin->page_size - 1) / zhuyin->page_size;
+
+    if (pages == 0)
+        return;
+    page = page > 0 ? page - 1 : pages - 1;
+    ibus_zhuyin_engine_set_cursor (zhuyin, page * zhuyin->page_size + in_page);
+}
+
+static void
+ibus_zhuyin_engine_page_down_cursor (IBusZhuyinEngine *zhuyin)
+{
+    guint page = zhuyin->cursor / zhuyin->page_size;
+    guint in_page = zhuyin->cursor % zhuyin->page_size;
+    guint pages = (zhuyin->candidate_number + zhuyin->page_size - 1) / zhuyin->page_size;
+
+    if (pages == 0)
+        return;
+    page = page + 1 < pages ? page + 1 : 0;
+    ibus_zhuyin_engine_set_cursor (zhuyin, page * zhuyin->page_size + in_page);
+}
+
 static void
 ibus_zhuyin_engine_candidate_clicked (IBusEngine *engine,
                                       guint       index,
@@ -525,9 +993,7 @@ ibus_zhuyin_engine_candidate_clicked (IBusEngine *engine,
     if (button != 1)
         return;
 
-    guint page_size = ibus_lookup_table_get_page_size(zhuyin->table);
-    guint cursor_pos = ibus_lookup_table_get_cursor_pos(zhuyin->table);
-    guint page_start = (cursor_pos / page_size) * page_size;
+    guint page_start = zhuyin->cursor / zhuyin->page_size * zhuyin->page_size;
     guint global_index = page_start + index;
 
     if (global_index >= zhuyin->candidate_number)
@@ -547,6 +1013,7 @@ ibus_zhuyin_engine_class_init (IBusZhuyinEngineClass *klass)
     engine_class->candidate_clicked   = ibus_zhuyin_engine_candidate_clicked;
     engine_class->disable             = ibus_zhuyin_engine_disable;
     engine_class->enable              = ibus_zhuyin_engine_enable;
+    engine_class->focus_in            = ibus_zhuyin_engine_focus_in;
     engine_class->page_down           = ibus_zhuyin_engine_page_down;
     engine_class->page_up             = ibus_zhuyin_engine_page_up;
     engine_class->process_key_event   = ibus_zhuyin_engine_process_key_event;
@@ -559,20 +1026,58 @@ static void
 ibus_zhuyin_engine_init (IBusZhuyinEngine *zhuyin)
 {
     engine_instance = (IBusEngine *)zhuyin;
-    zhuyin->preedit = g_string_new ("");
+    /* sized for the longest preedit and punctuation list, so typing does not grow them */
+    zhuyin->preedit = g_string_sized_new (4 * G_UNICHAR_MAX_BYTES);
+    zhuyin->preedit_text = new_static_text ();
+    zhuyin->preedit_text->attrs = g_object_ref_sink (ibus_attr_list_new ());
+    zhuyin->preedit_underline = ibus_attr_underline_new (IBUS_ATTR_UNDERLINE_SINGLE, 0, 0);
+    ibus_attr_list_append (zhuyin->preedit_text->attrs, zhuyin->preedit_underline);
+    zhuyin->aux_text = new_static_text ();
+    zhuyin->aux_str[0] = '\0';
+    zhuyin->commit_text = new_static_text ();
+    zhuyin->dirty = 0;
+    zhuyin->in_key_event = FALSE;
+    zhuyin->table_visible = FALSE;
+    zhuyin->aux_visible = FALSE;
+    zhuyin->table_serial = 0;
+    zhuyin->sent_preedit = g_string_sized_new (4 * G_UNICHAR_MAX_BYTES);
+    zhuyin->sent_preedit_cursor = 0;
+    zhuyin->sent_table_visible = FALSE;
+    zhuyin->sent_table_serial = 0;
+    zhuyin->sent_table_cursor = 0;
+    zhuyin->sent_aux[0] = '\0';
+    zhuyin->sent_aux_visible = FALSE;
+    zhuyin->emitted = 0;
+    zhuyin->calls = 0;
+    zhuyin->key_time = 0;
+#ifdef IBUS_ZHUYIN_TEST_BUILD
+    zhuyin->burst_time = 0;
+#else
+    zhuyin->burst_time = BURST_FRAME_TIME;
+#endif
+    zhuyin->flush_source = g_source_new (&flush_source_funcs, sizeof (GSource));
+    g_source_set_callback (zhuyin->flush_source, ibus_zhuyin_engine_flush_timeout, zhuyin, NULL);
+    g_source_attach (zhuyin->flush_source, NULL);
     zhuyin->mode = IBUS_ZHUYIN_MODE_NORMAL;
     zhuyin->page_size = 9;
-    zhuyin->punctuation_candidate = NULL;
-    zhuyin->phrase_candidate = NULL;
-
-    zhuyin->layout = LAYOUT_STANDARD;
+    zhuyin->candidates.pool = NULL;
+    zhuyin->split_pool = g_string_sized_new (256);
+    zhuyin->split_offset = g_array_sized_new (FALSE, FALSE, sizeof (guint32), 64);
+    zhuyin->learn = open_learn_file ();
+    zhuyin->learn_offset = g_array_sized_new (FALSE, FALSE, sizeof (guint32), 512);
+    zhuyin->learn_stanza = 0;
+
+    zhuyin->keyboard = zhuyin_keyboard_find ("standard");
     zhuyin->prop_menu = NULL;
     zhuyin->enable_association = FALSE;
     zhuyin->enable_quick_match = FALSE;
+    zhuyin->enable_tone_inference = FALSE;
+    zhuyin->inferred_tone = -1;
 
-    zhuyin->table = ibus_lookup_table_new (zhuyin->page_size, 0, TRUE, TRUE);
-    ibus_lookup_table_set_orientation(zhuyin->table, IBUS_ORIENTATION_HORIZONTAL);
-    g_object_ref_sink (zhuyin->table);
+    zhuyin->table = new_lookup_table (zhuyin->page_size);
+    zhuyin->cursor = 0;
+    zhuyin->table_page = G_MAXUINT;
+    zhuyin->table_key = 0;
 
     IBusBus *bus = ibus_bus_new();
     if (ibus_bus_is_connected(bus)) {
@@ -596,19 +1101,60 @@ ibus_zhuyin_engine_destroy (IBusZhuyinEngine *zhuyin)
         zhuyin->preedit = NULL;
     }
 
+    if (zhuyin->flush_source) {
+        g_source_destroy (zhuyin->flush_source);
+        g_source_unref (zhuyin->flush_source);
+        zhuyin->flush_source = NULL;
+    }
+
+    if (zhuyin->sent_preedit) {
+        g_string_free (zhuyin->sent_preedit, TRUE);
+        zhuyin->sent_preedit = NULL;
+    }
+
+    /* their text is the engine's, not theirs to free */
+    if (zhuyin->preedit_text) {
+        set_static_text (zhuyin->preedit_text, "");
+        g_object_unref (zhuyin->preedit_text);
+        zhuyin->preedit_text = NULL;
+    }
+
+    if (zhuyin->aux_text) {
+        set_static_text (zhuyin->aux_text, "");
+        g_object_unref (zhuyin->aux_text);
+        zhuyin->aux_text = NULL;
+    }
+
+    if (zhuyin->commit_text) {
+        set_static_text (zhuyin->commit_text, "");
+        g_object_unref (zhuyin->commit_text);
+        zhuyin->commit_text = NULL;
+    }
+
     if (zhuyin->table) {
         g_object_unref (zhuyin->table);
         zhuyin->table = NULL;
     }
 
-    if (zhuyin->punctuation_candidate) {
-        g_strfreev (zhuyin->punctuation_candidate);
-        zhuyin->punctuation_candidate = NULL;
+    if (zhuyin->split_pool) {
+        g_string_free (zhuyin->split_pool, TRUE);
+        zhuyin->split_pool = NULL;
+    }
+
+    if (zhuyin->split_offset) {
+        g_array_free (zhuyin->split_offset, TRUE);
+        zhuyin->split_offset = NULL;
     }
+    zhuyin->candidates.pool = NULL;
 
-    if (zhuyin->phrase_candidate) {
-        g_strfreev (zhuyin->phrase_candidate);
-        zhuyin->phrase_candidate = NULL;
+    if (zhuyin->learn) {
+        zhuyin_learn_close (zhuyin->learn);
+        zhuyin->learn = NULL;
+    }
+
+    if (zhuyin->learn_offset) {
+        g_array_free (zhuyin->learn_offset, TRUE);
+        zhuyin->learn_offset = NULL;
     }
 
     if (zhuyin->config) {
@@ -628,44 +1174,22 @@ ibus_zhuyin_engine_destroy (IBusZhuyinEngine *zhuyin)
 static void
 ibus_zhuyin_engine_update_lookup_table (IBusZhuyinEngine *zhuyin)
 {
-    gchar ** sugs;
-    gsize n_sug, i;
-    gboolean retval;
+    /* new candidates, back to the first */
+    zhuyin->cursor = 0;
+    zhuyin->table_page = G_MAXUINT;
 
-    ibus_lookup_table_clear (zhuyin->table);
-    
-    sugs = zhuyin->candidate_member;
-    n_sug = zhuyin->candidate_number;
-
-    if (sugs == NULL) {
-        ibus_engine_hide_lookup_table ((IBusEngine *) zhuyin);
+    if (zhuyin->candidates.pool == NULL) {
+        ibus_zhuyin_engine_hide_lookup_table (zhuyin);
         return;
     }
 
-    for (i = 0; i < n_sug; i++) {
-        ibus_lookup_table_append_candidate (zhuyin->table, ibus_text_new_from_string (sugs[i]));
-    }
-
     _update_lookup_table_and_aux_text (zhuyin);
 }
 
 static void
 ibus_zhuyin_engine_update_preedit (IBusZhuyinEngine *zhuyin)
 {
-    IBusText *text;
-    gint retval;
-
-    text = ibus_text_new_from_string (zhuyin->preedit->str);
-    text->attrs = ibus_attr_list_new ();
-    
-    ibus_attr_list_append (text->attrs,
-                           ibus_attr_underline_new (IBUS_ATTR_UNDERLINE_SINGLE, 0, zhuyin->preedit->len));
-
-    ibus_engine_update_preedit_text ((IBusEngine *)zhuyin,
-                                     text,
-                                     ibus_lookup_table_get_cursor_pos(zhuyin->table),
-                                     TRUE);
-
+    ibus_zhuyin_engine_changed (zhuyin, UI_PREEDIT);
 }
 
 /* commit preedit to client and update preedit */
@@ -681,28 +1205,43 @@ ibus_zhuyin_engine_commit_preedit (IBusZhuyinEngine *zhuyin)
     return TRUE;
 }
 
+/* Split space separated candidates into the reusable split buffers. */
 static void
-ibus_zhuyin_lookup_phrase (IBusZhuyinEngine *zhuyin, const gchar *text)
+ibus_zhuyin_engine_split_candidates (IBusZhuyinEngine *zhuyin,
+                                     const gchar      *text)
 {
-    int i;
-    const char *candidates = NULL;
+    guint32 start = 0;
+    gsize i;
 
-    for (i = 0; phrase_table[i].key != NULL; i++) {
-        if (g_strcmp0(phrase_table[i].key, text) == 0) {
-            candidates = phrase_table[i].candidates;
-            break;
+    g_string_assign (zhuyin->split_pool, text);
+    g_array_set_size (zhuyin->split_offset, 0);
+
+    for (i = 0; i <= zhuyin->split_pool->len; i++) {
+        if (zhuyin->split_pool->str[i] == ' ' || zhuyin->split_pool->str[i] == '\0') {
+            zhuyin->split_pool->str[i] = '\0';
+            g_array_append_val (zhuyin->split_offset, start);
+            start = i + 1;
         }
     }
 
-    if (zhuyin->phrase_candidate) {
-        g_strfreev(zhuyin->phrase_candidate);
-        zhuyin->phrase_candidate = NULL;
-    }
+    zhuyin->candidates.pool = zhuyin->split_pool->str;
+    zhuyin->candidates.offset = (const guint32 *) zhuyin->split_offset->data;
+    zhuyin->candidates.number = zhuyin->split_offset->len;
+    zhuyin->candidate_number = zhuyin->candidates.number;
+}
 
-    if (candidates) {
-        zhuyin->phrase_candidate = g_strsplit(candidates, " ", 0);
-        zhuyin->candidate_member = zhuyin->phrase_candidate;
-        zhuyin->candidate_number = g_strv_length(zhuyin->phrase_candidate);
+static void
+ibus_zhuyin_lookup_phrase (IBusZhuyinEngine *zhuyin, const gchar *text)
+{
+    ZhuyinCandidates candidates;
+    gint64 start = ZHUYIN_STATS_START ();
+    gint number = zhuyin_association(text, &candidates);
+
+    ZHUYIN_STATS_STOP (ZHUYIN_STATS_LOOKUP, start);
+    if (number > 0) {
+        zhuyin->candidates = candidates;
+        zhuyin->candidate_number = candidates.number;
+        zhuyin->table_key = TABLE_KEY (TABLE_KEY_ASSOCIATION, g_utf8_get_char (text));
         
         if (zhuyin->candidate_number % zhuyin->page_size)
             zhuyin->page_max = zhuyin->candidate_number / zhuyin->page_size;
@@ -714,25 +1253,61 @@ ibus_zhuyin_lookup_phrase (IBusZhuyinEngine *zhuyin, const gchar *text)
     }
 }
 
+/* Remember a candidate picked, if it is one of the syllable's own. */
+static void
+ibus_zhuyin_engine_learn (IBusZhuyinEngine *zhuyin, const gchar *text)
+{
+    ZhuyinCandidates list;
+    guint i, number;
+
+    if (zhuyin->learn == NULL || zhuyin->learn_stanza == 0 || zhuyin->mode == IBUS_ZHUYIN_MODE_PHRASE)
+        return;
+
+    number = zhuyin_candidate (zhuyin->learn_stanza, &list);
+    for (i = 0; i < number; i++) {
+        if (g_strcmp0 (zhuyin_candidates_get (&list, i), text) == 0) {
+            zhuyin_learn_pick (zhuyin->learn, zhuyin->learn_stanza, text, zhuyin_learn_today ());
+            return;
+        }
+    }
+}
+
+/* Move what the user picks most to the front, if the list is the syllable's own. */
+static void
+ibus_zhuyin_engine_promote (IBusZhuyinEngine *zhuyin, guint stanza)
+{
+    ZhuyinCandidates list;
+
+    zhuyin->learn_stanza = stanza;
+    if (zhuyin->learn == NULL || zhuyin->candidate_number == 0)
+        return;
+    if (zhuyin_candidate (stanza, &list) == 0 || list.offset != zhuyin->candidates.offset)
+        return;
+
+    g_array_set_size (zhuyin->learn_offset, zhuyin->candidate_number);
+    zhuyin_learn_sort (zhuyin->learn, stanza, &zhuyin->candidates,
+                       (guint32 *) zhuyin->learn_offset->data, zhuyin_learn_today ());
+}
+
 /* commit candidate to client and update preedit */
 static gboolean
 ibus_zhuyin_engine_commit_candidate (IBusZhuyinEngine *zhuyin, gint candidate)
 {
-    IBusText *ib_text = ibus_lookup_table_get_candidate (zhuyin->table, candidate);
-    gchar *text_copy;
+    const gchar *text;
 
-    if (ib_text == NULL)
+    if (candidate < 0 || candidate >= zhuyin->candidate_number || zhuyin->candidates.pool == NULL)
         return FALSE;
 
-    text_copy = g_strdup(ib_text->text);
-    ibus_zhuyin_engine_commit_string (zhuyin, ib_text->text);
+    /* in the dictionary or split_pool, neither changes until the next list */
+    text = zhuyin_candidates_get (&zhuyin->candidates, candidate);
+    ibus_zhuyin_engine_learn (zhuyin, text);
+    ibus_zhuyin_engine_commit_string (zhuyin, text);
     
     ibus_zhuyin_engine_reset((IBusEngine *) zhuyin);
 
     // Try to lookup phrases
     if (zhuyin->enable_association)
-        ibus_zhuyin_lookup_phrase(zhuyin, text_copy);
-    g_free(text_copy);
+        ibus_zhuyin_lookup_phrase(zhuyin, text);
 
     return TRUE;
 }
@@ -741,9 +1316,9 @@ static void
 ibus_zhuyin_engine_commit_string (IBusZhuyinEngine *zhuyin,
                                    const gchar       *string)
 {
-    IBusText *text;
-    text = ibus_text_new_from_string (string);
-    ibus_engine_commit_text ((IBusEngine *)zhuyin, text);
+    set_static_text (zhuyin->commit_text, string);
+    ibus_engine_commit_text ((IBusEngine *)zhuyin, zhuyin->commit_text);
+    ibus_zhuyin_engine_emitted (zhuyin, ZHUYIN_TRACE_COMMIT);
 }
 
 static void
@@ -767,18 +1342,18 @@ ibus_zhuyin_engine_reset (IBusEngine *engine)
     zhuyin->mode = IBUS_ZHUYIN_MODE_NORMAL;
     zhuyin->valid = FALSE;
     zhuyin->candidate_number = 0;
-    
-    if (zhuyin->phrase_candidate) {
-        g_strfreev(zhuyin->phrase_candidate);
-        zhuyin->phrase_candidate = NULL;
-    }
+    zhuyin->cursor = 0;
+    zhuyin->table_page = G_MAXUINT;
+    zhuyin->table_key = 0;
+    zhuyin->learn_stanza = 0;
+    zhuyin->inferred_tone = -1;
 
     if (punctuation_window && gtk_widget_get_visible(punctuation_window)) {
         g_idle_add(hide_punctuation_window_idle, NULL);
     }
 
     ibus_zhuyin_engine_update (zhuyin);
-    ibus_engine_hide_lookup_table ((IBusEngine *)zhuyin);
+    ibus_zhuyin_engine_hide_lookup_table (zhuyin);
     ibus_zhuyin_engine_update_aux_text(zhuyin);
 }
 
@@ -799,21 +1374,69 @@ ibus_zhuyin_engine_redraw (IBusZhuyinEngine *zhuyin)
     ibus_zhuyin_engine_update (zhuyin);
 }
 
+static guint
+get_zhuyin_index(IBusZhuyinEngine *zhuyin, guint keyval, gint type)
+{
+    return zhuyin_keyboard_index (zhuyin->keyboard, keyval, type);
+}
+
+/* The stanza of what has been typed so far. */
+static guint
+get_zhuyin_stanza(IBusZhuyinEngine *zhuyin)
+{
+    guint i = 0;
+    guint stanza = 0;
+    for (i = 0; i < 4; i++) {
+        if (zhuyin->input[i])
+            stanza |= get_zhuyin_index(zhuyin, zhuyin->input[i], i + 1) << (i * 8);
+    }
+    return stanza;
+}
+
+/* Whether a slot after the last one typed may still be filled in. */
+static gboolean
+is_zhuyin_partial(IBusZhuyinEngine *zhuyin, guint stanza)
+{
+    gint slot = ZHUYIN_SLOT_FINAL;
+
+    while (slot > ZHUYIN_SLOT_INITIAL && zhuyin->input[slot - 1] == 0)
+        slot--;
+    for (slot++; slot <= ZHUYIN_SLOT_FINAL; slot++) {
+        if (zhuyin_reachable(stanza, slot) & ~1u)
+            return TRUE;
+    }
+    return FALSE;
+}
+
 static void
 _update_candidates(IBusZhuyinEngine *zhuyin)
 {
+    update_punctuation_key_hints(zhuyin);
     if (zhuyin->preedit->len > 0) {
-        guint i = 0;
-        guint stanza = 0;
-        for (i = 0; i < 4; i++) {
-            if (zhuyin->input[i]) {
-                guint idx = get_zhuyin_index(zhuyin, zhuyin->input[i], i + 1);
-                if (i == 0) stanza |= idx;
-                else stanza |= (idx << (i * 8));
+        guint stanza = get_zhuyin_stanza(zhuyin);
+        gint64 start = ZHUYIN_STATS_START ();
+
+        zhuyin->learn_stanza = 0;
+        /*
+         * until the tone is typed, quick match offers the syllable in every tone,
+         * or the best of every syllable it may still become
+         */
+        if (zhuyin->enable_quick_match && zhuyin->mode == IBUS_ZHUYIN_MODE_NORMAL && zhuyin->input[3] == 0) {
+            if (is_zhuyin_partial(zhuyin, stanza)) {
+                zhuyin->candidate_number = zhuyin_prefix(stanza, &zhuyin->candidates);
+                zhuyin->table_key = TABLE_KEY (TABLE_KEY_PREFIX, stanza);
+            } else {
+                zhuyin->candidate_number = zhuyin_toneless(stanza, &zhuyin->candidates);
+                zhuyin->table_key = TABLE_KEY (TABLE_KEY_TONELESS, stanza);
             }
+        } else {
+            zhuyin->candidate_number = zhuyin_fuzzy_candidate(stanza, &zhuyin->candidates);
+            zhuyin->table_key = TABLE_KEY (TABLE_KEY_STANZA, stanza);
+            ibus_zhuyin_engine_promote(zhuyin, stanza);
         }
-        zhuyin->candidate_member = zhuyin_candidate(stanza, &i);
-        zhuyin->candidate_number = i;
+        ZHUYIN_STATS_STOP (ZHUYIN_STATS_LOOKUP, start);
+        if (zhuyin->candidate_number == 0)
+            zhuyin->candidates.pool = NULL;
         if (zhuyin->candidate_number > 0) {
             if (zhuyin->candidate_number % zhuyin->page_size)
                 zhuyin->page_max = zhuyin->candidate_number / zhuyin->page_size;
@@ -822,19 +1445,19 @@ _update_candidates(IBusZhuyinEngine *zhuyin)
         } else {
             zhuyin->page_max = 0;
         }
-        zhuyin->valid = (zhuyin->candidate_member != NULL);
+        zhuyin->valid = (zhuyin->candidates.pool != NULL);
         if (zhuyin->valid && (zhuyin->enable_quick_match || zhuyin->mode == IBUS_ZHUYIN_MODE_CANDIDATE)) {
             ibus_zhuyin_engine_update_lookup_table(zhuyin);
         } else {
-            ibus_engine_hide_lookup_table((IBusEngine *)zhuyin);
+            ibus_zhuyin_engine_hide_lookup_table (zhuyin);
             ibus_zhuyin_engine_update_aux_text(zhuyin);
         }
     } else {
         zhuyin->valid = FALSE;
-        zhuyin->candidate_member = NULL;
+        zhuyin->candidates.pool = NULL;
         zhuyin->candidate_number = 0;
         zhuyin->page_max = 0;
-        ibus_engine_hide_lookup_table((IBusEngine *)zhuyin);
+        ibus_zhuyin_engine_hide_lookup_table (zhuyin);
         ibus_zhuyin_engine_update_aux_text(zhuyin);
     }
 }
@@ -928,287 +1551,142 @@ ibus_zhuyin_punctuation_phase (IBusZhuyinEngine *zhuyin,
             break;
     }
 
-    if (zhuyin->punctuation_candidate != NULL) {
-        g_strfreev(zhuyin->punctuation_candidate);
-        zhuyin->punctuation_candidate = NULL;
-    }
-
     if (punctuation == NULL) {
         return FALSE;
     }
 
-    zhuyin->punctuation_candidate = g_strsplit (punctuation, " ", 0);
-    zhuyin->candidate_number = g_strv_length (zhuyin->punctuation_candidate);
-    if (zhuyin->candidate_number > 1) {
-        zhuyin->candidate_member = zhuyin->punctuation_candidate;
-        zhuyin->display[0] = zhuyin->punctuation_candidate[0];
+    if (strchr (punctuation, ' ') != NULL) {
+        ibus_zhuyin_engine_split_candidates (zhuyin, punctuation);
+        zhuyin->table_key = TABLE_KEY (TABLE_KEY_PUNCTUATION, keyval);
+        zhuyin->display[0] = zhuyin_candidates_get (&zhuyin->candidates, 0);
         zhuyin->mode = IBUS_ZHUYIN_MODE_CANDIDATE;
         ibus_zhuyin_engine_redraw (zhuyin);
         ibus_zhuyin_engine_update_lookup_table (zhuyin);
         return TRUE;
     }
 
-    if (zhuyin->punctuation_candidate) {
-        g_strfreev(zhuyin->punctuation_candidate);
-        zhuyin->punctuation_candidate = NULL;
-    }
-
     /* commit the single punctuation */
     zhuyin->candidate_number = 0;
     ibus_zhuyin_engine_commit_string (zhuyin, punctuation);
     return TRUE;
 }
 
-static guint
-get_zhuyin_index(IBusZhuyinEngine *zhuyin, guint keyval, gint type)
+/* TRUE if putting key into stanza still leads to a syllable with candidates. */
+static gboolean
+is_zhuyin_reachable(guint stanza, const ZhuyinKey *key)
 {
-    if (zhuyin->layout == LAYOUT_STANDARD) {
-        if (type == 1) { // Initial
-            switch (keyval) {
-                case '1': return 1; case 'q': return 2; case 'a': return 3; case 'z': return 4;
-                case '2': return 5; case 'w': return 6; case 's': return 7; case 'x': return 8;
-                case 'e': return 9; case 'd': return 10; case 'c': return 11; case 'r': return 12;
-                case 'f': return 13; case 'v': return 14; case '5': return 15; case 't': return 16;
-                case 'g': return 17; case 'b': return 18; case 'y': return 19; case 'h': return 20;
-                case 'n': return 21;
-            }
-        } else if (type == 2) { // Medial
-            switch (keyval) {
-                case 'u': return 1; case 'j': return 2; case 'm': return 3;
-            }
-        } else if (type == 3) { // Final
-            switch (keyval) {
-                case '8': return 1; case 'i': return 2; case 'k': return 3; case ',': return 4;
-                case '9': return 5; case 'o': return 6; case 'l': return 7; case '.': return 8;
-                case '0': return 9; case 'p': return 10; case ';': return 11; case '/': return 12;
-                case '-': return 13;
-            }
-        } else if (type == 4) { // Tone
-            switch (keyval) {
-                case '6': return 1; case '3': return 2; case '4': return 3; case '7': return 4;
-            }
-        }
-    } else if (zhuyin->layout == LAYOUT_ETEN) { // Eten
-        if (type == 1) { // Initial
-            switch (keyval) {
-                case 'b': return 1; case 'p': return 2; case 'm': return 3; case 'f': return 4;
-                case 'd': return 5; case 't': return 6; case 'n': return 7; case 'l': return 8;
-                case 'v': return 9; case 'k': return 10; case 'h': return 11;
-                case 'g': return 12; case '7': return 13; case 'c': return 14;
-                case ',': return 15; case '.': return 16; case '/': return 17; case 'j': return 18;
-                case ';': return 19; case '\'': return 20; case 's': return 21;
-            }
-        } else if (type == 2) { // Medial
-            switch (keyval) {
-                case 'e': return 1; case 'x': return 2; case 'u': return 3;
-            }
-        } else if (type == 3) { // Final
-            switch (keyval) {
-                case 'a': return 1; case 'o': return 2; case 'r': return 3; case 'w': return 4;
-                case 'i': return 5; case 'q': return 6; case 'z': return 7; case 'y': return 8;
-                case '8': return 9; case '9': return 10; case '0': return 11; case '-': return 12;
-                case '=': return 13;
-            }
-        } else if (type == 4) { // Tone
-            switch (keyval) {
-                case '2': return 1; case '3': return 2; case '4': return 3; case '1': return 4;
-            }
-        }
-    } else { // Hsu
-        if (type == 1) { // Initial
-            switch (keyval) {
-                case 'b': return 1; case 'p': return 2; case 'm': return 3; case 'f': return 4;
-                case 'd': return 5; case 't': return 6; case 'n': return 7; case 'l': return 8;
-                case 'g': return 9; case 'k': return 10; case 'h': return 11;
-                case 'j': return 12; case 'v': return 13; case 'c': return 14;
-                case 'z': return 15; case 'a': return 16; case 's': return 17; case 'r': return 18;
-                case 'q': return 19; case 'w': return 20; case '2': return 21;
-            }
-        } else if (type == 2) { // Medial
-            switch (keyval) {
-                case 'e': return 1; case 'x': return 2; case 'u': return 3;
-            }
-        } else if (type == 3) { // Final
-            switch (keyval) {
-                case 'y': return 1; case 'h': return 2; case 'g': return 3; case '9': return 4;
-                case 'i': return 5; case 'a': return 6; case 'w': return 7; case 'o': return 8;
-                case 'm': return 9; case 'n': return 10; case 'k': return 11; case 'l': return 12;
-                case ',': return 13; // ㄦ
-            }
-        } else if (type == 4) { // Tone
-            switch (keyval) {
-                case '6': return 1; case '3': return 2; case '4': return 3; case '7': return 4;
-            }
-        }
+    return (zhuyin_reachable (stanza, key->slot) >> key->index) & 1;
+}
+
+/*
+ * Read keyval in the current keyboard.  On a keyboard like Hsu's where a key
+ * types both an initial and a final, take the final as soon as something is
+ * typed and it still leads to a syllable, or the initial no longer does.
+ */
+static const ZhuyinKey*
+get_zhuyin_key(IBusZhuyinEngine *zhuyin, guint keyval)
+{
+    const ZhuyinKey *key = zhuyin_keyboard_key (zhuyin->keyboard, keyval, FALSE);
+
+    if (key != NULL && zhuyin->keyboard->ambiguous) {
+        const ZhuyinKey *alternate = zhuyin_keyboard_key (zhuyin->keyboard, keyval, TRUE);
+        guint stanza = get_zhuyin_stanza (zhuyin);
+
+        if (alternate->slot != key->slot && stanza != 0 &&
+            (is_zhuyin_reachable (stanza, alternate) || !is_zhuyin_reachable (stanza, key)))
+            key = alternate;
     }
-    return 0;
+
+    return (key != NULL && key->slot != 0) ? key : NULL;
 }
 
-static void 
-get_zhuyin_guess(IBusZhuyinEngine *zhuyin, guint keyval, gboolean prefer_final, gchar **phonetic, gint *type)
+/* TRUE if keyval types a symbol that keeps the preedit on the way to a syllable. */
+static gboolean
+is_zhuyin_key_reachable(IBusZhuyinEngine *zhuyin, guint keyval)
 {
-    *phonetic = NULL;
-    *type = 0;
+    const ZhuyinKey *key = get_zhuyin_key (zhuyin, keyval);
 
-    if (zhuyin->layout == LAYOUT_STANDARD) {
-        // Standard Map Text
-        switch (keyval) {
-            case '1': *phonetic = "ㄅ"; *type = 1; break;
-            case 'q': *phonetic = "ㄆ"; *type = 1; break;
-            case 'a': *phonetic = "ㄇ"; *type = 1; break;
-            case 'z': *phonetic = "ㄈ"; *type = 1; break;
-            case '2': *phonetic = "ㄉ"; *type = 1; break;
-            case 'w': *phonetic = "ㄊ"; *type = 1; break;
-            case 's': *phonetic = "ㄋ"; *type = 1; break;
-            case 'x': *phonetic = "ㄌ"; *type = 1; break;
-            case 'e': *phonetic = "ㄍ"; *type = 1; break;
-            case 'd': *phonetic = "ㄎ"; *type = 1; break;
-            case 'c': *phonetic = "ㄏ"; *type = 1; break;
-            case 'r': *phonetic = "ㄐ"; *type = 1; break;
-            case 'f': *phonetic = "ㄑ"; *type = 1; break;
-            case 'v': *phonetic = "ㄒ"; *type = 1; break;
-            case '5': *phonetic = "ㄓ"; *type = 1; break;
-            case 't': *phonetic = "ㄔ"; *type = 1; break;
-            case 'g': *phonetic = "ㄕ"; *type = 1; break;
-            case 'b': *phonetic = "ㄖ"; *type = 1; break;
-            case 'y': *phonetic = "ㄗ"; *type = 1; break;
-            case 'h': *phonetic = "ㄘ"; *type = 1; break;
-            case 'n': *phonetic = "ㄙ"; *type = 1; break;
-            case 'u': *phonetic = "ㄧ"; *type = 2; break;
-            case 'j': *phonetic = "ㄨ"; *type = 2; break;
-            case 'm': *phonetic = "ㄩ"; *type = 2; break;
-            case '8': *phonetic = "ㄚ"; *type = 3; break;
-            case 'i': *phonetic = "ㄛ"; *type = 3; break;
-            case 'k': *phonetic = "ㄜ"; *type = 3; break;
-            case ',': *phonetic = "ㄝ"; *type = 3; break;
-            case '9': *phonetic = "ㄞ"; *type = 3; break;
-            case 'o': *phonetic = "ㄟ"; *type = 3; break;
-            case 'l': *phonetic = "ㄠ"; *type = 3; break;
-            case '.': *phonetic = "ㄡ"; *type = 3; break;
-            case '0': *phonetic = "ㄢ"; *type = 3; break;
-            case 'p': *phonetic = "ㄣ"; *type = 3; break;
-            case ';': *phonetic = "ㄤ"; *type = 3; break;
-            case '/': *phonetic = "ㄥ"; *type = 3; break;
-            case '-': *phonetic = "ㄦ"; *type = 3; break;
-            case '3': *phonetic = "ˇ"; *type = 4; break;
-            case '4': *phonetic = "ˋ"; *type = 4; break;
-            case '6': *phonetic = "ˊ"; *type = 4; break;
-            case '7': *phonetic = "˙"; *type = 4; break;
-        }
-        return;
+    return key != NULL && is_zhuyin_reachable (get_zhuyin_stanza (zhuyin), key);
+}
+
+/*
+ * Fill in the tone of a syllable said in one tone only, once nothing else
+ * can be typed into it.  Returns FALSE when the tone key is still needed.
+ */
+static gboolean
+infer_zhuyin_tone(IBusZhuyinEngine *zhuyin)
+{
+    guint stanza = get_zhuyin_stanza (zhuyin);
+    guint tones = zhuyin_tones (stanza);
+    guint slot, keyval;
+    gint tone;
+
+    if (tones == 0 || (tones & (tones - 1)) != 0)
+        return FALSE;
+
+    for (slot = ZHUYIN_SLOT_INITIAL; slot < ZHUYIN_SLOT_TONE; slot++) {
+        if (zhuyin->input[slot - 1] == 0 && zhuyin_reachable (stanza, slot) != 1)
+            return FALSE;
     }
 
-    if (zhuyin->layout == LAYOUT_ETEN) {
-        switch (keyval) {
-            case 'b': *phonetic = "ㄅ"; *type = 1; break;
-            case 'p': *phonetic = "ㄆ"; *type = 1; break;
-            case 'm': *phonetic = "ㄇ"; *type = 1; break;
-            case 'f': *phonetic = "ㄈ"; *type = 1; break;
-            case 'd': *phonetic = "ㄉ"; *type = 1; break;
-            case 't': *phonetic = "ㄊ"; *type = 1; break;
-            case 'n': *phonetic = "ㄋ"; *type = 1; break;
-            case 'l': *phonetic = "ㄌ"; *type = 1; break;
-            case 'v': *phonetic = "ㄍ"; *type = 1; break;
-            case 'k': *phonetic = "ㄎ"; *type = 1; break;
-            case 'h': *phonetic = "ㄏ"; *type = 1; break;
-            case 'g': *phonetic = "ㄐ"; *type = 1; break;
-            case '7': *phonetic = "ㄑ"; *type = 1; break;
-            case 'c': *phonetic = "ㄒ"; *type = 1; break;
-            case ',': *phonetic = "ㄓ"; *type = 1; break;
-            case '.': *phonetic = "ㄔ"; *type = 1; break;
-            case '/': *phonetic = "ㄕ"; *type = 1; break;
-            case 'j': *phonetic = "ㄖ"; *type = 1; break;
-            case ';': *phonetic = "ㄗ"; *type = 1; break;
-            case '\'': *phonetic = "ㄘ"; *type = 1; break;
-            case 's': *phonetic = "ㄙ"; *type = 1; break;
-            
-            case 'e': *phonetic = "ㄧ"; *type = 2; break;
-            case 'x': *phonetic = "ㄨ"; *type = 2; break;
-            case 'u': *phonetic = "ㄩ"; *type = 2; break;
-            
-            case 'a': *phonetic = "ㄚ"; *type = 3; break;
-            case 'o': *phonetic = "ㄛ"; *type = 3; break;
-            case 'r': *phonetic = "ㄜ"; *type = 3; break;
-            case 'w': *phonetic = "ㄝ"; *type = 3; break;
-            case 'i': *phonetic = "ㄞ"; *type = 3; break;
-            case 'q': *phonetic = "ㄟ"; *type = 3; break;
-            case 'z': *phonetic = "ㄠ"; *type = 3; break;
-            case 'y': *phonetic = "ㄡ"; *type = 3; break;
-            case '8': *phonetic = "ㄢ"; *type = 3; break;
-            case '9': *phonetic = "ㄣ"; *type = 3; break;
-            case '0': *phonetic = "ㄤ"; *type = 3; break;
-            case '-': *phonetic = "ㄥ"; *type = 3; break;
-            case '=': *phonetic = "ㄦ"; *type = 3; break;
-            
-            case '2': *phonetic = "ˊ"; *type = 4; break;
-            case '3': *phonetic = "ˇ"; *type = 4; break;
-            case '4': *phonetic = "ˋ"; *type = 4; break;
-            case '1': *phonetic = "˙"; *type = 4; break;
+    tone = g_bit_nth_lsf (tones, -1);
+    zhuyin->input[3] = 0;
+    zhuyin->display[3] = NULL;
+    for (keyval = 0; tone > 0 && keyval < ZHUYIN_KEYBOARD_SIZE; keyval++) {
+        if (zhuyin_keyboard_index (zhuyin->keyboard, keyval, ZHUYIN_SLOT_TONE) == (guint) tone) {
+            zhuyin->input[3] = keyval;
+            zhuyin->display[3] = zhuyin->keyboard->key[keyval].symbol;
+            break;
         }
-        return;
     }
+    zhuyin->inferred_tone = tone;
+    return TRUE;
+}
 
-    // Hsu's Layout Text
-    switch(keyval) {
-        case 'b': *phonetic = "ㄅ"; *type = 1; break;
-        case 'p': *phonetic = "ㄆ"; *type = 1; break;
-        case 'm': 
-            if (prefer_final) { *phonetic = "ㄢ"; *type = 3; }
-            else { *phonetic = "ㄇ"; *type = 1; }
-            break;
-        case 'f': *phonetic = "ㄈ"; *type = 1; break;
-        case 'd': *phonetic = "ㄉ"; *type = 1; break;
-        case 't': *phonetic = "ㄊ"; *type = 1; break;
-        case 'n': 
-            if (prefer_final) { *phonetic = "ㄣ"; *type = 3; }
-            else { *phonetic = "ㄋ"; *type = 1; }
-            break;
-        case 'l': 
-            if (prefer_final) { *phonetic = "ㄥ"; *type = 3; }
-            else { *phonetic = "ㄌ"; *type = 1; }
-            break;
-        case 'g': 
-            if (prefer_final) { *phonetic = "ㄜ"; *type = 3; }
-            else { *phonetic = "ㄍ"; *type = 1; }
-            break;
-        case 'k': 
-            if (prefer_final) { *phonetic = "ㄤ"; *type = 3; }
-            else { *phonetic = "ㄎ"; *type = 1; }
-            break;
-        case 'h': 
-            if (prefer_final) { *phonetic = "ㄛ"; *type = 3; }
-            else { *phonetic = "ㄏ"; *type = 1; }
-            break;
-        case 'j': *phonetic = "ㄐ"; *type = 1; break;
-        case 'v': *phonetic = "ㄑ"; *type = 1; break;
-        case 'c': *phonetic = "ㄒ"; *type = 1; break;
-        case 'z': *phonetic = "ㄓ"; *type = 1; break;
-        case 'a': 
-            if (prefer_final) { *phonetic = "ㄟ"; *type = 3; }
-            else { *phonetic = "ㄔ"; *type = 1; }
-            break;
-        case 's': *phonetic = "ㄕ"; *type = 1; break;
-        case 'x': *phonetic = "ㄨ"; *type = 2; break;
-        case 'r': *phonetic = "ㄖ"; *type = 1; break;
-        case 'q': *phonetic = "ㄗ"; *type = 1; break;
-        case 'w': 
-            if (prefer_final) { *phonetic = "ㄠ"; *type = 3; }
-            else { *phonetic = "ㄘ"; *type = 1; }
-            break;
-        case '2': *phonetic = "ㄙ"; *type = 1; break;
-        
-        case 'e': *phonetic = "ㄧ"; *type = 2; break;
-        case 'u': *phonetic = "ㄩ"; *type = 2; break;
-        case 'y': *phonetic = "ㄚ"; *type = 3; break;
-        case 'i': *phonetic = "ㄞ"; *type = 3; break;
-        case 'o': *phonetic = "ㄡ"; *type = 3; break;
-        case '9': *phonetic = "ㄝ"; *type = 3; break; 
-        case ',': *phonetic = "ㄦ"; *type = 3; break;
-        
-        case '3': *phonetic = "ˇ"; *type = 4; break;
-        case '4': *phonetic = "ˋ"; *type = 4; break;
-        case '6': *phonetic = "ˊ"; *type = 4; break;
-        case '7': *phonetic = "˙"; *type = 4; break;
+/* TRUE for the tone key, or Space for the first tone, typed after the tone was inferred. */
+static gboolean
+is_zhuyin_inferred_tone_key(IBusZhuyinEngine *zhuyin, guint keyval, guint modifiers)
+{
+    const ZhuyinKey *key = zhuyin_keyboard_key (zhuyin->keyboard, keyval, FALSE);
+    gint tone = zhuyin->inferred_tone;
+
+    zhuyin->inferred_tone = -1;
+    if (tone < 0 || modifiers != 0)
+        return FALSE;
+    if (keyval == IBUS_space)
+        return tone == 0;
+    return key != NULL && key->slot == ZHUYIN_SLOT_TONE && key->index == tone;
+}
+
+/*
+ * Light the key caps of the punctuation window that type a symbol the
+ * preedit can go on with, so the reachable keys show at a glance.
+ */
+static void
+update_punctuation_key_hints(IBusZhuyinEngine *zhuyin)
+{
+    gint i, j;
+
+    if (punctuation_window == NULL)
+        return;
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 14 && global_physical_keys[i][j] != NULL; j++) {
+            gboolean reachable = zhuyin->preedit->len > 0 &&
+                                 is_zhuyin_key_reachable(zhuyin, global_physical_keys[i][j][0]);
+            gchar markup[128];
+
+            /* most keys stay as they were, and pango allocates for every markup */
+            if (global_physical_lit[i][j] == reachable)
+                continue;
+            global_physical_lit[i][j] = reachable;
+
+            g_snprintf(markup, sizeof (markup), reachable ?
+                       "<span size='x-small' foreground='#3465a4' weight='bold'>%s</span>" :
+                       "<span size='x-small' foreground='#888888'>%s</span>",
+                       global_physical_keys[i][j]);
+            gtk_label_set_markup(GTK_LABEL(global_physical_labels[i][j]), markup);
+        }
     }
 }
 
@@ -1218,50 +1696,30 @@ ibus_zhuyin_preedit_phase (IBusZhuyinEngine *zhuyin,
                            guint             keycode,
                            guint             modifiers)
 {
-    gchar* phonetic = NULL;
+    const ZhuyinKey *key = NULL;
+    const gchar* phonetic = NULL;
     gint   type = 0;
 
-    // Handle Space re-interpretation properly
-    if (keyval == IBUS_space && !zhuyin->valid && zhuyin->layout == LAYOUT_HSU) {
-        guint k = zhuyin->input[0];
-        if (k != 0 && zhuyin->input[1] == 0 && zhuyin->input[2] == 0 && zhuyin->input[3] == 0) {
-            gchar *p = NULL;
-            gint t = 0;
-            // Force re-check as final
-            get_zhuyin_guess(zhuyin, k, TRUE, &p, &t);
-            if (t > 1 && p != NULL) {
-                 zhuyin->input[0] = 0;
-                 zhuyin->display[0] = NULL;
-                 zhuyin->input[t-1] = k;
-                 zhuyin->display[t-1] = p;
-                 
-                 ibus_zhuyin_engine_redraw(zhuyin);
-                 _update_candidates(zhuyin);
-            }
-        }
-    }
-
     switch (keyval) {
         case IBUS_space:
-            g_print("Space pressed. Layout: %d, Input[0]: %d\n", zhuyin->layout, zhuyin->input[0]);
-            // Handle Hsu's ambiguity re-interpretation on Space
-            if (zhuyin->layout == LAYOUT_HSU && zhuyin->input[0] != 0 && zhuyin->input[1] == 0 && zhuyin->input[2] == 0 && zhuyin->input[3] == 0) {
-                 g_print("Attempting re-interpretation...\n");
-                 gchar *p = NULL;
-                 gint t = 0;
-                 get_zhuyin_guess(zhuyin, zhuyin->input[0], TRUE, &p, &t);
-                 
-                 g_print("Guess result: p=%s, t=%d\n", p, t);
-                 
-                 if (t > 1 && p != NULL) {
-                     zhuyin->input[t-1] = zhuyin->input[0]; 
-                     zhuyin->input[0] = 0;
-                     zhuyin->display[t-1] = p;
-                     zhuyin->display[0] = NULL;
-                     
-                     // Re-calculate stanza
-                     _update_candidates(zhuyin);
-                 }
+            /* a lone shared key followed by Space is its final, like ㄟ on Hsu's 'a' */
+            if (zhuyin->keyboard->ambiguous && zhuyin->input[0] != 0 &&
+                zhuyin->input[1] == 0 && zhuyin->input[2] == 0 && zhuyin->input[3] == 0) {
+                key = zhuyin_keyboard_key (zhuyin->keyboard, zhuyin->input[0], TRUE);
+                if (key->slot != ZHUYIN_SLOT_INITIAL && zhuyin_is_valid ((guint) key->index << ((key->slot - 1) * 8))) {
+                    zhuyin->input[key->slot - 1] = zhuyin->input[0];
+                    zhuyin->display[key->slot - 1] = key->symbol;
+                    zhuyin->input[0] = 0;
+                    zhuyin->display[0] = NULL;
+                    ibus_zhuyin_engine_redraw (zhuyin);
+                    _update_candidates(zhuyin);
+                }
+            }
+
+            /* Space is the first tone, narrow the tone-less quick match down to it */
+            if (zhuyin->valid == TRUE && zhuyin->enable_quick_match) {
+                zhuyin->mode = IBUS_ZHUYIN_MODE_CANDIDATE;
+                _update_candidates(zhuyin);
             }
 
             if (zhuyin->valid == TRUE) {
@@ -1277,7 +1735,7 @@ ibus_zhuyin_preedit_phase (IBusZhuyinEngine *zhuyin,
                     }
                     if (zhuyin->input[0] == 0)
                         zhuyin->input[0] = 1;
-                    zhuyin->display[0] = zhuyin->candidate_member[0];
+                    zhuyin->display[0] = zhuyin_candidates_get (&zhuyin->candidates, 0);
                     ibus_zhuyin_engine_redraw (zhuyin);
                     zhuyin->display[0] = NULL;
                     return ibus_zhuyin_engine_commit_preedit (zhuyin);
@@ -1319,7 +1777,7 @@ ibus_zhuyin_preedit_phase (IBusZhuyinEngine *zhuyin,
 
     if (modifiers & IBUS_SHIFT_MASK) {
         gint candidate = -1;
-        gint index = ibus_lookup_table_get_cursor_pos(zhuyin->table);
+        gint index = zhuyin->cursor;
         gint page = index / zhuyin->page_size;
         switch (keyval) {
             case IBUS_1: case IBUS_exclam: case IBUS_a: case IBUS_A: candidate = page * zhuyin->page_size; break;
@@ -1337,16 +1795,14 @@ ibus_zhuyin_preedit_phase (IBusZhuyinEngine *zhuyin,
         }
     }
 
-    gboolean prefer_final = FALSE;
-    if (zhuyin->layout == LAYOUT_HSU) {
-        // If we have an initial (input[0]), prefer final for next key
-        if (zhuyin->input[0] != 0) prefer_final = TRUE;
-        // Also if input[1] or [2] is set?
-        // zhuyin->input is array of keyvals.
-        // If prefer_final is true, we try to map to 2 or 3.
+    key = get_zhuyin_key(zhuyin, keyval);
+    if (key != NULL) {
+        /* no syllable goes this way, so keep the preedit as it is */
+        if (!is_zhuyin_reachable(get_zhuyin_stanza(zhuyin), key))
+            return TRUE;
+        phonetic = key->symbol;
+        type = key->slot;
     }
-    
-    get_zhuyin_guess(zhuyin, keyval, prefer_final, &phonetic, &type);
 
     if (type > 0) {
         guint i = 0;
@@ -1354,6 +1810,10 @@ ibus_zhuyin_preedit_phase (IBusZhuyinEngine *zhuyin,
         zhuyin->display[type - 1] = phonetic;
         zhuyin->input[type - 1] = keyval;
 
+        /* a syllable said in one tone only goes on as if its tone was typed */
+        if (type != 4 && zhuyin->enable_tone_inference && infer_zhuyin_tone (zhuyin))
+            type = 4;
+
         ibus_zhuyin_engine_redraw (zhuyin);
 
         if (type == 4) {
@@ -1364,8 +1824,11 @@ ibus_zhuyin_preedit_phase (IBusZhuyinEngine *zhuyin,
 
         /* directly commit when only one candidate. */
         if (type == 4 && zhuyin->candidate_number == 1) {
-            ibus_zhuyin_engine_commit_string (zhuyin, zhuyin->candidate_member[0]);
+            gint tone = zhuyin->inferred_tone;
+
+            ibus_zhuyin_engine_commit_string (zhuyin, zhuyin_candidates_get (&zhuyin->candidates, 0));
             ibus_zhuyin_engine_reset ((IBusEngine *)zhuyin);
+            zhuyin->inferred_tone = tone;
         }
         return TRUE;
     }
@@ -1379,50 +1842,50 @@ ibus_zhuyin_preedit_phase (IBusZhuyinEngine *zhuyin,
         switch (keyval) {
             case IBUS_Up:
                 if (orientation == IBUS_ORIENTATION_VERTICAL) {
-                    ibus_lookup_table_cursor_up(zhuyin->table);
+                    ibus_zhuyin_engine_cursor_up(zhuyin);
                 } else {
-                    ibus_lookup_table_page_up(zhuyin->table);
+                    ibus_zhuyin_engine_page_up_cursor(zhuyin);
                 }
                 _update_lookup_table_and_aux_text (zhuyin);
                 return TRUE;
             case IBUS_Down:
                 if (orientation == IBUS_ORIENTATION_VERTICAL) {
-                    ibus_lookup_table_cursor_down(zhuyin->table);
+                    ibus_zhuyin_engine_cursor_down(zhuyin);
                 } else {
-                    ibus_lookup_table_page_down(zhuyin->table);
+                    ibus_zhuyin_engine_page_down_cursor(zhuyin);
                 }
                 _update_lookup_table_and_aux_text (zhuyin);
                 return TRUE;
             case IBUS_Page_Up:
-                ibus_lookup_table_page_up(zhuyin->table);
+                ibus_zhuyin_engine_page_up_cursor(zhuyin);
                 _update_lookup_table_and_aux_text (zhuyin);
                 return TRUE;
             case IBUS_Page_Down:
-                ibus_lookup_table_page_down(zhuyin->table);
+                ibus_zhuyin_engine_page_down_cursor(zhuyin);
                 _update_lookup_table_and_aux_text (zhuyin);
                 return TRUE;
             case IBUS_Left:
                 if (orientation == IBUS_ORIENTATION_HORIZONTAL) {
-                    ibus_lookup_table_cursor_up(zhuyin->table);
+                    ibus_zhuyin_engine_cursor_up(zhuyin);
                 } else {
-                    ibus_lookup_table_page_up(zhuyin->table);
+                    ibus_zhuyin_engine_page_up_cursor(zhuyin);
                 }
                 _update_lookup_table_and_aux_text (zhuyin);
                 return TRUE;
             case IBUS_Right:
                 if (orientation == IBUS_ORIENTATION_HORIZONTAL) {
-                    ibus_lookup_table_cursor_down(zhuyin->table);
+                    ibus_zhuyin_engine_cursor_down(zhuyin);
                 } else {
-                    ibus_lookup_table_page_down(zhuyin->table);
+                    ibus_zhuyin_engine_page_down_cursor(zhuyin);
                 }
                 _update_lookup_table_and_aux_text (zhuyin);
                 return TRUE;
             case IBUS_Home:
-                ibus_lookup_table_set_cursor_pos(zhuyin->table, 0);
+                ibus_zhuyin_engine_set_cursor(zhuyin, 0);
                 _update_lookup_table_and_aux_text (zhuyin);
                 return TRUE;
             case IBUS_End:
-                ibus_lookup_table_set_cursor_pos(zhuyin->table, zhuyin->candidate_number - 1);
+                ibus_zhuyin_engine_set_cursor(zhuyin, zhuyin->candidate_number - 1);
                 _update_lookup_table_and_aux_text (zhuyin);
                 return TRUE;
         }
@@ -1431,121 +1894,6 @@ ibus_zhuyin_preedit_phase (IBusZhuyinEngine *zhuyin,
     return FALSE;
 }
 
-static void
-get_zhuyin_hsu(guint keyval, gboolean prefer_final, gchar **phonetic, gint *type)
-{
-    *phonetic = NULL;
-    *type = 0;
-    
-    // Tones (Natural/Hsu often use standard numbers or letters)
-    // S=˙, D=ˊ, F=ˇ, J=ˋ, Space=1
-    // BUT we need to support standard number keys for tones too as fallback?
-    // Let's stick to the letters mentioned in search result first, plus standard numbers if they don't conflict.
-    
-    switch(keyval) {
-        case 'b': *phonetic = "ㄅ"; *type = 1; break;
-        case 'p': *phonetic = "ㄆ"; *type = 1; break;
-        case 'm': 
-            if (prefer_final) { *phonetic = "ㄢ"; *type = 3; }
-            else { *phonetic = "ㄇ"; *type = 1; }
-            break;
-        case 'f': *phonetic = "ㄈ"; *type = 1; break; // F is ㄈ. Tone 3 is F?
-            // If F is Tone 3, it conflicts.
-            // Usually Tone keys are only active if there is a syllable pending.
-            // But F is Initial ㄈ.
-            // Let's assume standard number keys for Tones for now to avoid conflict, unless confirmed.
-            // Search result said: "聲調符號...對應 S D F G H J".
-            // S=˙, D=ˊ, F=ˇ, G=ㄜ, H=ㄛ, J=ˋ.
-            // Wait, G and H are finals?
-            // If I type `ㄅ` (B) + `ˇ` (F)?
-            // If `input[0]` is set, F might be Tone?
-            // But F is ㄈ.
-            // Ambiguity: Initial vs Tone.
-            // Usually Tone is only valid at the end.
-            // If I type B F, is it ㄅㄈ (Invalid) or ㄅˇ?
-            // I will implement Tone mapping ONLY if prefer_final is TRUE (or strictly, if we are expecting tone).
-            // But prefer_final is for Medial/Final.
-            break;
-            
-        case 'd': *phonetic = "ㄉ"; *type = 1; break; // D=ˊ (Tone 2)
-        case 't': *phonetic = "ㄊ"; *type = 1; break;
-        case 'n': 
-            if (prefer_final) { *phonetic = "ㄣ"; *type = 3; }
-            else { *phonetic = "ㄋ"; *type = 1; }
-            break;
-        case 'l': 
-            if (prefer_final) { *phonetic = "ㄥ"; *type = 3; } // Or ㄦ?
-            else { *phonetic = "ㄌ"; *type = 1; }
-            break;
-        case 'g': 
-            if (prefer_final) { *phonetic = "ㄜ"; *type = 3; }
-            else { *phonetic = "ㄍ"; *type = 1; }
-            break;
-        case 'k': 
-            if (prefer_final) { *phonetic = "ㄤ"; *type = 3; }
-            else { *phonetic = "ㄎ"; *type = 1; }
-            break;
-        case 'h': 
-            if (prefer_final) { *phonetic = "ㄛ"; *type = 3; }
-            else { *phonetic = "ㄏ"; *type = 1; }
-            break;
-        case 'j': 
-            // J=ㄐ or Tone 4?
-            *phonetic = "ㄐ"; *type = 1; 
-            break;
-        case 'v': *phonetic = "ㄑ"; *type = 1; break;
-        case 'c': *phonetic = "ㄒ"; *type = 1; break;
-            
-        case 'z': *phonetic = "ㄓ"; *type = 1; break;
-        case 'a': 
-            if (prefer_final) { *phonetic = "ㄟ"; *type = 3; }
-            else { *phonetic = "ㄔ"; *type = 1; }
-            break;
-        case 's': 
-            // S=ㄕ or Tone 5?
-            *phonetic = "ㄕ"; *type = 1; 
-            break;
-        case 'x': 
-             // X=ㄖ or ㄨ? Snippet said R=ㄖ, X=ㄨ.
-             *phonetic = "ㄨ"; *type = 2; 
-             break;
-        case 'r': *phonetic = "ㄖ"; *type = 1; break;
-        
-        case 'q': *phonetic = "ㄗ"; *type = 1; break;
-        case 'w': 
-            if (prefer_final) { *phonetic = "ㄠ"; *type = 3; }
-            else { *phonetic = "ㄘ"; *type = 1; }
-            break;
-        case '2': *phonetic = "ㄙ"; *type = 1; break; // Using 2 for ㄙ
-        
-        // Vowels
-        case 'e': *phonetic = "ㄧ"; *type = 2; break;
-        case 'u': *phonetic = "ㄩ"; *type = 2; break;
-        case 'y': *phonetic = "ㄚ"; *type = 3; break;
-        case 'i': *phonetic = "ㄞ"; *type = 3; break;
-        case 'o': *phonetic = "ㄡ"; *type = 3; break;
-        
-        // Tones (Standard)
-        case '3': *phonetic = "ˇ"; *type = 4; break;
-        case '4': *phonetic = "ˋ"; *type = 4; break;
-        case '6': *phonetic = "ˊ"; *type = 4; break;
-        case '7': *phonetic = "˙"; *type = 4; break;
-    }
-    
-    // Tones on letters (overrides if prefer_final is true/or handled separately?)
-    // If I map 'd' to Tone 2 here, I lose 'ㄉ'.
-    // I will stick to standard number tones for safety unless user strictly asks for letter tones.
-    // The prompt just said "Hsu's Zhuyin support".
-    // I'll add the tone letters ONLY if they are not conflicting or if they are purely tones.
-    // S=˙ (Conflict ㄕ)
-    // D=ˊ (Conflict ㄉ)
-    // F=ˇ (Conflict ㄈ)
-    // J=ˋ (Conflict ㄐ)
-    
-    // I will NOT add letter tones to avoid ambiguity without a more complex state machine.
-    // Users can use standard 3,4,6,7.
-}
-
 static gboolean
 ibus_zhuyin_candidate_phase (IBusZhuyinEngine *zhuyin,
                              guint             keyval,
@@ -1554,7 +1902,7 @@ ibus_zhuyin_candidate_phase (IBusZhuyinEngine *zhuyin,
 {
     /* Choose candidate character */
     gint candidate = -1;
-    gint index = ibus_lookup_table_get_cursor_pos(zhuyin->table);
+    gint index = zhuyin->cursor;
     gint page = index / zhuyin->page_size;
     switch (keyval) {
         case IBUS_1:
@@ -1610,11 +1958,13 @@ ibus_zhuyin_candidate_phase (IBusZhuyinEngine *zhuyin,
 
     if (modifiers == IBUS_CONTROL_MASK && keyval == IBUS_a) {
         ibus_engine_show_preedit_text ((IBusEngine *) zhuyin);
+        ibus_zhuyin_engine_emitted (zhuyin, ZHUYIN_TRACE_PREEDIT);
         return TRUE;
     }
 
     if (modifiers == IBUS_CONTROL_MASK && keyval == IBUS_b) {
         ibus_engine_hide_preedit_text ((IBusEngine *) zhuyin);
+        ibus_zhuyin_engine_emitted (zhuyin, ZHUYIN_TRACE_PREEDIT);
         return TRUE;
     }
 
@@ -1633,7 +1983,7 @@ ibus_zhuyin_candidate_phase (IBusZhuyinEngine *zhuyin,
 
     switch (keyval) {
         case IBUS_Return: {
-            gint index = ibus_lookup_table_get_cursor_pos(zhuyin->table);
+            gint index = zhuyin->cursor;
             if (index < zhuyin->candidate_number) {
                 return ibus_zhuyin_engine_commit_candidate (zhuyin, index);
             }
@@ -1651,62 +2001,62 @@ ibus_zhuyin_candidate_phase (IBusZhuyinEngine *zhuyin,
 
         case IBUS_Up:
             if (orientation == IBUS_ORIENTATION_VERTICAL) {
-                ibus_lookup_table_cursor_up(zhuyin->table);
+                ibus_zhuyin_engine_cursor_up(zhuyin);
             } else { // HORIZONTAL
-                ibus_lookup_table_page_up(zhuyin->table);
+                ibus_zhuyin_engine_page_up_cursor(zhuyin);
             }
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Down:
             if (orientation == IBUS_ORIENTATION_VERTICAL) {
-                ibus_lookup_table_cursor_down(zhuyin->table);
+                ibus_zhuyin_engine_cursor_down(zhuyin);
             } else { // HORIZONTAL
-                ibus_lookup_table_page_down(zhuyin->table);
+                ibus_zhuyin_engine_page_down_cursor(zhuyin);
             }
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Left:
             if (orientation == IBUS_ORIENTATION_HORIZONTAL) {
-                ibus_lookup_table_cursor_up(zhuyin->table);
+                ibus_zhuyin_engine_cursor_up(zhuyin);
             } else { // VERTICAL
-                ibus_lookup_table_page_up(zhuyin->table);
+                ibus_zhuyin_engine_page_up_cursor(zhuyin);
             }
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Right:
             if (orientation == IBUS_ORIENTATION_HORIZONTAL) {
-                ibus_lookup_table_cursor_down(zhuyin->table);
+                ibus_zhuyin_engine_cursor_down(zhuyin);
             } else { // VERTICAL
-                ibus_lookup_table_page_down(zhuyin->table);
+                ibus_zhuyin_engine_page_down_cursor(zhuyin);
             }
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Page_Up:
-            ibus_lookup_table_page_up(zhuyin->table);
+            ibus_zhuyin_engine_page_up_cursor(zhuyin);
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Page_Down:
-            ibus_lookup_table_page_down(zhuyin->table);
+            ibus_zhuyin_engine_page_down_cursor(zhuyin);
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Home:
-            ibus_lookup_table_set_cursor_pos(zhuyin->table, 0);
+            ibus_zhuyin_engine_set_cursor(zhuyin, 0);
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_End: {
-            ibus_lookup_table_set_cursor_pos(zhuyin->table, zhuyin->candidate_number - 1);
+            ibus_zhuyin_engine_set_cursor(zhuyin, zhuyin->candidate_number - 1);
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
         }
         case IBUS_space:
-            ibus_lookup_table_page_down(zhuyin->table);
+            ibus_zhuyin_engine_page_down_cursor(zhuyin);
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
@@ -1752,18 +2102,13 @@ ibus_zhuyin_leading_phase (IBusZhuyinEngine *zhuyin,
         zhuyin->mode = IBUS_ZHUYIN_MODE_NORMAL;
         return ibus_zhuyin_preedit_phase(zhuyin, keyval, keycode, modifiers);
     }
-    if (zhuyin->punctuation_candidate != NULL) {
-        g_strfreev(zhuyin->punctuation_candidate);
-        zhuyin->punctuation_candidate = NULL;
-    }
-    zhuyin->punctuation_candidate = g_strsplit (punctuation, " ", 0);
-    zhuyin->candidate_number = g_strv_length (zhuyin->punctuation_candidate);
+    ibus_zhuyin_engine_split_candidates (zhuyin, punctuation);
+    zhuyin->table_key = TABLE_KEY (TABLE_KEY_LEADING, keyval);
     if (zhuyin->candidate_number % zhuyin->page_size)
         zhuyin->page_max = zhuyin->candidate_number / zhuyin->page_size;
     else
         zhuyin->page_max = zhuyin->candidate_number / zhuyin->page_size - 1;
-    zhuyin->candidate_member = zhuyin->punctuation_candidate;
-    zhuyin->display[0] = zhuyin->punctuation_candidate[0];
+    zhuyin->display[0] = zhuyin_candidates_get (&zhuyin->candidates, 0);
     zhuyin->mode = IBUS_ZHUYIN_MODE_CANDIDATE;
     ibus_zhuyin_engine_redraw (zhuyin);
     ibus_zhuyin_engine_update_lookup_table (zhuyin);
@@ -1778,7 +2123,7 @@ ibus_zhuyin_phrase_phase (IBusZhuyinEngine *zhuyin,
 {
     /* Choose candidate character */
     gint candidate = -1;
-    gint index = ibus_lookup_table_get_cursor_pos(zhuyin->table);
+    gint index = zhuyin->cursor;
     gint page = index / zhuyin->page_size;
 
     if ((keyval >= IBUS_Shift_L && keyval <= IBUS_Hyper_R) ||
@@ -1878,58 +2223,58 @@ ibus_zhuyin_phrase_phase (IBusZhuyinEngine *zhuyin,
 
         case IBUS_Up:
             if (orientation == IBUS_ORIENTATION_VERTICAL) {
-                ibus_lookup_table_cursor_up(zhuyin->table);
+                ibus_zhuyin_engine_cursor_up(zhuyin);
             } else { // HORIZONTAL
-                ibus_lookup_table_page_up(zhuyin->table);
+                ibus_zhuyin_engine_page_up_cursor(zhuyin);
             }
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Down:
             if (orientation == IBUS_ORIENTATION_VERTICAL) {
-                ibus_lookup_table_cursor_down(zhuyin->table);
+                ibus_zhuyin_engine_cursor_down(zhuyin);
             } else { // HORIZONTAL
-                ibus_lookup_table_page_down(zhuyin->table);
+                ibus_zhuyin_engine_page_down_cursor(zhuyin);
             }
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Left:
             if (orientation == IBUS_ORIENTATION_HORIZONTAL) {
-                ibus_lookup_table_cursor_up(zhuyin->table);
+                ibus_zhuyin_engine_cursor_up(zhuyin);
             } else { // VERTICAL
-                ibus_lookup_table_page_up(zhuyin->table);
+                ibus_zhuyin_engine_page_up_cursor(zhuyin);
             }
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Right:
             if (orientation == IBUS_ORIENTATION_HORIZONTAL) {
-                ibus_lookup_table_cursor_down(zhuyin->table);
+                ibus_zhuyin_engine_cursor_down(zhuyin);
             } else { // VERTICAL
-                ibus_lookup_table_page_down(zhuyin->table);
+                ibus_zhuyin_engine_page_down_cursor(zhuyin);
             }
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Page_Up:
-            ibus_lookup_table_page_up(zhuyin->table);
+            ibus_zhuyin_engine_page_up_cursor(zhuyin);
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Page_Down:
         case IBUS_space:
-            ibus_lookup_table_page_down(zhuyin->table);
+            ibus_zhuyin_engine_page_down_cursor(zhuyin);
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_Home:
-            ibus_lookup_table_set_cursor_pos(zhuyin->table, 0);
+            ibus_zhuyin_engine_set_cursor(zhuyin, 0);
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
 
         case IBUS_End: {
-            ibus_lookup_table_set_cursor_pos(zhuyin->table, zhuyin->candidate_number - 1);
+            ibus_zhuyin_engine_set_cursor(zhuyin, zhuyin->candidate_number - 1);
             _update_lookup_table_and_aux_text (zhuyin);
             return TRUE;
         }
@@ -1949,17 +2294,13 @@ ibus_zhuyin_phrase_phase (IBusZhuyinEngine *zhuyin,
  * @return TRUE if the key was handled, FALSE otherwise
  */
 static gboolean
-ibus_zhuyin_engine_process_key_event (IBusEngine *engine,
-                                       guint       keyval,
-                                       guint       keycode,
-                                       guint       modifiers)
+ibus_zhuyin_engine_handle_key_event (IBusEngine *engine,
+                                      guint       keyval,
+                                      guint       keycode,
+                                      guint       modifiers)
 {
     IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
 
-    /* Ignore key release event */
-    if (modifiers & IBUS_RELEASE_MASK)
-        return FALSE;
-
     if ((modifiers & (IBUS_CONTROL_MASK | IBUS_MOD1_MASK)) == (IBUS_CONTROL_MASK | IBUS_MOD1_MASK) && keyval == IBUS_comma) {
         if (!punctuation_window) {
             g_idle_add(create_punctuation_window_idle, engine);
@@ -2008,6 +2349,10 @@ ibus_zhuyin_engine_process_key_event (IBusEngine *engine,
         return TRUE;
     }
 
+    /* the tone key typed out of habit after tone inference filled it in */
+    if (is_zhuyin_inferred_tone_key(zhuyin, keyval, modifiers))
+        return TRUE;
+
     switch (zhuyin->mode) {
         case IBUS_ZHUYIN_MODE_NORMAL:
             if (zhuyin->preedit->len == 0) {
@@ -2049,50 +2394,139 @@ ibus_zhuyin_engine_process_key_event (IBusEngine *engine,
     return TRUE;
 }
 
+/* Put a key handled into the trace, for a look at it when the engine lagged. */
+static void
+ibus_zhuyin_engine_trace (IBusZhuyinEngine *zhuyin,
+                          guint             keyval,
+                          guint             modifiers,
+                          guint             mode,
+                          gboolean          handled,
+                          gint64            start)
+{
+    ZhuyinTraceEvent event;
+
+    event.time = start;
+    event.duration = zhuyin_stats_now () - start;
+    event.keyval = keyval;
+    event.modifiers = modifiers;
+    event.stanza = get_zhuyin_stanza (zhuyin);
+    event.candidates = zhuyin->table_visible ? zhuyin->candidate_number : 0;
+    event.mode_before = mode;
+    event.mode_after = zhuyin->mode;
+    event.emitted = MIN (zhuyin->emitted, G_MAXUINT8);
+    event.calls = zhuyin->calls;
+    event.handled = handled != FALSE;
+    zhuyin_trace_record (&event);
+}
+
+static gboolean
+ibus_zhuyin_engine_process_key_event (IBusEngine *engine,
+                                       guint       keyval,
+                                       guint       keycode,
+                                       guint       modifiers)
+{
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    gboolean retval;
+
+    gint64 now;
+    gboolean burst;
+    gint64 start, phase_start, trace_start;
+    ZhuyinStatsPhase phase;
+    guint mode;
+
+    /* Ignore key release event */
+    if (modifiers & IBUS_RELEASE_MASK)
+        return FALSE;
+
+    start = ZHUYIN_STATS_START ();
+    trace_start = G_UNLIKELY (zhuyin_trace_enabled) ? zhuyin_stats_now () : 0;
+    ibus_zhuyin_engine_reload_config (engine);
+    mode = zhuyin->mode;
+    now = g_get_monotonic_time ();
+    burst = now - zhuyin->key_time < zhuyin->burst_time;
+    zhuyin->key_time = now;
+
+    zhuyin->emitted = 0;
+    zhuyin->calls = 0;
+    zhuyin->in_key_event = TRUE;
+    phase = stats_phases[mode];
+    phase_start = ZHUYIN_STATS_START ();
+    retval = ibus_zhuyin_engine_handle_key_event (engine, keyval, keycode, modifiers);
+    ZHUYIN_STATS_STOP (phase, phase_start);
+    zhuyin->in_key_event = FALSE;
+
+    /*
+     * Keys that come faster than a frame, held down or typed by a program,
+     * are handled right away but shown once a frame, as the last of them
+     * left it.  Text committed reaches the client at once, so the preedit
+     * it came from goes along with it.
+     */
+    if (burst && zhuyin->dirty != 0 && !(zhuyin->calls & ZHUYIN_TRACE_COMMIT)) {
+        if (g_source_get_ready_time (zhuyin->flush_source) == -1)
+            g_source_set_ready_time (zhuyin->flush_source, now + BURST_FRAME_TIME);
+    } else {
+        ibus_zhuyin_engine_flush (zhuyin);
+    }
+
+    ZHUYIN_STATS_STOP (ZHUYIN_STATS_KEY, start);
+    if (G_UNLIKELY (trace_start != 0))
+        ibus_zhuyin_engine_trace (zhuyin, keyval, modifiers, mode, retval, trace_start);
+    return retval;
+}
+
 static void
 _update_keyboard_menu (IBusEngine *engine)
 {
     IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *) engine;
     IBusPropList *props = ibus_prop_list_new();
     IBusProperty *prop;
+    guint i;
+
+    for (i = 0; i < zhuyin_keyboard_get_number (); i++) {
+        const ZhuyinKeyboard *keyboard = zhuyin_keyboard_get_nth (i);
+        gchar *prop_name = get_keyboard_prop_name (keyboard);
 
-    prop = ibus_property_new ("InputMode.Standard",
-                              PROP_TYPE_RADIO,
-                              ibus_text_new_from_string (_("Standard")),
-                              NULL,
-                              NULL,
-                              TRUE,
-                              TRUE,
-                              zhuyin->layout == LAYOUT_STANDARD ? PROP_STATE_CHECKED : PROP_STATE_UNCHECKED,
-                              NULL);
-    ibus_prop_list_append (props, prop);
-
-    prop = ibus_property_new ("InputMode.Hsu",
-                              PROP_TYPE_RADIO,
-                              ibus_text_new_from_string (_("Hsu's")),
-                              NULL,
-                              NULL,
-                              TRUE,
-                              TRUE,
-                              zhuyin->layout == LAYOUT_HSU ? PROP_STATE_CHECKED : PROP_STATE_UNCHECKED,
-                              NULL);
-    ibus_prop_list_append (props, prop);
-
-    prop = ibus_property_new ("InputMode.Eten",
-                              PROP_TYPE_RADIO,
-                              ibus_text_new_from_string (_("Eten")),
-                              NULL,
-                              NULL,
-                              TRUE,
-                              TRUE,
-                              zhuyin->layout == LAYOUT_ETEN ? PROP_STATE_CHECKED : PROP_STATE_UNCHECKED,
-                              NULL);
-    ibus_prop_list_append (props, prop);
+        prop = ibus_property_new (prop_name,
+                                  PROP_TYPE_RADIO,
+                                  ibus_text_new_from_string (_(keyboard->label)),
+                                  NULL,
+                                  NULL,
+                                  TRUE,
+                                  TRUE,
+                                  zhuyin->keyboard == keyboard ? PROP_STATE_CHECKED : PROP_STATE_UNCHECKED,
+                                  NULL);
+        ibus_prop_list_append (props, prop);
+        g_free (prop_name);
+    }
 
     ibus_property_set_sub_props(zhuyin->prop_menu, props);
     ibus_engine_update_property (engine, zhuyin->prop_menu);
 }
 
+static void
+_update_fuzzy_menu (IBusEngine *engine)
+{
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *) engine;
+    IBusPropList *props = ibus_prop_list_new();
+    guint i;
+
+    for (i = 0; i < ZHUYIN_FUZZY_NUMBER; i++) {
+        IBusProperty *prop = ibus_property_new (fuzzy_rules[i].prop_name,
+                                                PROP_TYPE_TOGGLE,
+                                                ibus_text_new_from_string (fuzzy_rules[i].label),
+                                                NULL,
+                                                NULL,
+                                                TRUE,
+                                                TRUE,
+                                                (zhuyin_get_fuzzy () & fuzzy_rules[i].rule) ? PROP_STATE_CHECKED : PROP_STATE_UNCHECKED,
+                                                NULL);
+        ibus_prop_list_append (props, prop);
+    }
+
+    ibus_property_set_sub_props(zhuyin->prop_fuzzy, props);
+    ibus_engine_update_property (engine, zhuyin->prop_fuzzy);
+}
+
 static void
 _update_toggles (IBusEngine *engine)
 {
@@ -2107,6 +2541,27 @@ _update_toggles (IBusEngine *engine)
         ibus_property_set_state(zhuyin->prop_quick, zhuyin->enable_quick_match ? PROP_STATE_CHECKED : PROP_STATE_UNCHECKED);
         ibus_engine_update_property(engine, zhuyin->prop_quick);
     }
+
+    if (zhuyin->prop_tone) {
+        ibus_property_set_state(zhuyin->prop_tone, zhuyin->enable_tone_inference ? PROP_STATE_CHECKED : PROP_STATE_UNCHECKED);
+        ibus_engine_update_property(engine, zhuyin->prop_tone);
+    }
+}
+
+/*
+ * Apply a config that changed since, reloaded from the file or saved by
+ * another engine, and show it in the menus once they are there.
+ */
+static void
+ibus_zhuyin_engine_reload_config (IBusEngine *engine)
+{
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *) engine;
+
+    if (!apply_config (zhuyin) || zhuyin->prop_menu == NULL)
+        return;
+    _update_keyboard_menu (engine);
+    _update_fuzzy_menu (engine);
+    _update_toggles (engine);
 }
 
 static void
@@ -2130,15 +2585,39 @@ ibus_zhuyin_engine_property_activate (IBusEngine *engine,
         return;
     }
 
+    if (g_strcmp0 (prop_name, "InputMode.ToneInference") == 0) {
+        zhuyin->enable_tone_inference = (prop_state == PROP_STATE_CHECKED);
+        save_config_to_file(zhuyin);
+        _update_toggles(engine);
+        return;
+    }
+
+    for (guint i = 0; i < ZHUYIN_FUZZY_NUMBER; i++) {
+        if (g_strcmp0 (prop_name, fuzzy_rules[i].prop_name) == 0) {
+            if (prop_state == PROP_STATE_CHECKED)
+                zhuyin_set_fuzzy (zhuyin_get_fuzzy () | fuzzy_rules[i].rule);
+            else
+                zhuyin_set_fuzzy (zhuyin_get_fuzzy () & ~fuzzy_rules[i].rule);
+            ibus_zhuyin_engine_reset (engine);
+            save_config_to_file(zhuyin);
+            _update_fuzzy_menu(engine);
+            return;
+        }
+    }
+
     if (prop_state != PROP_STATE_CHECKED)
         return;
 
-    if (g_strcmp0 (prop_name, "InputMode.Standard") == 0) {
-        zhuyin->layout = LAYOUT_STANDARD;
-    } else if (g_strcmp0 (prop_name, "InputMode.Hsu") == 0) {
-        zhuyin->layout = LAYOUT_HSU;
-    } else if (g_strcmp0 (prop_name, "InputMode.Eten") == 0) {
-        zhuyin->layout = LAYOUT_ETEN;
+    for (guint i = 0; i < zhuyin_keyboard_get_number (); i++) {
+        const ZhuyinKeyboard *keyboard = zhuyin_keyboard_get_nth (i);
+        gchar *name = get_keyboard_prop_name (keyboard);
+        gboolean match = (g_strcmp0 (prop_name, name) == 0);
+
+        g_free (name);
+        if (match) {
+            zhuyin->keyboard = keyboard;
+            break;
+        }
     }
 
     save_config_to_file(zhuyin);
@@ -2177,14 +2656,34 @@ static void ibus_zhuyin_engine_enable (IBusEngine *engine)
                               NULL, NULL, TRUE, TRUE, PROP_STATE_UNCHECKED, NULL);
     g_object_ref_sink (zhuyin->prop_quick);
 
+    zhuyin->prop_tone = ibus_property_new ("InputMode.ToneInference",
+                              PROP_TYPE_TOGGLE,
+                              ibus_text_new_from_string (_("Tone Inference")),
+                              NULL, NULL, TRUE, TRUE, PROP_STATE_UNCHECKED, NULL);
+    g_object_ref_sink (zhuyin->prop_tone);
+
+    zhuyin->prop_fuzzy = ibus_property_new ("Fuzzy",
+                                            PROP_TYPE_MENU,
+                                            ibus_text_new_from_string (_("Fuzzy Zhuyin")),
+                                            NULL,
+                                            NULL,
+                                            TRUE,
+                                            TRUE,
+                                            PROP_STATE_UNCHECKED,
+                                            ibus_prop_list_new ());
+    g_object_ref_sink (zhuyin->prop_fuzzy);
+
     load_config_from_file(zhuyin);
 
     _update_keyboard_menu(engine);
+    _update_fuzzy_menu(engine);
     _update_toggles(engine);
 
     ibus_prop_list_append (prop_list, zhuyin->prop_menu);
     ibus_prop_list_append (prop_list, zhuyin->prop_association);
     ibus_prop_list_append (prop_list, zhuyin->prop_quick);
+    ibus_prop_list_append (prop_list, zhuyin->prop_tone);
+    ibus_prop_list_append (prop_list, zhuyin->prop_fuzzy);
     ibus_engine_register_properties (engine, prop_list);
 }
 
@@ -2198,6 +2697,11 @@ static void ibus_zhuyin_engine_disable (IBusEngine *engine)
     engine_instance = NULL;
 }
 
+static void ibus_zhuyin_engine_focus_in (IBusEngine *engine)
+{
+    ibus_zhuyin_engine_reload_config (engine);
+}
+
 static void
 ibus_engine_set_cursor_location (IBusEngine *engine,
                                  gint        x,
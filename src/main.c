@@ -19,10 +19,17 @@
 #include <glib/gi18n.h>
 #include <locale.h>
 #include <gtk/gtk.h>
+#include <glib-unix.h>
+#include <signal.h>
 
 #include <config.h>
 #include <ibus.h>
 #include "engine.h"
+#include "zhuyin.h"
+#include "zhuyin-backend.h"
+#include "zhuyin-keyboard.h"
+#include "zhuyin-stats.h"
+#include "zhuyin-trace.h"
 
 static IBusBus *bus = NULL;
 static IBusFactory *factory = NULL;
@@ -30,11 +37,25 @@ static IBusFactory *factory = NULL;
 /* command line options */
 static gboolean ibus = FALSE;
 static gboolean verbose = FALSE;
+static gchar *backend = "mapped";
+static gchar *dictionary = PKGLIBDIR "/zhuyin.dict";
+static gchar *overlay = NULL;
+static gboolean stats = FALSE;
+static gboolean trace = FALSE;
+static gboolean trace_keys = FALSE;
+static gint trace_slow = 100;
 
 static const GOptionEntry entries[] =
 {
     { "ibus", 'i', 0, G_OPTION_ARG_NONE, &ibus, "component is executed by ibus", NULL },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "verbose", NULL },
+    { "backend", 'b', 0, G_OPTION_ARG_STRING, &backend, "dictionary backend, builtin or mapped", "NAME" },
+    { "dictionary", 'd', 0, G_OPTION_ARG_FILENAME, &dictionary, "compiled dictionary to map instead of the built-in one", "FILE" },
+    { "overlay", 'o', 0, G_OPTION_ARG_FILENAME, &overlay, "text dictionary to put in front of the backend", "FILE" },
+    { "stats", 's', 0, G_OPTION_ARG_NONE, &stats, "time key handling, written on SIGUSR1 and exit", NULL },
+    { "trace", 't', 0, G_OPTION_ARG_NONE, &trace, "record the last keys, written on SIGUSR2, exit and a slow key", NULL },
+    { "trace-keys", 0, 0, G_OPTION_ARG_NONE, &trace_keys, "record what was typed too, not only editing keys", NULL },
+    { "trace-slow", 0, 0, G_OPTION_ARG_INT, &trace_slow, "write the trace after a key slower than this, 0 for never", "MS" },
     { NULL },
 };
 
@@ -45,12 +66,107 @@ ibus_disconnected_cb (IBusBus  *bus,
     ibus_quit ();
 }
 
+static void
+use_backend (void)
+{
+    const ZhuyinBackendClass *klass = zhuyin_backend_find (backend);
+    ZhuyinBackend *base = NULL;
+    ZhuyinBackend *top;
+    GError *error = NULL;
+
+    /* Fall back on the tables compiled in if the dictionary is unusable. */
+    if (klass == NULL || klass == &zhuyin_backend_overlay) {
+        g_warning ("Unknown backend %s", backend);
+    } else {
+        base = zhuyin_backend_open (klass, dictionary, NULL, &error);
+    }
+    if (base == NULL) {
+        if (error != NULL)
+            g_warning ("%s, using the built-in tables", error->message);
+        g_clear_error (&error);
+        base = zhuyin_backend_open (&zhuyin_backend_builtin, NULL, NULL, NULL);
+    }
+
+    top = base;
+    if (overlay != NULL) {
+        top = zhuyin_backend_open (&zhuyin_backend_overlay, overlay, base, &error);
+        if (top == NULL) {
+            g_warning ("%s", error->message);
+            g_clear_error (&error);
+            top = base;
+        }
+    }
+
+    zhuyin_use (top);
+}
+
+/* $XDG_RUNTIME_DIR/ibus-zhuyin.stats, for a look while the engine runs. */
+static gboolean
+write_stats (gpointer user_data)
+{
+    gchar *path = g_build_filename (g_get_user_runtime_dir (), "ibus-zhuyin.stats", NULL);
+    GError *error = NULL;
+
+    if (!zhuyin_stats_write (path, &error)) {
+        g_warning ("%s", error->message);
+        g_error_free (error);
+    }
+    g_free (path);
+    return G_SOURCE_CONTINUE;
+}
+
+static gchar *
+get_trace_path (void)
+{
+    return g_build_filename (g_get_user_runtime_dir (), "ibus-zhuyin.trace", NULL);
+}
+
+static gboolean
+write_trace (gpointer user_data)
+{
+    gchar *path = get_trace_path ();
+    GError *error = NULL;
+
+    if (!zhuyin_trace_write (path, &error)) {
+        g_warning ("%s", error->message);
+        g_error_free (error);
+    }
+    g_free (path);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Layouts of the user replace system ones of the same name. */
+static void
+load_keyboards (void)
+{
+    gchar *path = g_build_filename (g_get_user_data_dir (), "ibus-zhuyin", "layouts", NULL);
+
+    zhuyin_keyboard_load_dir (PKGDATADIR "/layouts");
+    zhuyin_keyboard_load_dir (path);
+    g_free (path);
+}
 
 static void
 init (void)
 {
     ibus_init ();
 
+    use_backend ();
+    load_keyboards ();
+
+    if (stats) {
+        zhuyin_stats_enable (TRUE);
+        g_unix_signal_add (SIGUSR1, write_stats, NULL);
+    }
+    if (trace) {
+        gchar *path = get_trace_path ();
+
+        zhuyin_trace_enable (TRUE, !trace_keys);
+        zhuyin_trace_dump_slow ((gint64) trace_slow * 1000000, path);
+        g_unix_signal_add (SIGUSR2, write_trace, NULL);
+        g_free (path);
+    }
+
     bus = ibus_bus_new ();
     g_object_ref_sink (bus);
     g_signal_connect (bus, "disconnected", G_CALLBACK (ibus_disconnected_cb), NULL);
@@ -123,6 +239,11 @@ int main(int argc, char **argv)
     /* Go */
     init ();
     ibus_main ();
+    ibus_zhuyin_engine_flush_config ();
+    if (stats)
+        write_stats (NULL);
+    if (trace)
+        write_trace (NULL);
 
     return 0;
 }
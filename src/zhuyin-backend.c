@@ -0,0 +1,474 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "zhuyin-backend.h"
+#include "zhuyin-dict.h"
+#include "zhuyin-table.h"
+
+#define ZHUYIN_BUILTIN_LISTS(name, pool) { \
+    name##_index, G_N_ELEMENTS(name##_index), \
+    name##_first, G_N_ELEMENTS(name##_first) - 1, \
+    name##_offset, G_N_ELEMENTS(name##_offset), \
+    pool, sizeof(pool) }
+#define ZHUYIN_BUILTIN_TABLE(name) ZHUYIN_BUILTIN_LISTS(name, name##_pool)
+
+/* The tables compiled into the engine. */
+static const ZhuyinDict zhuyin_builtin = {
+    ZHUYIN_BUILTIN_TABLE(zhuyin_syllable),
+    ZHUYIN_BUILTIN_TABLE(zhuyin_association),
+    ZHUYIN_BUILTIN_LISTS(zhuyin_toneless, zhuyin_syllable_pool),
+    ZHUYIN_BUILTIN_LISTS(zhuyin_prefix, zhuyin_syllable_pool),
+};
+
+/* The builtin and mapped backends, which only differ in where dict lives. */
+typedef struct {
+    ZhuyinBackend parent;
+    ZhuyinDict dict;
+    GMappedFile *file;
+} ZhuyinDictBackend;
+
+typedef struct {
+    ZhuyinBackend parent;
+    ZhuyinBackend *base;
+    ZhuyinDictBuilder syllable;
+    ZhuyinDictBuilder association;
+    ZhuyinDictBuilder toneless;
+    ZhuyinDictBuilder prefix;
+    ZhuyinDict dict;
+} ZhuyinOverlayBackend;
+
+static const ZhuyinBackendClass *zhuyin_backends[] = {
+    &zhuyin_backend_builtin,
+    &zhuyin_backend_mapped,
+    &zhuyin_backend_overlay,
+    NULL
+};
+
+static guint
+zhuyin_dict_backend_candidate (ZhuyinBackend     *backend,
+                               unsigned int       stanza,
+                               ZhuyinCandidates  *list)
+{
+    return zhuyin_dict_candidate (&((ZhuyinDictBackend *) backend)->dict, stanza, list);
+}
+
+static guint
+zhuyin_dict_backend_association (ZhuyinBackend     *backend,
+                                 const gchar       *text,
+                                 ZhuyinCandidates  *list)
+{
+    return zhuyin_dict_association (&((ZhuyinDictBackend *) backend)->dict, text, list);
+}
+
+static guint
+zhuyin_dict_backend_toneless (ZhuyinBackend     *backend,
+                              unsigned int       stanza,
+                              ZhuyinCandidates  *list)
+{
+    return zhuyin_dict_toneless (&((ZhuyinDictBackend *) backend)->dict, stanza, list);
+}
+
+static guint
+zhuyin_dict_backend_prefix (ZhuyinBackend     *backend,
+                            unsigned int       stanza,
+                            ZhuyinCandidates  *list)
+{
+    return zhuyin_dict_prefix (&((ZhuyinDictBackend *) backend)->dict, stanza, list);
+}
+
+static void
+zhuyin_dict_backend_foreach (ZhuyinBackend     *backend,
+                             ZhuyinBackendFunc  func,
+                             gpointer           user_data)
+{
+    const ZhuyinDictTable *table = &((ZhuyinDictBackend *) backend)->dict.syllable;
+    guint key;
+
+    for (key = 0; key < table->index_number; key++) {
+        ZhuyinCandidates list;
+
+        if (zhuyin_dict_table_lookup (table, key, &list) > 0)
+            func (ZHUYIN_KEY_STANZA (key), &list, user_data);
+    }
+}
+
+static void
+zhuyin_dict_backend_close (ZhuyinBackend *backend)
+{
+    ZhuyinDictBackend *self = (ZhuyinDictBackend *) backend;
+
+    if (self->file != NULL)
+        g_mapped_file_unref (self->file);
+    g_free (self);
+}
+
+static ZhuyinBackend *
+zhuyin_builtin_open (const gchar    *path,
+                     ZhuyinBackend  *base,
+                     GError        **error)
+{
+    ZhuyinDictBackend *self = g_new0 (ZhuyinDictBackend, 1);
+
+    self->parent.klass = &zhuyin_backend_builtin;
+    self->dict = zhuyin_builtin;
+    return &self->parent;
+}
+
+static ZhuyinBackend *
+zhuyin_mapped_open (const gchar    *path,
+                    ZhuyinBackend  *base,
+                    GError        **error)
+{
+    ZhuyinDictBackend *self;
+    GMappedFile *file;
+    ZhuyinDict dict;
+
+    file = g_mapped_file_new (path, FALSE, error);
+    if (file == NULL)
+        return NULL;
+
+    if (!zhuyin_dict_parse (g_mapped_file_get_contents (file),
+                            g_mapped_file_get_length (file), &dict, error)) {
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    self = g_new0 (ZhuyinDictBackend, 1);
+    self->parent.klass = &zhuyin_backend_mapped;
+    self->dict = dict;
+    self->file = file;
+    return &self->parent;
+}
+
+/* Whether candidate is one of the space separated words in candidates. */
+static gboolean
+zhuyin_overlay_lists (const gchar *candidates, const gchar *candidate)
+{
+    gsize size = strlen (candidate);
+    const gchar *start = candidates;
+
+    while (start != NULL) {
+        const gchar *end = strchr (start, ' ');
+
+        if ((end ? (gsize) (end - start) : strlen (start)) == size &&
+            strncmp (start, candidate, size) == 0)
+            return TRUE;
+        start = end ? end + 1 : NULL;
+    }
+    return FALSE;
+}
+
+/* Store one line of the overlay, followed by what base has for the same key. */
+static gboolean
+zhuyin_overlay_add (const gchar  *key,
+                    const gchar  *candidates,
+                    gpointer      user_data,
+                    GError      **error)
+{
+    ZhuyinOverlayBackend *self = user_data;
+    ZhuyinDictBuilder *builder;
+    ZhuyinCandidates base;
+    GString *merged;
+    guint stanza, index, number, i;
+    gboolean ok;
+
+    if (zhuyin_dict_parse_syllable (key, &stanza)) {
+        builder = &self->syllable;
+        index = ZHUYIN_STANZA_KEY (stanza);
+        number = zhuyin_backend_candidate (self->base, stanza, &base);
+    } else if (zhuyin_dict_parse_character (key, &index)) {
+        builder = &self->association;
+        number = zhuyin_backend_association (self->base, key, &base);
+    } else {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "\"%s\" is not a valid key", key);
+        return FALSE;
+    }
+
+    merged = g_string_new (candidates);
+    for (i = 0; i < number; i++) {
+        const gchar *candidate = zhuyin_candidates_get (&base, i);
+
+        if (!zhuyin_overlay_lists (candidates, candidate)) {
+            g_string_append_c (merged, ' ');
+            g_string_append (merged, candidate);
+        }
+    }
+
+    ok = zhuyin_dict_builder_add (builder, index, merged->str, &number, error);
+    g_string_free (merged, TRUE);
+    return ok;
+}
+
+static guint zhuyin_overlay_candidate (ZhuyinBackend*, unsigned int, ZhuyinCandidates*);
+
+/*
+ * Merge the tones of the syllables the overlay touches.  Their lists span
+ * the overlay and the base, so unlike zhuyin_dict_merge_tones() the
+ * candidates are copied into a pool of their own.
+ */
+static void
+zhuyin_overlay_merge_tones (ZhuyinOverlayBackend *self)
+{
+    GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+    GString *merged = g_string_new ("");
+    guint key, tone, i, number;
+
+    zhuyin_dict_builder_init (&self->toneless, ZHUYIN_TONELESS_NUMBER);
+
+    for (key = 0; key < ZHUYIN_TONELESS_NUMBER; key++) {
+        for (tone = 0; tone < ZHUYIN_TONE_NUMBER; tone++) {
+            if (zhuyin_dict_table_lookup (&self->dict.syllable, key + tone * ZHUYIN_TONELESS_NUMBER, NULL) > 0)
+                break;
+        }
+        if (tone == ZHUYIN_TONE_NUMBER)
+            continue;
+
+        g_string_truncate (merged, 0);
+        for (tone = 0; tone < ZHUYIN_TONE_NUMBER; tone++) {
+            ZhuyinCandidates list;
+
+            number = zhuyin_overlay_candidate (&self->parent,
+                                               ZHUYIN_KEY_STANZA (key + tone * ZHUYIN_TONELESS_NUMBER), &list);
+            for (i = 0; i < number; i++) {
+                const gchar *candidate = zhuyin_candidates_get (&list, i);
+
+                if (g_hash_table_contains (seen, candidate))
+                    continue;
+                g_hash_table_add (seen, (gpointer) candidate);
+                if (merged->len > 0)
+                    g_string_append_c (merged, ' ');
+                g_string_append (merged, candidate);
+            }
+        }
+        g_hash_table_remove_all (seen);
+
+        /* the keys are fresh and the candidates came from valid lists */
+        zhuyin_dict_builder_add (&self->toneless, key, merged->str, &number, NULL);
+    }
+
+    g_string_free (merged, TRUE);
+    g_hash_table_destroy (seen);
+    zhuyin_dict_builder_finish (&self->toneless, &self->dict.toneless);
+}
+
+static guint
+zhuyin_overlay_lookup (gpointer data, guint key, ZhuyinCandidates *list)
+{
+    return zhuyin_overlay_candidate (data, ZHUYIN_KEY_STANZA (key), list);
+}
+
+static void
+zhuyin_overlay_add_prefix (guint key, const gchar **candidates, guint number, gpointer user_data)
+{
+    ZhuyinOverlayBackend *self = user_data;
+    GString *merged = g_string_new (candidates[0]);
+    guint i;
+
+    for (i = 1; i < number; i++) {
+        g_string_append_c (merged, ' ');
+        g_string_append (merged, candidates[i]);
+    }
+
+    /* the keys are fresh and the candidates came from valid lists */
+    zhuyin_dict_builder_add (&self->prefix, key, merged->str, &number, NULL);
+    g_string_free (merged, TRUE);
+}
+
+/*
+ * Rank the prefixes again over the overlay and the base.  Any syllable
+ * the overlay reorders may move the best candidates of its prefixes, so
+ * every prefix is redone, copying the candidates into a pool of its own.
+ */
+static void
+zhuyin_overlay_merge_prefixes (ZhuyinOverlayBackend *self)
+{
+    zhuyin_dict_builder_init (&self->prefix, ZHUYIN_TONELESS_NUMBER);
+    zhuyin_dict_rank_prefixes (zhuyin_overlay_lookup, self, zhuyin_overlay_add_prefix, self);
+    zhuyin_dict_builder_finish (&self->prefix, &self->dict.prefix);
+}
+
+static ZhuyinBackend *
+zhuyin_overlay_open (const gchar    *path,
+                     ZhuyinBackend  *base,
+                     GError        **error)
+{
+    ZhuyinOverlayBackend *self;
+
+    if (base == NULL) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "The overlay needs a backend to go over");
+        return NULL;
+    }
+
+    self = g_new0 (ZhuyinOverlayBackend, 1);
+    self->parent.klass = &zhuyin_backend_overlay;
+    self->base = base;
+    zhuyin_dict_builder_init (&self->syllable, ZHUYIN_STANZA_NUMBER);
+    zhuyin_dict_builder_init (&self->association, ZHUYIN_ASSOCIATION_NUMBER);
+
+    if (!zhuyin_dict_read_text (path, zhuyin_overlay_add, self, error)) {
+        zhuyin_dict_builder_clear (&self->syllable);
+        zhuyin_dict_builder_clear (&self->association);
+        g_free (self);
+        return NULL;
+    }
+
+    zhuyin_dict_builder_finish (&self->syllable, &self->dict.syllable);
+    zhuyin_dict_builder_finish (&self->association, &self->dict.association);
+    zhuyin_overlay_merge_tones (self);
+    zhuyin_overlay_merge_prefixes (self);
+    return &self->parent;
+}
+
+static guint
+zhuyin_overlay_candidate (ZhuyinBackend     *backend,
+                          unsigned int       stanza,
+                          ZhuyinCandidates  *list)
+{
+    ZhuyinOverlayBackend *self = (ZhuyinOverlayBackend *) backend;
+    guint number = zhuyin_dict_candidate (&self->dict, stanza, list);
+
+    return number > 0 ? number : zhuyin_backend_candidate (self->base, stanza, list);
+}
+
+static guint
+zhuyin_overlay_association (ZhuyinBackend     *backend,
+                            const gchar       *text,
+                            ZhuyinCandidates  *list)
+{
+    ZhuyinOverlayBackend *self = (ZhuyinOverlayBackend *) backend;
+    guint number = zhuyin_dict_association (&self->dict, text, list);
+
+    return number > 0 ? number : zhuyin_backend_association (self->base, text, list);
+}
+
+static guint
+zhuyin_overlay_toneless (ZhuyinBackend     *backend,
+                         unsigned int       stanza,
+                         ZhuyinCandidates  *list)
+{
+    ZhuyinOverlayBackend *self = (ZhuyinOverlayBackend *) backend;
+    guint number = zhuyin_dict_toneless (&self->dict, stanza, list);
+
+    return number > 0 ? number : zhuyin_backend_toneless (self->base, stanza, list);
+}
+
+static guint
+zhuyin_overlay_prefix (ZhuyinBackend     *backend,
+                       unsigned int       stanza,
+                       ZhuyinCandidates  *list)
+{
+    return zhuyin_dict_prefix (&((ZhuyinOverlayBackend *) backend)->dict, stanza, list);
+}
+
+static void
+zhuyin_overlay_foreach (ZhuyinBackend     *backend,
+                        ZhuyinBackendFunc  func,
+                        gpointer           user_data)
+{
+    guint key;
+
+    for (key = 0; key < ZHUYIN_STANZA_NUMBER; key++) {
+        ZhuyinCandidates list;
+
+        if (zhuyin_overlay_candidate (backend, ZHUYIN_KEY_STANZA (key), &list) > 0)
+            func (ZHUYIN_KEY_STANZA (key), &list, user_data);
+    }
+}
+
+static void
+zhuyin_overlay_close (ZhuyinBackend *backend)
+{
+    ZhuyinOverlayBackend *self = (ZhuyinOverlayBackend *) backend;
+
+    zhuyin_backend_close (self->base);
+    zhuyin_dict_builder_clear (&self->syllable);
+    zhuyin_dict_builder_clear (&self->association);
+    zhuyin_dict_builder_clear (&self->toneless);
+    zhuyin_dict_builder_clear (&self->prefix);
+    g_free (self);
+}
+
+const ZhuyinBackendClass zhuyin_backend_builtin = {
+    "builtin",
+    zhuyin_builtin_open,
+    zhuyin_dict_backend_candidate,
+    zhuyin_dict_backend_association,
+    zhuyin_dict_backend_toneless,
+    zhuyin_dict_backend_prefix,
+    zhuyin_dict_backend_foreach,
+    zhuyin_dict_backend_close,
+};
+
+const ZhuyinBackendClass zhuyin_backend_mapped = {
+    "mapped",
+    zhuyin_mapped_open,
+    zhuyin_dict_backend_candidate,
+    zhuyin_dict_backend_association,
+    zhuyin_dict_backend_toneless,
+    zhuyin_dict_backend_prefix,
+    zhuyin_dict_backend_foreach,
+    zhuyin_dict_backend_close,
+};
+
+const ZhuyinBackendClass zhuyin_backend_overlay = {
+    "overlay",
+    zhuyin_overlay_open,
+    zhuyin_overlay_candidate,
+    zhuyin_overlay_association,
+    zhuyin_overlay_toneless,
+    zhuyin_overlay_prefix,
+    zhuyin_overlay_foreach,
+    zhuyin_overlay_close,
+};
+
+/**
+ * Find a backend class by name.
+ *
+ * @param name "builtin", "mapped" or "overlay"
+ * @return The class, or NULL if there is none by that name
+ */
+const ZhuyinBackendClass* zhuyin_backend_find(const gchar *name)
+{
+    guint i;
+
+    for (i = 0; zhuyin_backends[i] != NULL; i++) {
+        if (g_strcmp0 (zhuyin_backends[i]->name, name) == 0)
+            return zhuyin_backends[i];
+    }
+    return NULL;
+}
+
+/**
+ * Open a backend.
+ *
+ * @param klass The kind of backend to open
+ * @param path The file it reads, if it reads one
+ * @param base The backend to go over, only for the overlay
+ * @param error Return location for the reason it could not be opened
+ * @return The backend, or NULL on failure, in which case base is untouched
+ */
+ZhuyinBackend* zhuyin_backend_open(const ZhuyinBackendClass *klass, const gchar *path, ZhuyinBackend *base, GError **error)
+{
+    return klass->open (path, base, error);
+}
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
@@ -0,0 +1,434 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include "zhuyin-config.h"
+
+static ZhuyinConfig *current = NULL;
+static guint generation = 0;
+static GFileMonitor *monitor = NULL;
+static gchar *written = NULL;       /* what a writer wrote last, guarded by current */
+static gsize written_length = 0;
+static gint writes_pending = 0;     /* writers with something not written yet */
+G_LOCK_DEFINE_STATIC (current);
+
+static gint
+zhuyin_config_get_boolean (GKeyFile *key_file, const gchar *key)
+{
+    GError *error = NULL;
+    gboolean value = g_key_file_get_boolean (key_file, "engine", key, &error);
+
+    if (error) {
+        g_error_free (error);
+        return ZHUYIN_CONFIG_UNSET;
+    }
+    return value;
+}
+
+static gint
+zhuyin_config_get_integer (GKeyFile *key_file, const gchar *key)
+{
+    GError *error = NULL;
+    gint value = g_key_file_get_integer (key_file, "engine", key, &error);
+
+    if (error) {
+        g_error_free (error);
+        return ZHUYIN_CONFIG_UNSET;
+    }
+    return value;
+}
+
+/**
+ * Parse the contents of a config file.
+ *
+ * @param data The contents
+ * @param length The length of data
+ * @param error Return location for why it could not be parsed
+ * @return A config not yet current, or NULL on failure
+ */
+ZhuyinConfig* zhuyin_config_parse(const gchar *data, gsize length, GError **error)
+{
+    GKeyFile *key_file = g_key_file_new ();
+    ZhuyinConfig *config;
+
+    if (!g_key_file_load_from_data (key_file, data, length, G_KEY_FILE_NONE, error)) {
+        g_key_file_free (key_file);
+        return NULL;
+    }
+
+    config = g_new0 (ZhuyinConfig, 1);
+    config->ref_count = 1;
+    config->layout = g_key_file_get_string (key_file, "engine", "layout", NULL);
+    config->association = zhuyin_config_get_boolean (key_file, "association");
+    config->quick_match = zhuyin_config_get_boolean (key_file, "quick_match");
+    config->tone_inference = zhuyin_config_get_boolean (key_file, "tone_inference");
+    config->fuzzy = g_key_file_get_string_list (key_file, "engine", "fuzzy", NULL, NULL);
+    config->punctuation_window_x = zhuyin_config_get_integer (key_file, "punctuation_window_x");
+    config->punctuation_window_y = zhuyin_config_get_integer (key_file, "punctuation_window_y");
+
+    g_key_file_free (key_file);
+    return config;
+}
+
+/**
+ * Take a reference to a config.
+ *
+ * @param config The config
+ * @return config
+ */
+ZhuyinConfig* zhuyin_config_ref(ZhuyinConfig *config)
+{
+    g_atomic_int_inc (&config->ref_count);
+    return config;
+}
+
+/**
+ * Drop a reference to a config, freeing it with the last one.
+ *
+ * @param config The config
+ */
+void zhuyin_config_unref(ZhuyinConfig *config)
+{
+    if (!g_atomic_int_dec_and_test (&config->ref_count))
+        return;
+    g_free (config->layout);
+    g_strfreev (config->fuzzy);
+    g_free (config);
+}
+
+/**
+ * Get the current config.
+ *
+ * @return A reference to it, to drop with zhuyin_config_unref(), or NULL
+ *         if none was loaded
+ */
+ZhuyinConfig* zhuyin_config_get(void)
+{
+    ZhuyinConfig *config = NULL;
+
+    G_LOCK (current);
+    if (current)
+        config = zhuyin_config_ref (current);
+    G_UNLOCK (current);
+
+    return config;
+}
+
+/**
+ * Get the generation of the current config without taking a reference,
+ * cheap enough to check on every key.
+ *
+ * @return The generation, 0 if none was loaded
+ */
+guint zhuyin_config_generation(void)
+{
+    return (guint) g_atomic_int_get (&generation);
+}
+
+/**
+ * Make a config current, giving it the next generation.
+ *
+ * @param config The new config, whose reference is taken over
+ */
+void zhuyin_config_set(ZhuyinConfig *config)
+{
+    ZhuyinConfig *old;
+
+    G_LOCK (current);
+    g_atomic_int_inc (&generation);
+    config->generation = generation;
+    old = current;
+    current = config;
+    G_UNLOCK (current);
+
+    if (old)
+        zhuyin_config_unref (old);
+}
+
+/**
+ * Parse a config file and make it current.  A missing file leaves the
+ * current config alone.
+ *
+ * @param path The config file
+ * @param error Return location for why it could not be loaded
+ * @return TRUE if it was loaded
+ */
+gboolean zhuyin_config_load(const gchar *path, GError **error)
+{
+    ZhuyinConfig *config;
+    gchar *data;
+    gsize length;
+
+    if (!g_file_get_contents (path, &data, &length, error))
+        return FALSE;
+    config = zhuyin_config_parse (data, length, error);
+    g_free (data);
+    if (config == NULL)
+        return FALSE;
+
+    zhuyin_config_set (config);
+    return TRUE;
+}
+
+/**
+ * Reload a config file that changed on disk, unless the change came from
+ * a ZhuyinConfigWriter.  While a write is waiting the file is older than
+ * the current config, and once written it is what the current config was
+ * made from, so neither is loaded again.
+ *
+ * @param path The config file
+ * @param error Return location for why it could not be loaded
+ * @return TRUE unless it had to be loaded and could not be
+ */
+gboolean zhuyin_config_reload(const gchar *path, GError **error)
+{
+    ZhuyinConfig *config;
+    gboolean own;
+    gchar *data;
+    gsize length;
+
+    if (g_atomic_int_get (&writes_pending) > 0)
+        return TRUE;
+    if (!g_file_get_contents (path, &data, &length, error))
+        return FALSE;
+
+    G_LOCK (current);
+    own = written != NULL && written_length == length && memcmp (written, data, length) == 0;
+    if (!own) {
+        /* an edit back to what was written is not ours then */
+        g_free (written);
+        written = NULL;
+    }
+    G_UNLOCK (current);
+
+    if (own) {
+        g_free (data);
+        return TRUE;
+    }
+    config = zhuyin_config_parse (data, length, error);
+    g_free (data);
+    if (config == NULL)
+        return FALSE;
+
+    zhuyin_config_set (config);
+    return TRUE;
+}
+
+static void
+zhuyin_config_changed (GFileMonitor      *file_monitor,
+                       GFile             *file,
+                       GFile             *other_file,
+                       GFileMonitorEvent  event,
+                       gpointer           user_data)
+{
+    const gchar *path = user_data;
+    GError *error = NULL;
+
+    if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+        event != G_FILE_MONITOR_EVENT_CREATED &&
+        event != G_FILE_MONITOR_EVENT_MOVED_IN &&
+        event != G_FILE_MONITOR_EVENT_RENAMED)
+        return;
+
+    if (!zhuyin_config_reload (path, &error)) {
+        g_warning ("%s", error->message);
+        g_error_free (error);
+    }
+}
+
+/**
+ * Load the config file and reload it whenever it changes, for the rest of
+ * the process.  Only the first call does anything.
+ *
+ * @param path The config file
+ */
+void zhuyin_config_watch(const gchar *path)
+{
+    GFile *file;
+
+    if (monitor != NULL)
+        return;
+
+    zhuyin_config_load (path, NULL);
+
+    /* g_file_set_contents() renames into place, so follow moves too */
+    file = g_file_new_for_path (path);
+    monitor = g_file_monitor_file (file, G_FILE_MONITOR_WATCH_MOVES, NULL, NULL);
+    g_object_unref (file);
+    if (monitor != NULL)
+        g_signal_connect (monitor, "changed", G_CALLBACK (zhuyin_config_changed), g_strdup (path));
+}
+
+struct _ZhuyinConfigWriter {
+    gchar *path;
+    guint quiet_ms;
+    GThread *thread;
+
+    /* guarded by lock */
+    GMutex lock;
+    GCond cond;
+    gchar *data;            /* waiting to be written, NULL if none */
+    gsize length;
+    gint64 deadline;        /* monotonic time to write data at */
+    gboolean writing;
+    gboolean quit;
+};
+
+/* Takes data over, keeping it for zhuyin_config_reload() once written. */
+static void
+zhuyin_config_writer_write (ZhuyinConfigWriter *writer, gchar *data, gsize length)
+{
+    gchar *dir = g_path_get_dirname (writer->path);
+    GError *error = NULL;
+
+    if (!g_file_test (dir, G_FILE_TEST_IS_DIR))
+        g_mkdir_with_parents (dir, 0700);
+    if (g_file_set_contents (writer->path, data, length, &error)) {
+        G_LOCK (current);
+        g_free (written);
+        written = data;
+        written_length = length;
+        G_UNLOCK (current);
+    } else {
+        g_warning ("%s", error->message);
+        g_error_free (error);
+        g_free (data);
+    }
+    g_free (dir);
+}
+
+static gpointer
+zhuyin_config_writer_run (gpointer user_data)
+{
+    ZhuyinConfigWriter *writer = user_data;
+
+    g_mutex_lock (&writer->lock);
+    for (;;) {
+        gchar *data;
+        gsize length;
+
+        if (writer->data == NULL) {
+            if (writer->quit)
+                break;
+            g_cond_wait (&writer->cond, &writer->lock);
+            continue;
+        }
+        if (!writer->quit && g_get_monotonic_time () < writer->deadline) {
+            g_cond_wait_until (&writer->cond, &writer->lock, writer->deadline);
+            continue;
+        }
+
+        data = writer->data;
+        length = writer->length;
+        writer->data = NULL;
+        writer->writing = TRUE;
+        g_mutex_unlock (&writer->lock);
+
+        zhuyin_config_writer_write (writer, data, length);
+
+        g_mutex_lock (&writer->lock);
+        writer->writing = FALSE;
+        if (writer->data == NULL)
+            g_atomic_int_add (&writes_pending, -1);
+        g_cond_broadcast (&writer->cond);
+    }
+    g_mutex_unlock (&writer->lock);
+
+    return NULL;
+}
+
+/**
+ * Start a writer for a config file.
+ *
+ * @param path The file to write
+ * @param quiet_ms How long no change must come before writing
+ * @return The writer
+ */
+ZhuyinConfigWriter* zhuyin_config_writer_new(const gchar *path, guint quiet_ms)
+{
+    ZhuyinConfigWriter *writer = g_new0 (ZhuyinConfigWriter, 1);
+
+    writer->path = g_strdup (path);
+    writer->quiet_ms = quiet_ms;
+    g_mutex_init (&writer->lock);
+    g_cond_init (&writer->cond);
+    writer->thread = g_thread_new ("zhuyin-config", zhuyin_config_writer_run, writer);
+
+    return writer;
+}
+
+/**
+ * Write what is waiting and stop the writer.
+ *
+ * @param writer The writer to free
+ */
+void zhuyin_config_writer_free(ZhuyinConfigWriter *writer)
+{
+    g_mutex_lock (&writer->lock);
+    writer->quit = TRUE;
+    g_cond_broadcast (&writer->cond);
+    g_mutex_unlock (&writer->lock);
+    g_thread_join (writer->thread);
+
+    g_cond_clear (&writer->cond);
+    g_mutex_clear (&writer->lock);
+    g_free (writer->path);
+    g_free (writer);
+}
+
+/**
+ * Queue the contents of the config file, replacing what was queued before.
+ * Returns at once.
+ *
+ * @param writer The writer
+ * @param data The contents, freed by the writer
+ * @param length The length of data
+ */
+void zhuyin_config_writer_save(ZhuyinConfigWriter *writer, gchar *data, gsize length)
+{
+    g_mutex_lock (&writer->lock);
+    if (writer->data == NULL && !writer->writing)
+        g_atomic_int_inc (&writes_pending);
+    g_free (writer->data);
+    writer->data = data;
+    writer->length = length;
+    writer->deadline = g_get_monotonic_time () + writer->quiet_ms * G_TIME_SPAN_MILLISECOND;
+    g_cond_broadcast (&writer->cond);
+    g_mutex_unlock (&writer->lock);
+}
+
+/**
+ * Write what is queued without waiting for the quiet period, and wait
+ * until it is written.
+ *
+ * @param writer The writer
+ */
+void zhuyin_config_writer_flush(ZhuyinConfigWriter *writer)
+{
+    g_mutex_lock (&writer->lock);
+    writer->deadline = 0;
+    g_cond_broadcast (&writer->cond);
+    while (writer->data != NULL || writer->writing)
+        g_cond_wait (&writer->cond, &writer->lock);
+    g_mutex_unlock (&writer->lock);
+}
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
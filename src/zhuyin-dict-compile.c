@@ -0,0 +1,383 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Dictionary compiler.
+ *
+ * It reads the syllable and association lists and splits them once.  It
+ * then merges the tones of every syllable into the toneless lists and the
+ * best candidates of every partial syllable into the prefix lists.  All of
+ * this goes either into the binary dictionary that zhuyin_load() maps, or
+ * with --header into the zhuyin-table.h that is compiled into the engine.
+ *
+ * Without --phone and --phrase it uses phone.h and phrases.h.  The text
+ * sources hold one list per line, a key followed by its candidates, all
+ * separated by spaces; lines starting with '#' are ignored:
+ *
+ *   ㄅㄚˋ 爸 罷 霸 壩 ...      (--phone, the key is a Zhuyin syllable)
+ *   一 個 些 樣 定 ...         (--phrase, the key is one CJK character)
+ *
+ * With --corpus, the candidates of every syllable are put in order of how
+ * often they appear in the given plain text files, counted in parallel,
+ * so the common ones land on the first page.  Candidates the corpus never
+ * shows, and phrases, keep their places.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "zhuyin.h"
+#include "zhuyin-dict.h"
+#include "phone.h"
+#include "phrases.h"
+
+static gchar *output = NULL;
+static gchar *phone_file = NULL;
+static gchar *phrase_file = NULL;
+static gchar **corpus_files = NULL;
+static gboolean header = FALSE;
+
+static const GOptionEntry entries[] =
+{
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "write to FILE instead of stdout", "FILE" },
+    { "phone", 0, 0, G_OPTION_ARG_FILENAME, &phone_file, "read the syllable lists from FILE", "FILE" },
+    { "phrase", 0, 0, G_OPTION_ARG_FILENAME, &phrase_file, "read the association lists from FILE", "FILE" },
+    { "corpus", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &corpus_files, "rank the syllable lists by the characters of FILE, may be repeated", "FILE" },
+    { "header", 0, 0, G_OPTION_ARG_NONE, &header, "write zhuyin-table.h instead of a binary dictionary", NULL },
+    { NULL },
+};
+
+static gboolean
+read_builtin (ZhuyinDictBuilder *syllable, ZhuyinDictBuilder *association, GError **error)
+{
+    guint number;
+    gint i;
+
+    for (i = 0; i < phone_length; i++) {
+        guint stanza = phone_table[i].index;
+
+        if (!ZHUYIN_STANZA_IN_RANGE (stanza)) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                         "phone.h: stanza %u is out of range", stanza);
+            return FALSE;
+        }
+        if (!zhuyin_dict_builder_add (syllable, ZHUYIN_STANZA_KEY (stanza),
+                                phone_table[i].candidate.string, &number, error))
+            return FALSE;
+        if (number != phone_table[i].number) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                         "phone.h: stanza %u lists %u candidates, not %u",
+                         stanza, number, phone_table[i].number);
+            return FALSE;
+        }
+    }
+
+    for (i = 0; phrase_table[i].key != NULL; i++) {
+        guint key;
+
+        if (!zhuyin_dict_parse_character (phrase_table[i].key, &key)) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                         "phrases.h: \"%s\" is not one CJK character", phrase_table[i].key);
+            return FALSE;
+        }
+        if (!zhuyin_dict_builder_add (association, key, phrase_table[i].candidates, &number, error))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+add_syllable (const gchar *key, const gchar *candidates, gpointer table, GError **error)
+{
+    guint stanza, number;
+
+    if (!zhuyin_dict_parse_syllable (key, &stanza)) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "\"%s\" is not a valid key", key);
+        return FALSE;
+    }
+    return zhuyin_dict_builder_add (table, ZHUYIN_STANZA_KEY (stanza), candidates, &number, error);
+}
+
+static gboolean
+add_association (const gchar *key, const gchar *candidates, gpointer table, GError **error)
+{
+    guint index, number;
+
+    if (!zhuyin_dict_parse_character (key, &index)) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "\"%s\" is not a valid key", key);
+        return FALSE;
+    }
+    return zhuyin_dict_builder_add (table, index, candidates, &number, error);
+}
+
+/* Emit one C string literal, escaping what the compiler would otherwise eat. */
+static void
+print_literal (FILE *out, const gchar *text)
+{
+    fputc ('"', out);
+    for (; *text != '\0'; text++) {
+        if (*text == '"' || *text == '\\' || *text == '?')
+            fputc ('\\', out);
+        fputc (*text, out);
+    }
+    fputs ("\\0\"", out);
+}
+
+static void
+print_array (FILE *out, const gchar *type, const gchar *name,
+             const void *data, guint number, gsize size)
+{
+    guint per_line = size == sizeof (guint16) ? 12 : 8;
+    guint i;
+
+    fprintf (out, "static const %s %s[%u] = {", type, name, number);
+    for (i = 0; i < number; i++) {
+        if (i % per_line == 0)
+            fputs ("\n   ", out);
+        if (size == sizeof (guint16))
+            fprintf (out, " %u,", ((const guint16 *) data)[i]);
+        else
+            fprintf (out, " %u,", ((const guint32 *) data)[i]);
+    }
+    fputs ("\n};\n\n", out);
+}
+
+static void
+print_lists (FILE *out, const gchar *prefix, const ZhuyinDictTable *table)
+{
+    gchar *name;
+
+    name = g_strdup_printf ("%s_index", prefix);
+    fprintf (out, "/* %s_first position + 1 for every key, 0 if absent. */\n", prefix);
+    print_array (out, "guint16", name, table->index, table->index_number, sizeof (guint16));
+    g_free (name);
+
+    name = g_strdup_printf ("%s_first", prefix);
+    fprintf (out, "/* Index into %s_offset per list, plus the end. */\n", prefix);
+    print_array (out, "guint32", name, table->first, table->list_number + 1, sizeof (guint32));
+    g_free (name);
+
+    name = g_strdup_printf ("%s_offset", prefix);
+    print_array (out, "guint32", name, table->offset, table->offset_number, sizeof (guint32));
+    g_free (name);
+}
+
+static void
+print_table (FILE *out, const gchar *prefix, const ZhuyinDictTable *table)
+{
+    guint i, j;
+
+    print_lists (out, prefix, table);
+    fprintf (out, "static const gchar %s_pool[] =", prefix);
+    for (i = 0; i < table->list_number; i++) {
+        fputs ("\n   ", out);
+        for (j = table->first[i]; j < table->first[i + 1]; j++) {
+            fputc (' ', out);
+            print_literal (out, table->pool + table->offset[j]);
+        }
+    }
+    fputs (";\n\n", out);
+}
+
+static void
+print_header (FILE *out, const ZhuyinDict *dict)
+{
+    fputs ("/* Generated by zhuyin-dict-compile.  Do not edit. */\n\n", out);
+    fputs ("#ifndef __ZHUYIN_TABLE_H__\n", out);
+    fputs ("#define __ZHUYIN_TABLE_H__\n\n", out);
+    print_table (out, "zhuyin_syllable", &dict->syllable);
+    print_table (out, "zhuyin_association", &dict->association);
+    fputs ("/* The toneless and prefix lists point into zhuyin_syllable_pool. */\n", out);
+    print_lists (out, "zhuyin_toneless", &dict->toneless);
+    print_lists (out, "zhuyin_prefix", &dict->prefix);
+    fputs ("#endif\n", out);
+}
+
+/* Order the syllable lists by how often their candidates show up in the corpus. */
+static gboolean
+rank_by_corpus (ZhuyinDictBuilder *syllable, GError **error)
+{
+    GHashTable *counts = g_hash_table_new (g_direct_hash, g_direct_equal);
+    gchar **path;
+
+    for (path = corpus_files; *path != NULL; path++) {
+        GMappedFile *file = g_mapped_file_new (*path, FALSE, error);
+
+        if (file == NULL) {
+            g_hash_table_destroy (counts);
+            return FALSE;
+        }
+        zhuyin_dict_count (counts, g_mapped_file_get_contents (file),
+                           g_mapped_file_get_length (file), 0);
+        g_mapped_file_unref (file);
+    }
+
+    zhuyin_dict_builder_rank (syllable, counts);
+    g_hash_table_destroy (counts);
+    return TRUE;
+}
+
+static void
+append_section (GString *data, ZhuyinDictSection *section,
+                const void *start, guint number, gsize size)
+{
+    while (data->len % 4 != 0)
+        g_string_append_c (data, '\0');
+
+    section->offset = data->len;
+    section->length = number;
+    g_string_append_len (data, start, number * size);
+}
+
+static void
+append_lists (GString *data, ZhuyinDictTableHeader *header, const ZhuyinDictTable *table)
+{
+    append_section (data, &header->index, table->index, table->index_number, sizeof (guint16));
+    append_section (data, &header->first, table->first, table->list_number + 1, sizeof (guint32));
+    append_section (data, &header->offset, table->offset, table->offset_number, sizeof (guint32));
+}
+
+static void
+append_table (GString *data, ZhuyinDictTableHeader *header, const ZhuyinDictTable *table)
+{
+    append_lists (data, header, table);
+    append_section (data, &header->pool, table->pool, table->pool_size, sizeof (gchar));
+}
+
+/* Lay the dictionary out as described in zhuyin-dict.h. */
+static GString *
+build_binary (const ZhuyinDict *dict)
+{
+    GString *data = g_string_new ("");
+    ZhuyinDictHeader header;
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, ZHUYIN_DICT_MAGIC, sizeof (header.magic));
+    header.version = ZHUYIN_DICT_VERSION;
+    header.byte_order = ZHUYIN_DICT_BYTE_ORDER;
+
+    g_string_set_size (data, sizeof (header));
+    append_table (data, &header.syllable, &dict->syllable);
+    append_table (data, &header.association, &dict->association);
+    append_lists (data, &header.toneless, &dict->toneless);
+    header.toneless.pool = header.syllable.pool;
+    append_lists (data, &header.prefix, &dict->prefix);
+    header.prefix.pool = header.syllable.pool;
+    memcpy (data->str, &header, sizeof (header));
+
+    return data;
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    ZhuyinDictBuilder syllable, association, toneless, prefix;
+    ZhuyinDict dict;
+    gboolean ok;
+
+    context = g_option_context_new ("- compile the Zhuyin dictionary.");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("zhuyin-dict-compile: %s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    zhuyin_dict_builder_init (&syllable, ZHUYIN_STANZA_NUMBER);
+    zhuyin_dict_builder_init (&association, ZHUYIN_ASSOCIATION_NUMBER);
+    toneless.index = NULL;
+    prefix.index = NULL;
+
+    if (phone_file == NULL && phrase_file == NULL) {
+        ok = read_builtin (&syllable, &association, &error);
+    } else if (phone_file != NULL && phrase_file != NULL) {
+        ok = zhuyin_dict_read_text (phone_file, add_syllable, &syllable, &error) &&
+             zhuyin_dict_read_text (phrase_file, add_association, &association, &error);
+    } else {
+        g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "--phone and --phrase go together");
+        ok = FALSE;
+    }
+
+    /* An empty table would print as C arrays of no elements. */
+    if (ok && (syllable.first->len == 0 || association.first->len == 0)) {
+        g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s has no lists",
+                     syllable.first->len == 0 ? (phone_file ? phone_file : "phone.h")
+                                              : (phrase_file ? phrase_file : "phrases.h"));
+        ok = FALSE;
+    }
+
+    if (ok && corpus_files != NULL)
+        ok = rank_by_corpus (&syllable, &error);
+
+    if (ok) {
+        zhuyin_dict_builder_finish (&syllable, &dict.syllable);
+        zhuyin_dict_builder_finish (&association, &dict.association);
+        ok = zhuyin_dict_table_check (&dict.syllable, &error) &&
+             zhuyin_dict_table_check (&dict.association, &error);
+    }
+    if (ok) {
+        zhuyin_dict_merge_tones (&dict.syllable, &toneless, &dict.toneless);
+        zhuyin_dict_merge_prefixes (&dict.syllable, &prefix, &dict.prefix);
+        ok = zhuyin_dict_table_check (&dict.toneless, &error) &&
+             zhuyin_dict_table_check (&dict.prefix, &error);
+    }
+
+    if (ok && header) {
+        FILE *out = output ? fopen (output, "w") : stdout;
+
+        if (out == NULL) {
+            g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                         "cannot write %s", output);
+            ok = FALSE;
+        } else {
+            print_header (out, &dict);
+            if (out != stdout)
+                fclose (out);
+        }
+    } else if (ok) {
+        GString *data = build_binary (&dict);
+
+        if (output != NULL)
+            ok = g_file_set_contents (output, data->str, data->len, &error);
+        else
+            fwrite (data->str, 1, data->len, stdout);
+        g_string_free (data, TRUE);
+    }
+
+    if (toneless.index != NULL)
+        zhuyin_dict_builder_clear (&toneless);
+    if (prefix.index != NULL)
+        zhuyin_dict_builder_clear (&prefix);
+    zhuyin_dict_builder_clear (&syllable);
+    zhuyin_dict_builder_clear (&association);
+
+    if (!ok) {
+        g_printerr ("zhuyin-dict-compile: %s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+    return 0;
+}
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
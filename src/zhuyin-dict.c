@@ -0,0 +1,831 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "zhuyin-dict.h"
+
+static gboolean
+zhuyin_dict_fail (GError **error, const gchar *reason)
+{
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                 "Invalid Zhuyin dictionary: %s", reason);
+    return FALSE;
+}
+
+/**
+ * Check that every index, first and offset entry of a table stays inside
+ * the table, so lookups never have to.
+ *
+ * @param table The table to check
+ * @param error Return location for the reason it is broken
+ * @return TRUE if the table is safe to look up
+ */
+gboolean zhuyin_dict_table_check(const ZhuyinDictTable *table, GError **error)
+{
+    guint i;
+
+    for (i = 0; i < table->index_number; i++) {
+        if (table->index[i] > table->list_number)
+            return zhuyin_dict_fail (error, "index points past the last list");
+    }
+
+    if (table->first[0] != 0 || table->first[table->list_number] != table->offset_number)
+        return zhuyin_dict_fail (error, "lists do not cover the offsets");
+    for (i = 0; i < table->list_number; i++) {
+        if (table->first[i] > table->first[i + 1])
+            return zhuyin_dict_fail (error, "lists overlap");
+    }
+
+    if (table->pool_size == 0 || table->pool[table->pool_size - 1] != '\0')
+        return zhuyin_dict_fail (error, "pool is not NUL-terminated");
+    for (i = 0; i < table->offset_number; i++) {
+        if (table->offset[i] >= table->pool_size)
+            return zhuyin_dict_fail (error, "offset points past the pool");
+    }
+
+    return TRUE;
+}
+
+static gboolean
+zhuyin_dict_section (const gchar             *data,
+                     gsize                    length,
+                     const ZhuyinDictSection *section,
+                     gsize                    element,
+                     gconstpointer           *start,
+                     GError                 **error)
+{
+    if (section->offset % 4 != 0)
+        return zhuyin_dict_fail (error, "section is misaligned");
+    if (section->offset > length || section->length > (length - section->offset) / element)
+        return zhuyin_dict_fail (error, "section is truncated");
+
+    *start = data + section->offset;
+    return TRUE;
+}
+
+static gboolean
+zhuyin_dict_parse_table (const gchar                 *data,
+                         gsize                        length,
+                         const ZhuyinDictTableHeader *header,
+                         guint                        index_number,
+                         ZhuyinDictTable             *table,
+                         GError                     **error)
+{
+    gconstpointer start;
+
+    if (header->index.length != index_number)
+        return zhuyin_dict_fail (error, "index has the wrong size");
+    if (header->first.length == 0)
+        return zhuyin_dict_fail (error, "lists are missing");
+
+    if (!zhuyin_dict_section (data, length, &header->index, sizeof (guint16), &start, error))
+        return FALSE;
+    table->index = start;
+    table->index_number = header->index.length;
+
+    if (!zhuyin_dict_section (data, length, &header->first, sizeof (guint32), &start, error))
+        return FALSE;
+    table->first = start;
+    table->list_number = header->first.length - 1;
+
+    if (!zhuyin_dict_section (data, length, &header->offset, sizeof (guint32), &start, error))
+        return FALSE;
+    table->offset = start;
+    table->offset_number = header->offset.length;
+
+    if (!zhuyin_dict_section (data, length, &header->pool, sizeof (gchar), &start, error))
+        return FALSE;
+    table->pool = start;
+    table->pool_size = header->pool.length;
+
+    return zhuyin_dict_table_check (table, error);
+}
+
+/**
+ * Point a dictionary at the tables of a compiled dictionary file.
+ *
+ * Nothing is copied: the tables stay inside data, which must be 4 byte
+ * aligned and outlive the dictionary.
+ *
+ * @param data Contents of the file
+ * @param length Size of data in bytes
+ * @param dict Dictionary to fill in
+ * @param error Return location for the reason the file is rejected
+ * @return TRUE if data holds a valid dictionary
+ */
+gboolean zhuyin_dict_parse(const gchar *data, gsize length, ZhuyinDict *dict, GError **error)
+{
+    const ZhuyinDictHeader *header = (const ZhuyinDictHeader *) data;
+
+    if (length < sizeof (ZhuyinDictHeader) ||
+        memcmp (header->magic, ZHUYIN_DICT_MAGIC, sizeof (header->magic)) != 0)
+        return zhuyin_dict_fail (error, "bad magic");
+    if (header->version != ZHUYIN_DICT_VERSION)
+        return zhuyin_dict_fail (error, "unsupported version");
+    if (header->byte_order != ZHUYIN_DICT_BYTE_ORDER)
+        return zhuyin_dict_fail (error, "foreign byte order");
+
+    return zhuyin_dict_parse_table (data, length, &header->syllable,
+                                    ZHUYIN_STANZA_NUMBER, &dict->syllable, error) &&
+           zhuyin_dict_parse_table (data, length, &header->association,
+                                    ZHUYIN_ASSOCIATION_NUMBER, &dict->association, error) &&
+           zhuyin_dict_parse_table (data, length, &header->toneless,
+                                    ZHUYIN_TONELESS_NUMBER, &dict->toneless, error) &&
+           zhuyin_dict_parse_table (data, length, &header->prefix,
+                                    ZHUYIN_TONELESS_NUMBER, &dict->prefix, error);
+}
+
+/**
+ * Get the list stored under a key of a table.
+ *
+ * @param table The table to look up
+ * @param key Key inside the table, already known to be in range
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, 0 if the key has none
+ */
+guint zhuyin_dict_table_lookup(const ZhuyinDictTable *table, guint key, ZhuyinCandidates *list)
+{
+    guint slot = table->index[key];
+    guint first;
+
+    if (slot == 0)
+        return 0;
+    slot--;
+
+    first = table->first[slot];
+    if (list != NULL) {
+        list->pool = table->pool;
+        list->offset = table->offset + first;
+        list->number = table->first[slot + 1] - first;
+    }
+    return table->first[slot + 1] - first;
+}
+
+/**
+ * Get candidate characters for a given Zhuyin index.
+ *
+ * @param dict The dictionary to look up
+ * @param index The Zhuyin phonetic index
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, 0 if the index has none
+ */
+guint zhuyin_dict_candidate(const ZhuyinDict *dict, unsigned int index, ZhuyinCandidates *list)
+{
+    if (!ZHUYIN_STANZA_IN_RANGE(index))
+        return 0;
+
+    return zhuyin_dict_table_lookup (&dict->syllable, ZHUYIN_STANZA_KEY(index), list);
+}
+
+/**
+ * Get association candidates for a committed character.
+ *
+ * @param dict The dictionary to look up
+ * @param text The committed text, a single character to match
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, 0 if the text has none
+ */
+guint zhuyin_dict_association(const ZhuyinDict *dict, const gchar *text, ZhuyinCandidates *list)
+{
+    gunichar ch;
+
+    if (text == NULL || *text == '\0' || *g_utf8_next_char(text) != '\0')
+        return 0;
+
+    ch = g_utf8_get_char(text);
+    if (ch < ZHUYIN_ASSOCIATION_FIRST || ch > ZHUYIN_ASSOCIATION_LAST)
+        return 0;
+
+    return zhuyin_dict_table_lookup (&dict->association, ch - ZHUYIN_ASSOCIATION_FIRST, list);
+}
+
+/**
+ * Get the candidates of a syllable in all of its tones, whatever tone the
+ * stanza holds, by tone and then in the order of each tone.
+ *
+ * @param dict The dictionary to look up
+ * @param index The Zhuyin phonetic index
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, 0 if the syllable has none in any tone
+ */
+guint zhuyin_dict_toneless(const ZhuyinDict *dict, unsigned int index, ZhuyinCandidates *list)
+{
+    index &= 0xffffff;
+    if (!ZHUYIN_STANZA_IN_RANGE(index))
+        return 0;
+
+    return zhuyin_dict_table_lookup (&dict->toneless, ZHUYIN_STANZA_KEY(index), list);
+}
+
+/**
+ * Get the best candidates of every syllable starting with what is typed
+ * so far, such as ㄐ or ㄐㄧ.  The tone of the stanza is ignored.
+ *
+ * @param dict The dictionary to look up
+ * @param index The Zhuyin phonetic index of the typed slots
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, at most ZHUYIN_PREFIX_LIMIT
+ */
+guint zhuyin_dict_prefix(const ZhuyinDict *dict, unsigned int index, ZhuyinCandidates *list)
+{
+    index &= 0xffffff;
+    if (!ZHUYIN_STANZA_IN_RANGE(index))
+        return 0;
+
+    return zhuyin_dict_table_lookup (&dict->prefix, ZHUYIN_STANZA_KEY(index), list);
+}
+
+/**
+ * Start an empty table with room for index_number keys.
+ *
+ * @param builder The builder to set up
+ * @param index_number Number of keys, ZHUYIN_STANZA_NUMBER or ZHUYIN_ASSOCIATION_NUMBER
+ */
+void zhuyin_dict_builder_init(ZhuyinDictBuilder *builder, guint index_number)
+{
+    builder->index = g_array_new (FALSE, TRUE, sizeof (guint16));
+    g_array_set_size (builder->index, index_number);
+    builder->first = g_array_new (FALSE, FALSE, sizeof (guint32));
+    builder->offset = g_array_new (FALSE, FALSE, sizeof (guint32));
+    builder->pool = g_string_new ("");
+}
+
+/**
+ * Split one space separated list and store it under a key.
+ *
+ * @param builder The builder to add to
+ * @param key Key inside the table, not used before
+ * @param candidates Candidates separated by single spaces
+ * @param number Return location for the number of candidates
+ * @param error Return location for the reason the list is refused
+ * @return TRUE if the list was added
+ */
+gboolean zhuyin_dict_builder_add(ZhuyinDictBuilder *builder, guint key, const gchar *candidates, guint *number, GError **error)
+{
+    const gchar *start = candidates;
+    guint16 slot = builder->first->len + 1;
+
+    if (g_array_index (builder->index, guint16, key) != 0) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "\"%s\" reuses a key", candidates);
+        return FALSE;
+    }
+    if (builder->first->len >= G_MAXUINT16) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "too many lists");
+        return FALSE;
+    }
+
+    g_array_index (builder->index, guint16, key) = slot;
+    g_array_append_val (builder->first, builder->offset->len);
+    *number = 0;
+
+    while (start != NULL) {
+        const gchar *end = strchr (start, ' ');
+        gsize size = end ? (gsize) (end - start) : strlen (start);
+        guint32 position = builder->pool->len;
+
+        if (size == 0) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                         "\"%s\" has an empty candidate", candidates);
+            return FALSE;
+        }
+        g_array_append_val (builder->offset, position);
+        g_string_append_len (builder->pool, start, size);
+        g_string_append_c (builder->pool, '\0');
+        (*number)++;
+        start = end ? end + 1 : NULL;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Close the last list and point a table at the finished arrays.
+ *
+ * Nothing can be added afterwards.
+ *
+ * @param builder The builder to finish
+ * @param table Table to fill in
+ */
+void zhuyin_dict_builder_finish(ZhuyinDictBuilder *builder, ZhuyinDictTable *table)
+{
+    g_array_append_val (builder->first, builder->offset->len);
+
+    table->index = (const guint16 *) builder->index->data;
+    table->index_number = builder->index->len;
+    table->first = (const guint32 *) builder->first->data;
+    table->list_number = builder->first->len - 1;
+    table->offset = (const guint32 *) builder->offset->data;
+    table->offset_number = builder->offset->len;
+    table->pool = builder->pool->str;
+    table->pool_size = builder->pool->len;
+}
+
+/**
+ * Free the arrays of a builder, and with them any table finished from it.
+ *
+ * @param builder The builder to clear
+ */
+void zhuyin_dict_builder_clear(ZhuyinDictBuilder *builder)
+{
+    g_array_free (builder->index, TRUE);
+    g_array_free (builder->first, TRUE);
+    g_array_free (builder->offset, TRUE);
+    g_string_free (builder->pool, TRUE);
+}
+
+/**
+ * Build the toneless table of a syllable table.  Each syllable gets the
+ * candidates of its tones in tone order, a candidate said in several tones
+ * only where it first shows up.  The lists point into the pool of syllable,
+ * which has to outlive toneless.
+ *
+ * @param syllable The finished syllable table
+ * @param builder An unused builder, to be cleared along with syllable
+ * @param toneless Table to fill in
+ */
+void zhuyin_dict_merge_tones(const ZhuyinDictTable *syllable, ZhuyinDictBuilder *builder, ZhuyinDictTable *toneless)
+{
+    GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+    guint key, tone, i;
+
+    zhuyin_dict_builder_init (builder, ZHUYIN_TONELESS_NUMBER);
+
+    for (key = 0; key < ZHUYIN_TONELESS_NUMBER; key++) {
+        guint32 start = builder->offset->len;
+
+        for (tone = 0; tone < ZHUYIN_TONE_NUMBER; tone++) {
+            ZhuyinCandidates list;
+            guint number = zhuyin_dict_table_lookup (syllable, key + tone * ZHUYIN_TONELESS_NUMBER, &list);
+
+            for (i = 0; i < number; i++) {
+                const gchar *candidate = zhuyin_candidates_get (&list, i);
+
+                if (g_hash_table_contains (seen, candidate))
+                    continue;
+                g_hash_table_add (seen, (gpointer) candidate);
+                g_array_append_val (builder->offset, list.offset[i]);
+            }
+        }
+
+        if (builder->offset->len > start) {
+            g_array_index (builder->index, guint16, key) = builder->first->len + 1;
+            g_array_append_val (builder->first, start);
+        }
+        g_hash_table_remove_all (seen);
+    }
+    g_hash_table_destroy (seen);
+
+    zhuyin_dict_builder_finish (builder, toneless);
+    toneless->pool = syllable->pool;
+    toneless->pool_size = syllable->pool_size;
+}
+
+/* One slice of a corpus, counted by a thread of its own. */
+typedef struct {
+    const gchar *start;
+    const gchar *end;
+    GHashTable *counts;
+} ZhuyinDictSlice;
+
+static gpointer
+zhuyin_dict_count_slice (gpointer data)
+{
+    ZhuyinDictSlice *slice = data;
+    const gchar *p = slice->start;
+
+    while (p < slice->end) {
+        gunichar ch = g_utf8_get_char_validated (p, slice->end - p);
+        gpointer key;
+
+        if (ch == (gunichar) -1 || ch == (gunichar) -2) {
+            p++;
+            continue;
+        }
+        key = GUINT_TO_POINTER (ch);
+        g_hash_table_insert (slice->counts, key,
+                             GUINT_TO_POINTER (GPOINTER_TO_UINT (g_hash_table_lookup (slice->counts, key)) + 1));
+        p = g_utf8_next_char (p);
+    }
+    return NULL;
+}
+
+/**
+ * Count how often each character shows up in a corpus.  The text is cut
+ * into slices on character boundaries and each slice is counted by its
+ * own thread, the tallies being added up at the end.
+ *
+ * @param counts Table from code point to count, made with g_direct_hash(), to add to
+ * @param text The corpus, UTF-8; bytes that are not are skipped
+ * @param length Size of text in bytes
+ * @param threads Number of threads to count with, 0 for one per processor
+ */
+void zhuyin_dict_count(GHashTable *counts, const gchar *text, gsize length, guint threads)
+{
+    ZhuyinDictSlice *slices;
+    GThread **workers;
+    const gchar *start = text;
+    guint i;
+
+    if (threads == 0)
+        threads = g_get_num_processors ();
+    if (threads > length / 4096 + 1)
+        threads = length / 4096 + 1;
+
+    slices = g_new0 (ZhuyinDictSlice, threads);
+    workers = g_new0 (GThread*, threads);
+    for (i = 0; i < threads; i++) {
+        const gchar *end = text + length * (i + 1) / threads;
+
+        /* never cut a character in two */
+        while (end < text + length && (*(const guchar *) end & 0xc0) == 0x80)
+            end++;
+        slices[i].start = start;
+        slices[i].end = end > start ? end : start;
+        slices[i].counts = g_hash_table_new (g_direct_hash, g_direct_equal);
+        workers[i] = g_thread_new ("zhuyin-count", zhuyin_dict_count_slice, &slices[i]);
+        start = slices[i].end;
+    }
+
+    for (i = 0; i < threads; i++) {
+        GHashTableIter iter;
+        gpointer key, value;
+
+        g_thread_join (workers[i]);
+        g_hash_table_iter_init (&iter, slices[i].counts);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            guint total = GPOINTER_TO_UINT (g_hash_table_lookup (counts, key)) + GPOINTER_TO_UINT (value);
+
+            g_hash_table_insert (counts, key, GUINT_TO_POINTER (total));
+        }
+        g_hash_table_destroy (slices[i].counts);
+    }
+    g_free (workers);
+    g_free (slices);
+}
+
+/* A candidate of a list being ranked by how often it was counted. */
+typedef struct {
+    guint count;
+    guint position;
+    guint32 offset;
+} ZhuyinDictCounted;
+
+static gint
+zhuyin_dict_counted_compare (gconstpointer a, gconstpointer b)
+{
+    const ZhuyinDictCounted *x = a;
+    const ZhuyinDictCounted *y = b;
+
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return x->position < y->position ? -1 : x->position > y->position;
+}
+
+/**
+ * Put the candidates of every list added so far in order of how often
+ * zhuyin_dict_count() saw them, the most frequent first.  Only the places
+ * of counted candidates are shuffled: those of more than one character or
+ * never seen stay where they came in, and ties keep their order.
+ *
+ * @param builder The builder, not finished yet
+ * @param counts Table from code point to count
+ */
+void zhuyin_dict_builder_rank(ZhuyinDictBuilder *builder, GHashTable *counts)
+{
+    GArray *items = g_array_new (FALSE, FALSE, sizeof (ZhuyinDictCounted));
+    GArray *counted = g_array_new (FALSE, FALSE, sizeof (ZhuyinDictCounted));
+    GString *copy = g_string_new ("");
+    guint32 start, end, position;
+    guint list, i, next;
+
+    for (list = 0; list < builder->first->len; list++) {
+        guint32 first = g_array_index (builder->first, guint32, list);
+        guint32 last = list + 1 < builder->first->len ?
+                       g_array_index (builder->first, guint32, list + 1) : builder->offset->len;
+
+        g_array_set_size (items, 0);
+        g_array_set_size (counted, 0);
+        for (i = first; i < last; i++) {
+            ZhuyinDictCounted item = { 0, i, g_array_index (builder->offset, guint32, i) };
+            const gchar *candidate = builder->pool->str + item.offset;
+
+            if (*g_utf8_next_char (candidate) == '\0')
+                item.count = GPOINTER_TO_UINT (g_hash_table_lookup (counts, GUINT_TO_POINTER (g_utf8_get_char (candidate))));
+            g_array_append_val (items, item);
+            if (item.count > 0)
+                g_array_append_val (counted, item);
+        }
+
+        if (counted->len == 0)
+            continue;
+        g_array_sort (counted, zhuyin_dict_counted_compare);
+        for (next = 0, i = 0; i < items->len; i++) {
+            if (g_array_index (items, ZhuyinDictCounted, i).count > 0)
+                g_array_index (items, ZhuyinDictCounted, i) = g_array_index (counted, ZhuyinDictCounted, next++);
+        }
+
+        /* lay the list out again in the pool too, which stays in list order */
+        start = g_array_index (builder->offset, guint32, first);
+        end = last < builder->offset->len ? g_array_index (builder->offset, guint32, last) : builder->pool->len;
+        g_string_truncate (copy, 0);
+        g_string_append_len (copy, builder->pool->str + start, end - start);
+        for (position = start, i = first; i < last; i++) {
+            const gchar *candidate = copy->str + g_array_index (items, ZhuyinDictCounted, i - first).offset - start;
+            gsize size = strlen (candidate) + 1;
+
+            memcpy (builder->pool->str + position, candidate, size);
+            g_array_index (builder->offset, guint32, i) = position;
+            position += size;
+        }
+    }
+    g_string_free (copy, TRUE);
+    g_array_free (items, TRUE);
+    g_array_free (counted, TRUE);
+}
+
+/* A candidate of a syllable seen from one of its prefixes. */
+typedef struct {
+    guint8 rank;    /* position inside the list of the syllable */
+    guint8 rest;    /* slots of the syllable after the prefix */
+    guint16 key;    /* key of the syllable */
+    const gchar *candidate;
+} ZhuyinDictRanked;
+
+static gint
+zhuyin_dict_ranked_compare (gconstpointer a, gconstpointer b)
+{
+    const ZhuyinDictRanked *x = a;
+    const ZhuyinDictRanked *y = b;
+
+    if (x->rank != y->rank)
+        return x->rank - y->rank;
+    if (x->rest != y->rest)
+        return x->rest - y->rest;
+    return x->key - y->key;
+}
+
+/**
+ * Rank the candidates of every prefix of every syllable.  A prefix is a
+ * syllable without its tone cut after its initial, medial or final, the
+ * way it is typed.  Candidates go by their place in the list of their
+ * syllable, then by how few slots are left to type, then by syllable, a
+ * candidate of several syllables only where it first shows up.
+ *
+ * @param lookup Gets the list of a stanza key
+ * @param data Passed to lookup
+ * @param func Called once for each prefix with a candidate, in key order
+ * @param user_data Passed to func
+ */
+void zhuyin_dict_rank_prefixes(ZhuyinDictLookupFunc lookup, gpointer data, ZhuyinDictPrefixFunc func, gpointer user_data)
+{
+    GArray **ranked = g_new0 (GArray*, ZHUYIN_TONELESS_NUMBER);
+    GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+    const gchar *best[ZHUYIN_PREFIX_LIMIT];
+    guint key, slot, i;
+
+    for (key = 0; key < ZHUYIN_STANZA_NUMBER; key++) {
+        ZhuyinCandidates list;
+        guint number = lookup (data, key, &list);
+        guint stanza = ZHUYIN_KEY_STANZA(key) & 0xffffff;
+        guint last = 0;
+
+        if (number > ZHUYIN_PREFIX_LIMIT)
+            number = ZHUYIN_PREFIX_LIMIT;
+
+        for (slot = ZHUYIN_SLOT_INITIAL; slot < ZHUYIN_SLOT_TONE && number > 0; slot++) {
+            guint prefix = stanza & ((1u << (slot * 8)) - 1);
+            guint rest = 0;
+            guint later;
+            GArray *array;
+
+            /* An empty slot adds nothing to the prefix before it. */
+            if (prefix == 0 || prefix == last)
+                continue;
+            last = prefix;
+
+            for (later = slot; later < ZHUYIN_SLOT_TONE; later++) {
+                if ((stanza >> (later * 8)) & 0xff)
+                    rest++;
+            }
+
+            array = ranked[ZHUYIN_STANZA_KEY(prefix)];
+            if (array == NULL) {
+                array = g_array_new (FALSE, FALSE, sizeof (ZhuyinDictRanked));
+                ranked[ZHUYIN_STANZA_KEY(prefix)] = array;
+            }
+            for (i = 0; i < number; i++) {
+                ZhuyinDictRanked item = { i, rest, key, zhuyin_candidates_get (&list, i) };
+
+                g_array_append_val (array, item);
+            }
+        }
+    }
+
+    for (key = 0; key < ZHUYIN_TONELESS_NUMBER; key++) {
+        GArray *array = ranked[key];
+        guint number = 0;
+
+        if (array == NULL)
+            continue;
+
+        g_array_sort (array, zhuyin_dict_ranked_compare);
+        for (i = 0; i < array->len && number < ZHUYIN_PREFIX_LIMIT; i++) {
+            const gchar *candidate = g_array_index (array, ZhuyinDictRanked, i).candidate;
+
+            if (g_hash_table_contains (seen, candidate))
+                continue;
+            g_hash_table_add (seen, (gpointer) candidate);
+            best[number++] = candidate;
+        }
+        func (key, best, number, user_data);
+
+        g_hash_table_remove_all (seen);
+        g_array_free (array, TRUE);
+    }
+    g_hash_table_destroy (seen);
+    g_free (ranked);
+}
+
+static guint
+zhuyin_dict_prefix_lookup (gpointer data, guint key, ZhuyinCandidates *list)
+{
+    return zhuyin_dict_table_lookup (data, key, list);
+}
+
+typedef struct {
+    ZhuyinDictBuilder *builder;
+    const gchar *pool;
+} ZhuyinDictPrefixBuild;
+
+static void
+zhuyin_dict_prefix_append (guint key, const gchar **candidates, guint number, gpointer user_data)
+{
+    ZhuyinDictPrefixBuild *build = user_data;
+    ZhuyinDictBuilder *builder = build->builder;
+    guint i;
+
+    g_array_index (builder->index, guint16, key) = builder->first->len + 1;
+    g_array_append_val (builder->first, builder->offset->len);
+    for (i = 0; i < number; i++) {
+        guint32 offset = candidates[i] - build->pool;
+
+        g_array_append_val (builder->offset, offset);
+    }
+}
+
+/**
+ * Build the prefix table of a syllable table, ranked by
+ * zhuyin_dict_rank_prefixes().  The lists point into the pool of
+ * syllable, which has to outlive prefix.
+ *
+ * @param syllable The finished syllable table
+ * @param builder An unused builder, to be cleared along with syllable
+ * @param prefix Table to fill in
+ */
+void zhuyin_dict_merge_prefixes(const ZhuyinDictTable *syllable, ZhuyinDictBuilder *builder, ZhuyinDictTable *prefix)
+{
+    ZhuyinDictPrefixBuild build = { builder, syllable->pool };
+
+    zhuyin_dict_builder_init (builder, ZHUYIN_TONELESS_NUMBER);
+    zhuyin_dict_rank_prefixes (zhuyin_dict_prefix_lookup, (gpointer) syllable,
+                               zhuyin_dict_prefix_append, &build);
+
+    zhuyin_dict_builder_finish (builder, prefix);
+    prefix->pool = syllable->pool;
+    prefix->pool_size = syllable->pool_size;
+}
+
+/* The symbols of each slot in stanza order, NULL-terminated. */
+static const gchar *zhuyin_symbols[ZHUYIN_SLOT_NUMBER - 1][ZHUYIN_INITIAL_NUMBER] = {
+    { "ㄅ", "ㄆ", "ㄇ", "ㄈ", "ㄉ", "ㄊ", "ㄋ", "ㄌ", "ㄍ", "ㄎ", "ㄏ",
+      "ㄐ", "ㄑ", "ㄒ", "ㄓ", "ㄔ", "ㄕ", "ㄖ", "ㄗ", "ㄘ", "ㄙ", NULL },
+    { "ㄧ", "ㄨ", "ㄩ", NULL },
+    { "ㄚ", "ㄛ", "ㄜ", "ㄝ", "ㄞ", "ㄟ", "ㄠ", "ㄡ", "ㄢ", "ㄣ", "ㄤ", "ㄥ", "ㄦ", NULL },
+    { "ˊ", "ˇ", "ˋ", "˙", NULL },
+};
+
+/**
+ * Get the written symbol of a slot value.
+ *
+ * @param slot ZHUYIN_SLOT_INITIAL .. ZHUYIN_SLOT_TONE
+ * @param index Value of the slot inside a stanza, from 1 up
+ * @return The symbol, such as "ㄅ" or "ˊ"
+ */
+const gchar* zhuyin_dict_symbol(guint slot, guint index)
+{
+    return zhuyin_symbols[slot - 1][index - 1];
+}
+
+static guint
+zhuyin_dict_parse_symbol (const gchar **text, const gchar **symbols)
+{
+    guint i;
+
+    for (i = 0; symbols[i] != NULL; i++) {
+        if (g_str_has_prefix (*text, symbols[i])) {
+            *text += strlen (symbols[i]);
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Turn a written syllable such as ㄅㄚˋ back into its stanza.
+ *
+ * @param text The syllable
+ * @param stanza Return location for the stanza
+ * @return TRUE if text is exactly one syllable
+ */
+gboolean zhuyin_dict_parse_syllable(const gchar *text, guint *stanza)
+{
+    guint initial = zhuyin_dict_parse_symbol (&text, zhuyin_symbols[ZHUYIN_SLOT_INITIAL - 1]);
+    guint medial = zhuyin_dict_parse_symbol (&text, zhuyin_symbols[ZHUYIN_SLOT_MEDIAL - 1]);
+    guint final = zhuyin_dict_parse_symbol (&text, zhuyin_symbols[ZHUYIN_SLOT_FINAL - 1]);
+    guint tone = zhuyin_dict_parse_symbol (&text, zhuyin_symbols[ZHUYIN_SLOT_TONE - 1]);
+
+    *stanza = initial | medial << 8 | final << 16 | tone << 24;
+    return *text == '\0' && *stanza != 0;
+}
+
+/**
+ * Turn an association key into its place in the association table.
+ *
+ * @param text The key
+ * @param key Return location for the codepoint minus ZHUYIN_ASSOCIATION_FIRST
+ * @return TRUE if text is exactly one CJK character
+ */
+gboolean zhuyin_dict_parse_character(const gchar *text, guint *key)
+{
+    gunichar ch = g_utf8_get_char (text);
+
+    *key = ch - ZHUYIN_ASSOCIATION_FIRST;
+    return *text != '\0' && *g_utf8_next_char (text) == '\0' &&
+           ch >= ZHUYIN_ASSOCIATION_FIRST && ch <= ZHUYIN_ASSOCIATION_LAST;
+}
+
+/**
+ * Read a text dictionary, one list per line.
+ *
+ * Each line holds a key followed by its candidates, all separated by
+ * spaces.  Empty lines and lines starting with '#' are skipped.
+ *
+ * @param path The file to read
+ * @param func Called with the key and candidates of every line
+ * @param user_data Passed on to func
+ * @param error Return location for the first line that could not be used
+ * @return TRUE if every line was accepted by func
+ */
+gboolean zhuyin_dict_read_text(const gchar *path, ZhuyinDictLineFunc func, gpointer user_data, GError **error)
+{
+    gchar *contents;
+    gchar **lines;
+    gboolean ok = TRUE;
+    guint i;
+
+    if (!g_file_get_contents (path, &contents, NULL, error))
+        return FALSE;
+
+    lines = g_strsplit (contents, "\n", 0);
+    for (i = 0; ok && lines[i] != NULL; i++) {
+        gchar *line = g_strstrip (lines[i]);
+        gchar *space = strchr (line, ' ');
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        if (space == NULL) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                         "\"%s\" has no candidates", line);
+            ok = FALSE;
+        } else {
+            *space = '\0';
+            ok = func (line, g_strchug (space + 1), user_data, error);
+        }
+        if (!ok)
+            g_prefix_error (error, "%s:%u: ", path, i + 1);
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+    return ok;
+}
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
@@ -0,0 +1,331 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gi18n.h>
+#include "zhuyin-keyboard.h"
+#include "zhuyin-dict.h"
+
+/*
+ * The built-in layouts, one string per slot giving the key of every
+ * symbol in stanza order: ㄅ .. ㄙ, ㄧ ㄨ ㄩ, ㄚ .. ㄦ, ˊ ˇ ˋ ˙.
+ */
+static const struct {
+    const gchar *name;
+    const gchar *label;
+    const gchar *keys[ZHUYIN_SLOT_NUMBER - 1];
+} zhuyin_keyboard_layouts[] = {
+    { "standard", N_("Standard"), { "1qaz2wsxedcrfv5tgbyhn", "ujm", "8ik,9ol.0p;/-", "6347" } },
+    { "hsu",      N_("Hsu's"),    { "bpmfdtnlgkhjvczasrqw2", "exu", "yhg9iawomnkl,", "6347" } },
+    { "eten",     N_("Eten"),     { "bpmfdtnlvkhg7c,./j;'s", "exu", "aorwiqzy890-=", "2341" } },
+};
+
+/* Keys of the [Layout] group of a layout file, one per slot. */
+static const gchar *zhuyin_keyboard_file_keys[ZHUYIN_SLOT_NUMBER - 1] = {
+    "Initials", "Medials", "Finals", "Tones"
+};
+
+/* Every layout in menu order, the built-in ones first.  Never freed. */
+static GPtrArray *zhuyin_keyboards = NULL;
+
+static const guint zhuyin_slot_number[ZHUYIN_SLOT_NUMBER] = {
+    0,
+    ZHUYIN_INITIAL_NUMBER - 1,
+    ZHUYIN_MEDIAL_NUMBER - 1,
+    ZHUYIN_FINAL_NUMBER - 1,
+    ZHUYIN_TONE_NUMBER - 1,
+};
+
+/**
+ * Expand a layout into the arrays of a ZhuyinKeyboard.
+ *
+ * A key may appear in one slot only, except that it may be both an
+ * initial and a final, which makes the layout ambiguous.
+ *
+ * @param name Name of the layout, kept by pointer
+ * @param keys For each slot from ZHUYIN_SLOT_INITIAL, the key of every symbol in stanza order
+ * @param keyboard The keyboard to fill in
+ * @param error Return location for the reason the layout is refused
+ * @return TRUE if keyboard is ready to use
+ */
+gboolean zhuyin_keyboard_compile(const gchar *name, const gchar* const *keys, ZhuyinKeyboard *keyboard, GError **error)
+{
+    guint slot, i;
+
+    memset (keyboard, 0, sizeof (ZhuyinKeyboard));
+    keyboard->name = name;
+
+    for (slot = ZHUYIN_SLOT_INITIAL; slot <= ZHUYIN_SLOT_TONE; slot++) {
+        const gchar *row = keys[slot - ZHUYIN_SLOT_INITIAL];
+
+        if (strlen (row) != zhuyin_slot_number[slot]) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                         "%s: \"%s\" needs %u keys", name, row, zhuyin_slot_number[slot]);
+            return FALSE;
+        }
+
+        for (i = 0; row[i] != '\0'; i++) {
+            guchar keyval = row[i];
+            ZhuyinKey key = { zhuyin_dict_symbol (slot, i + 1), slot, i + 1 };
+
+            if (keyval <= ' ' || keyval >= ZHUYIN_KEYBOARD_SIZE - 1) {
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                             "%s: '%c' is not a printable ASCII key", name, keyval);
+                return FALSE;
+            }
+            if (keyboard->key[keyval].slot != 0 &&
+                !(keyboard->key[keyval].slot == ZHUYIN_SLOT_INITIAL && slot == ZHUYIN_SLOT_FINAL)) {
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                             "%s: '%c' types both %s and %s", name, keyval,
+                             keyboard->key[keyval].symbol, key.symbol);
+                return FALSE;
+            }
+
+            if (keyboard->key[keyval].slot == 0)
+                keyboard->key[keyval] = key;
+            else
+                keyboard->ambiguous = TRUE;
+            keyboard->alternate[keyval] = key;
+            keyboard->index[slot][keyval] = i + 1;
+        }
+    }
+
+    return TRUE;
+}
+
+static void
+zhuyin_keyboard_ensure (void)
+{
+    guint i;
+
+    if (zhuyin_keyboards != NULL)
+        return;
+
+    zhuyin_keyboards = g_ptr_array_new ();
+    for (i = 0; i < G_N_ELEMENTS (zhuyin_keyboard_layouts); i++) {
+        ZhuyinKeyboard *keyboard = g_new0 (ZhuyinKeyboard, 1);
+
+        if (!zhuyin_keyboard_compile (zhuyin_keyboard_layouts[i].name,
+                                      zhuyin_keyboard_layouts[i].keys,
+                                      keyboard, NULL))
+            g_assert_not_reached ();
+        keyboard->label = zhuyin_keyboard_layouts[i].label;
+        g_ptr_array_add (zhuyin_keyboards, keyboard);
+    }
+}
+
+/**
+ * Get a layout by name.
+ *
+ * @param name "standard", "hsu", "eten" or the name of a loaded layout
+ * @return The keyboard, or NULL if there is none by that name
+ */
+const ZhuyinKeyboard* zhuyin_keyboard_find(const gchar *name)
+{
+    guint i;
+
+    zhuyin_keyboard_ensure ();
+    for (i = 0; i < zhuyin_keyboards->len; i++) {
+        const ZhuyinKeyboard *keyboard = g_ptr_array_index (zhuyin_keyboards, i);
+
+        if (g_strcmp0 (keyboard->name, name) == 0)
+            return keyboard;
+    }
+    return NULL;
+}
+
+/**
+ * Get the number of layouts, built-in and loaded.
+ *
+ * @return Number of layouts
+ */
+guint zhuyin_keyboard_get_number(void)
+{
+    zhuyin_keyboard_ensure ();
+    return zhuyin_keyboards->len;
+}
+
+/**
+ * Get a layout in menu order.
+ *
+ * @param n Position, below zhuyin_keyboard_get_number()
+ * @return The keyboard
+ */
+const ZhuyinKeyboard* zhuyin_keyboard_get_nth(guint n)
+{
+    zhuyin_keyboard_ensure ();
+    return g_ptr_array_index (zhuyin_keyboards, n);
+}
+
+static gint
+zhuyin_keyboard_compare_path (gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0 (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+static gboolean
+zhuyin_keyboard_check_name (const gchar *name, GError **error)
+{
+    const gchar *c;
+    guint i;
+
+    /* The built-in layouts stay as they are, and property names must not clash. */
+    for (i = 0; i < G_N_ELEMENTS (zhuyin_keyboard_layouts); i++) {
+        if (g_strcmp0 (name, zhuyin_keyboard_layouts[i].name) == 0)
+            break;
+    }
+    if (i < G_N_ELEMENTS (zhuyin_keyboard_layouts) ||
+        g_strcmp0 (name, "association") == 0 || g_strcmp0 (name, "quickmatch") == 0 ||
+        g_strcmp0 (name, "toneinference") == 0) {
+        g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                     "Layout name \"%s\" is reserved", name);
+        return FALSE;
+    }
+    for (c = name; *c != '\0'; c++) {
+        if (!g_ascii_islower (*c) && !g_ascii_isdigit (*c) && *c != '-' && *c != '_')
+            break;
+    }
+    if (*name == '\0' || *c != '\0') {
+        g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                     "Layout name \"%s\" is not lowercase ASCII", name);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Load a layout file and add it to the layouts, or replace the loaded one
+ * of the same name.  The built-in names cannot be reused.
+ *
+ * The file is a key file with a [Layout] group:
+ *
+ *   [Layout]
+ *   Name=ibm
+ *   Label=IBM
+ *   Initials=1234567890-qwertyuiop
+ *   Medials=asd
+ *   Finals=fghjkl;zxcvbn
+ *   Tones=m,./
+ *
+ * Initials, Medials, Finals and Tones give the key of every symbol in
+ * stanza order, as for the built-in layouts.  A backslash is written \\.
+ * Label may be localized as Label[zh_TW] and defaults to Name.
+ *
+ * @param path The file to load
+ * @param error Return location for the reason it was refused
+ * @return TRUE if the layout can now be found by its name
+ */
+gboolean zhuyin_keyboard_load(const gchar *path, GError **error)
+{
+    GKeyFile *file = g_key_file_new ();
+    gchar *keys[ZHUYIN_SLOT_NUMBER - 1] = { NULL };
+    gchar *name = NULL;
+    gchar *label = NULL;
+    ZhuyinKeyboard *keyboard = NULL;
+    gboolean ok;
+    guint i;
+
+    ok = g_key_file_load_from_file (file, path, G_KEY_FILE_NONE, error) &&
+         (name = g_key_file_get_string (file, "Layout", "Name", error)) != NULL &&
+         zhuyin_keyboard_check_name (name, error);
+    for (i = 0; ok && i < G_N_ELEMENTS (keys); i++) {
+        keys[i] = g_key_file_get_string (file, "Layout", zhuyin_keyboard_file_keys[i], error);
+        ok = keys[i] != NULL;
+    }
+
+    if (ok) {
+        label = g_key_file_get_locale_string (file, "Layout", "Label", NULL, NULL);
+        if (label == NULL)
+            label = g_strdup (name);
+
+        keyboard = g_new0 (ZhuyinKeyboard, 1);
+        ok = zhuyin_keyboard_compile (name, (const gchar* const*) keys, keyboard, error);
+    }
+
+    if (ok) {
+        ZhuyinKeyboard *old = (ZhuyinKeyboard *) zhuyin_keyboard_find (name);
+
+        keyboard->label = label;
+        if (old != NULL) {
+            /* Update in place, engines may hold on to the old one. */
+            g_free ((gchar *) old->name);
+            g_free ((gchar *) old->label);
+            *old = *keyboard;
+            g_free (keyboard);
+        } else {
+            g_ptr_array_add (zhuyin_keyboards, keyboard);
+        }
+        name = NULL;
+        label = NULL;
+    } else {
+        g_prefix_error (error, "%s: ", path);
+        g_free (keyboard);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (keys); i++)
+        g_free (keys[i]);
+    g_free (name);
+    g_free (label);
+    g_key_file_free (file);
+    return ok;
+}
+
+/**
+ * Load every *.layout file in a directory, in name order.
+ *
+ * Files that cannot be used are reported with g_warning() and skipped.
+ *
+ * @param path The directory, which need not exist
+ * @return Number of layouts loaded
+ */
+guint zhuyin_keyboard_load_dir(const gchar *path)
+{
+    GDir *dir = g_dir_open (path, 0, NULL);
+    GPtrArray *files;
+    const gchar *entry;
+    guint number = 0;
+    guint i;
+
+    if (dir == NULL)
+        return 0;
+
+    files = g_ptr_array_new_with_free_func (g_free);
+    while ((entry = g_dir_read_name (dir)) != NULL) {
+        if (g_str_has_suffix (entry, ".layout"))
+            g_ptr_array_add (files, g_build_filename (path, entry, NULL));
+    }
+    g_dir_close (dir);
+    g_ptr_array_sort (files, zhuyin_keyboard_compare_path);
+
+    for (i = 0; i < files->len; i++) {
+        GError *error = NULL;
+
+        if (zhuyin_keyboard_load (g_ptr_array_index (files, i), &error)) {
+            number++;
+        } else {
+            g_warning ("%s", error->message);
+            g_error_free (error);
+        }
+    }
+
+    g_ptr_array_free (files, TRUE);
+    return number;
+}
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
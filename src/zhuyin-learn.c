@@ -0,0 +1,534 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "zhuyin-learn.h"
+
+struct _ZhuyinLearn {
+    ZhuyinLearnRecord record[ZHUYIN_LEARN_SLOTS];
+    gchar *path;
+    gint ref_count;         /* guarded by stores */
+
+    /* the journal, guarded by lock once a compactor may run */
+    GMutex lock;
+    int fd;
+    gsize size;
+    gsize limit;            /* compact once size passes it */
+    gboolean compacting;
+    GArray *pending;        /* entries appended while compacting */
+    GThread *compactor;
+};
+
+/* The open stores by path, shared by every engine. */
+static GHashTable *stores = NULL;
+G_LOCK_DEFINE_STATIC (stores);
+
+/* A candidate seen by zhuyin_learn_sort(), ranked by its decayed count. */
+typedef struct {
+    guint candidate;    /* zhuyin_learn_id() until found, then the position */
+    guint count;
+} ZhuyinLearnRanked;
+
+/* What a compactor writes: one entry per record of the table. */
+typedef struct {
+    ZhuyinLearn *learn;
+    GArray *snapshot;
+} ZhuyinLearnCompaction;
+
+static void
+zhuyin_learn_fail (GError **error, const gchar *path)
+{
+    int saved = errno;
+
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved),
+                 "%s: %s", path, g_strerror (saved));
+}
+
+static gboolean
+zhuyin_learn_write (int fd, gconstpointer data, gsize length)
+{
+    const gchar *p = data;
+
+    while (length > 0) {
+        gssize n = write (fd, p, length);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        p += n;
+        length -= n;
+    }
+    return TRUE;
+}
+
+static gboolean
+zhuyin_learn_write_header (int fd)
+{
+    ZhuyinLearnHeader header = { { 0 }, ZHUYIN_LEARN_VERSION, sizeof (ZhuyinLearnEntry) };
+
+    memcpy (header.magic, ZHUYIN_LEARN_MAGIC, sizeof (header.magic));
+    return zhuyin_learn_write (fd, &header, sizeof (header));
+}
+
+/* FNV-1a */
+static guint32
+zhuyin_learn_hash (const guint8 *p, gsize length)
+{
+    guint32 hash = 2166136261u;
+    gsize i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Get the checksum a journal entry carries, FNV-1a over its record.
+ *
+ * @param record The record of the entry
+ * @return The checksum
+ */
+guint32 zhuyin_learn_check(const ZhuyinLearnRecord *record)
+{
+    return zhuyin_learn_hash ((const guint8 *) record, sizeof (*record));
+}
+
+/**
+ * Get what a candidate is learned by: the code point of a single
+ * character, or a hash of a longer one with the top bit set.
+ *
+ * @param candidate The text of the candidate
+ * @return Its id
+ */
+guint32 zhuyin_learn_id(const gchar *candidate)
+{
+    if (*candidate != '\0' && *g_utf8_next_char (candidate) == '\0')
+        return g_utf8_get_char (candidate);
+    return zhuyin_learn_hash ((const guint8 *) candidate, strlen (candidate)) | 0x80000000u;
+}
+
+/**
+ * Get the day to pass to the other functions.
+ *
+ * @return Days since the epoch
+ */
+guint zhuyin_learn_today(void)
+{
+    return g_get_real_time () / G_USEC_PER_SEC / (24 * 60 * 60);
+}
+
+/* The days from day to today, none if today comes first. */
+static guint
+zhuyin_learn_age (guint16 day, guint today)
+{
+    guint16 age = (guint16) today - day;
+
+    return age < 0x8000 ? age : 0;
+}
+
+/* The count of a record as of today. */
+static guint
+zhuyin_learn_decayed (const ZhuyinLearnRecord *record, guint today)
+{
+    guint halves = zhuyin_learn_age (record->day, today) / ZHUYIN_LEARN_HALF_LIFE;
+
+    return halves < 16 ? record->count >> halves : 0;
+}
+
+static guint
+zhuyin_learn_slot (guint16 key)
+{
+    return (key * 2654435761u >> 16) & (ZHUYIN_LEARN_SLOTS - 1);
+}
+
+/* Add count picks made on day to the table. */
+static void
+zhuyin_learn_add (ZhuyinLearn *learn, const ZhuyinLearnRecord *pick)
+{
+    ZhuyinLearnRecord *weakest = NULL;
+    guint weakest_count = G_MAXUINT;
+    guint slot, i;
+
+    slot = zhuyin_learn_slot (pick->key);
+    for (i = 0; i < ZHUYIN_LEARN_PROBES; i++) {
+        ZhuyinLearnRecord *record = &learn->record[(slot + i) & (ZHUYIN_LEARN_SLOTS - 1)];
+        guint count = record->key ? zhuyin_learn_decayed (record, pick->day) : 0;
+
+        if (record->key == pick->key && record->candidate == pick->candidate) {
+            record->count = MIN (count + pick->count, G_MAXUINT16);
+            if (zhuyin_learn_age (record->day, pick->day) > 0)
+                record->day = pick->day;
+            return;
+        }
+        if (count < weakest_count) {
+            weakest = record;
+            weakest_count = count;
+        }
+    }
+
+    *weakest = *pick;
+}
+
+static gpointer
+zhuyin_learn_compact (gpointer data)
+{
+    ZhuyinLearnCompaction *compaction = data;
+    ZhuyinLearn *learn = compaction->learn;
+    gchar *path = g_strconcat (learn->path, ".new", NULL);
+    gsize size = sizeof (ZhuyinLearnHeader) +
+                 compaction->snapshot->len * sizeof (ZhuyinLearnEntry);
+    gboolean done;
+    int fd;
+
+    fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    done = fd >= 0 &&
+           zhuyin_learn_write_header (fd) &&
+           zhuyin_learn_write (fd, compaction->snapshot->data,
+                               compaction->snapshot->len * sizeof (ZhuyinLearnEntry)) &&
+           fsync (fd) == 0;
+
+    /* what was picked meanwhile goes after the snapshot */
+    g_mutex_lock (&learn->lock);
+    if (done)
+        done = zhuyin_learn_write (fd, learn->pending->data,
+                                   learn->pending->len * sizeof (ZhuyinLearnEntry)) &&
+               g_rename (path, learn->path) == 0;
+    if (done) {
+        close (learn->fd);
+        learn->fd = fd;
+        learn->size = size + learn->pending->len * sizeof (ZhuyinLearnEntry);
+        learn->limit = MAX (ZHUYIN_LEARN_JOURNAL_LIMIT, 2 * learn->size);
+    } else {
+        if (fd >= 0) {
+            close (fd);
+            g_unlink (path);
+        }
+        learn->limit = 2 * learn->size;
+    }
+    g_array_set_size (learn->pending, 0);
+    learn->compacting = FALSE;
+    g_mutex_unlock (&learn->lock);
+
+    g_array_free (compaction->snapshot, TRUE);
+    g_free (compaction);
+    g_free (path);
+    return NULL;
+}
+
+/* Start a compactor on a snapshot of the table.  Called with lock held. */
+static void
+zhuyin_learn_start_compaction (ZhuyinLearn *learn)
+{
+    ZhuyinLearnCompaction *compaction = g_new0 (ZhuyinLearnCompaction, 1);
+    guint i;
+
+    /* a compactor that is done only has to return */
+    if (learn->compactor)
+        g_thread_join (learn->compactor);
+
+    compaction->learn = learn;
+    compaction->snapshot = g_array_new (FALSE, FALSE, sizeof (ZhuyinLearnEntry));
+    for (i = 0; i < ZHUYIN_LEARN_SLOTS; i++) {
+        ZhuyinLearnEntry entry = { learn->record[i], 0 };
+
+        if (entry.record.key == 0)
+            continue;
+        entry.check = zhuyin_learn_check (&entry.record);
+        g_array_append_val (compaction->snapshot, entry);
+    }
+
+    learn->compacting = TRUE;
+    learn->compactor = g_thread_new ("zhuyin-learn", zhuyin_learn_compact, compaction);
+}
+
+/* Add an entry to the journal. */
+static void
+zhuyin_learn_append (ZhuyinLearn *learn, const ZhuyinLearnEntry *entry)
+{
+    g_mutex_lock (&learn->lock);
+    if (zhuyin_learn_write (learn->fd, entry, sizeof (*entry)))
+        learn->size += sizeof (*entry);
+    if (learn->compacting)
+        g_array_append_vals (learn->pending, entry, 1);
+    else if (learn->size > learn->limit)
+        zhuyin_learn_start_compaction (learn);
+    g_mutex_unlock (&learn->lock);
+}
+
+/* Close the store for good. */
+static void
+zhuyin_learn_free (ZhuyinLearn *learn)
+{
+    if (learn->compactor)
+        g_thread_join (learn->compactor);
+    close (learn->fd);
+    g_array_free (learn->pending, TRUE);
+    g_mutex_clear (&learn->lock);
+    g_free (learn->path);
+    g_free (learn);
+}
+
+/**
+ * Drop a reference to the store.  The last one waits for a compactor to
+ * finish and closes it.  What was learned is already in the journal.
+ *
+ * @param learn The store to close
+ */
+void zhuyin_learn_close(ZhuyinLearn *learn)
+{
+    G_LOCK (stores);
+    if (--learn->ref_count > 0) {
+        G_UNLOCK (stores);
+        return;
+    }
+    g_hash_table_remove (stores, learn->path);
+    G_UNLOCK (stores);
+
+    zhuyin_learn_free (learn);
+}
+
+/* Open a journal not open yet. */
+static ZhuyinLearn*
+zhuyin_learn_new (const gchar *path, GError **error)
+{
+    const ZhuyinLearnHeader *header;
+    ZhuyinLearn *learn;
+    gchar *contents = NULL;
+    gsize length = 0;
+    gsize offset;
+    int fd;
+
+    fd = open (path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0 || !g_file_get_contents (path, &contents, &length, error)) {
+        if (fd >= 0)
+            close (fd);
+        else
+            zhuyin_learn_fail (error, path);
+        return NULL;
+    }
+
+    learn = g_new0 (ZhuyinLearn, 1);
+    learn->path = g_strdup (path);
+    learn->ref_count = 1;
+    g_mutex_init (&learn->lock);
+    learn->fd = fd;
+    learn->limit = ZHUYIN_LEARN_JOURNAL_LIMIT;
+    learn->pending = g_array_new (FALSE, FALSE, sizeof (ZhuyinLearnEntry));
+
+    header = (const ZhuyinLearnHeader *) contents;
+    if (length < sizeof (*header) ||
+        memcmp (header->magic, ZHUYIN_LEARN_MAGIC, sizeof (header->magic)) != 0 ||
+        header->version != ZHUYIN_LEARN_VERSION ||
+        header->entry_size != sizeof (ZhuyinLearnEntry)) {
+        offset = 0;
+    } else {
+        /* replay up to the first entry that did not make it whole */
+        for (offset = sizeof (*header); offset + sizeof (ZhuyinLearnEntry) <= length;
+             offset += sizeof (ZhuyinLearnEntry)) {
+            ZhuyinLearnEntry entry;
+
+            memcpy (&entry, contents + offset, sizeof (entry));
+            if (entry.check != zhuyin_learn_check (&entry.record) ||
+                entry.record.key == 0 || entry.record.key > ZHUYIN_STANZA_NUMBER)
+                break;
+            zhuyin_learn_add (learn, &entry.record);
+        }
+    }
+    g_free (contents);
+
+    if (offset < length && ftruncate (fd, offset) < 0) {
+        zhuyin_learn_fail (error, path);
+        zhuyin_learn_free (learn);
+        return NULL;
+    }
+    if (offset == 0 && !zhuyin_learn_write_header (fd)) {
+        zhuyin_learn_fail (error, path);
+        zhuyin_learn_free (learn);
+        return NULL;
+    }
+    learn->size = MAX (offset, sizeof (ZhuyinLearnHeader));
+    return learn;
+}
+
+/**
+ * Open the store, creating it when there is none, and replay its journal.
+ * A file that is not a journal of this version is started over.  A store
+ * already open is shared instead.
+ *
+ * @param path The journal
+ * @param error Return location for the reason it could not be opened
+ * @return A reference to the store, to drop with zhuyin_learn_close(), or
+ *         NULL on failure
+ */
+ZhuyinLearn* zhuyin_learn_open(const gchar *path, GError **error)
+{
+    ZhuyinLearn *learn;
+
+    G_LOCK (stores);
+    if (stores == NULL)
+        stores = g_hash_table_new (g_str_hash, g_str_equal);
+    learn = g_hash_table_lookup (stores, path);
+    if (learn != NULL) {
+        learn->ref_count++;
+    } else {
+        learn = zhuyin_learn_new (path, error);
+        if (learn != NULL)
+            g_hash_table_insert (stores, learn->path, learn);
+    }
+    G_UNLOCK (stores);
+
+    return learn;
+}
+
+/**
+ * Remember that a candidate was picked.
+ *
+ * @param learn The store
+ * @param stanza The Zhuyin phonetic index it was picked for
+ * @param candidate Its text
+ * @param today As returned by zhuyin_learn_today()
+ */
+void zhuyin_learn_pick(ZhuyinLearn *learn, unsigned int stanza, const gchar *candidate, guint today)
+{
+    ZhuyinLearnEntry entry;
+
+    if (!ZHUYIN_STANZA_IN_RANGE(stanza))
+        return;
+
+    entry.record.key = ZHUYIN_STANZA_KEY(stanza) + 1;
+    entry.record.count = 1;
+    entry.record.day = today;
+    entry.record.reserved = 0;
+    entry.record.candidate = zhuyin_learn_id (candidate);
+    entry.check = zhuyin_learn_check (&entry.record);
+
+    zhuyin_learn_add (learn, &entry.record);
+    zhuyin_learn_append (learn, &entry);
+}
+
+/**
+ * Tell how often a candidate was picked, decayed to today.
+ *
+ * @param learn The store
+ * @param stanza The Zhuyin phonetic index
+ * @param candidate Its text
+ * @param today As returned by zhuyin_learn_today()
+ * @return The decayed count, 0 if it was never picked or long forgotten
+ */
+guint zhuyin_learn_count(const ZhuyinLearn *learn, unsigned int stanza, const gchar *candidate, guint today)
+{
+    guint32 id;
+    guint16 key;
+    guint slot, i;
+
+    if (!ZHUYIN_STANZA_IN_RANGE(stanza))
+        return 0;
+
+    id = zhuyin_learn_id (candidate);
+    key = ZHUYIN_STANZA_KEY(stanza) + 1;
+    slot = zhuyin_learn_slot (key);
+    for (i = 0; i < ZHUYIN_LEARN_PROBES; i++) {
+        const ZhuyinLearnRecord *record = &learn->record[(slot + i) & (ZHUYIN_LEARN_SLOTS - 1)];
+
+        if (record->key == key && record->candidate == id)
+            return zhuyin_learn_decayed (record, today);
+    }
+    return 0;
+}
+
+/**
+ * Move the candidates picked most often to the front of a list, up to
+ * ZHUYIN_LEARN_PROMOTED of them, the others keeping their order.  Nothing
+ * is allocated: the new order goes into offset, which list then points at.
+ *
+ * @param learn The store
+ * @param stanza The Zhuyin phonetic index list belongs to
+ * @param list The zhuyin_candidate() list of stanza, to reorder
+ * @param offset Room for list->number offsets
+ * @param today As returned by zhuyin_learn_today()
+ */
+void zhuyin_learn_sort(const ZhuyinLearn *learn, unsigned int stanza, ZhuyinCandidates *list, guint32 *offset, guint today)
+{
+    ZhuyinLearnRanked learned[ZHUYIN_LEARN_PROBES];
+    ZhuyinLearnRanked top[ZHUYIN_LEARN_PROMOTED];
+    guint number = 0, found = 0, promoted = 0;
+    guint16 key;
+    guint slot, i, j, n;
+
+    if (!ZHUYIN_STANZA_IN_RANGE(stanza))
+        return;
+
+    key = ZHUYIN_STANZA_KEY(stanza) + 1;
+    slot = zhuyin_learn_slot (key);
+    for (i = 0; i < ZHUYIN_LEARN_PROBES; i++) {
+        const ZhuyinLearnRecord *record = &learn->record[(slot + i) & (ZHUYIN_LEARN_SLOTS - 1)];
+        ZhuyinLearnRanked item = { record->candidate, 0 };
+
+        if (record->key != key)
+            continue;
+        item.count = zhuyin_learn_decayed (record, today);
+        if (item.count > 0)
+            learned[number++] = item;
+    }
+
+    /* find them in the list, in its order, until all are */
+    for (i = 0; i < list->number && found < number; i++) {
+        guint32 id = zhuyin_learn_id (zhuyin_candidates_get (list, i));
+        ZhuyinLearnRanked item = { i, 0 };
+
+        for (j = 0; j < number && learned[j].candidate != id; j++);
+        if (j == number)
+            continue;
+        item.count = learned[j].count;
+        found++;
+
+        /* keep top sorted by count, then by list order */
+        for (j = promoted; j > 0; j--) {
+            if (top[j - 1].count >= item.count)
+                break;
+            if (j < ZHUYIN_LEARN_PROMOTED)
+                top[j] = top[j - 1];
+        }
+        if (j < ZHUYIN_LEARN_PROMOTED) {
+            top[j] = item;
+            if (promoted < ZHUYIN_LEARN_PROMOTED)
+                promoted++;
+        }
+    }
+    if (promoted == 0)
+        return;
+
+    for (n = 0; n < promoted; n++)
+        offset[n] = list->offset[top[n].candidate];
+    for (i = 0; i < list->number; i++) {
+        for (j = 0; j < promoted && top[j].candidate != i; j++);
+        if (j == promoted)
+            offset[n++] = list->offset[i];
+    }
+    list->offset = offset;
+}
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
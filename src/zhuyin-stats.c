@@ -0,0 +1,174 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include <glib.h>
+#include "zhuyin-stats.h"
+
+typedef struct {
+    gint bucket[ZHUYIN_STATS_BUCKETS];
+    gint max;                   /* microseconds, rounded up */
+} ZhuyinStatsHistogram;
+
+static const gchar *phase_names[ZHUYIN_STATS_NUMBER] = {
+    "key", "preedit", "candidate", "leading", "phrase", "lookup"
+};
+
+static ZhuyinStatsHistogram histograms[ZHUYIN_STATS_NUMBER];
+
+gint zhuyin_stats_enabled = FALSE;
+
+/**
+ * Start or stop timing the phases.  What was counted so far is kept.
+ *
+ * @param enable TRUE to time them
+ */
+void zhuyin_stats_enable (gboolean enable)
+{
+    g_atomic_int_set (&zhuyin_stats_enabled, enable != FALSE);
+}
+
+/**
+ * Get the time of the monotonic clock.
+ *
+ * @return Nanoseconds since some point, never 0
+ */
+gint64 zhuyin_stats_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (gint64) ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec + 1;
+}
+
+/**
+ * Count a time taken by a phase.
+ *
+ * @param phase The phase
+ * @param ns How long it took, in nanoseconds
+ */
+void zhuyin_stats_add (ZhuyinStatsPhase phase, gint64 ns)
+{
+    ZhuyinStatsHistogram *histogram = &histograms[phase];
+    guint i;
+    gint value, max;
+
+    if (ns < 0)
+        ns = 0;
+    i = ns > 0 ? g_bit_storage ((gulong) ns) : 0;
+    if (i >= ZHUYIN_STATS_BUCKETS)
+        i = ZHUYIN_STATS_BUCKETS - 1;
+    g_atomic_int_inc (&histogram->bucket[i]);
+
+    value = (gint) MIN ((ns + 999) / 1000, G_MAXINT);
+    do {
+        max = g_atomic_int_get (&histogram->max);
+    } while (value > max && !g_atomic_int_compare_and_exchange (&histogram->max, max, value));
+}
+
+/* The longest time of the bucket holding the nth time, no more than max. */
+static gint64
+zhuyin_stats_percentile (const gint *bucket, guint count, guint percent, gint64 max)
+{
+    guint rank = (count * percent + 99) / 100;
+    guint seen = 0;
+    guint i;
+
+    for (i = 0; i < ZHUYIN_STATS_BUCKETS; i++) {
+        seen += bucket[i];
+        if (seen >= rank && seen > 0)
+            return MIN ((gint64) 1 << i, max);
+    }
+    return max;
+}
+
+/**
+ * Sum up the times of a phase.  Times counted meanwhile may or may not
+ * be in it.
+ *
+ * @param phase The phase
+ * @param summary Where to put the count, the median, the 99th percentile
+ *                and the longest
+ */
+void zhuyin_stats_summary (ZhuyinStatsPhase phase, ZhuyinStatsSummary *summary)
+{
+    gint bucket[ZHUYIN_STATS_BUCKETS];
+    guint i;
+
+    summary->count = 0;
+    for (i = 0; i < ZHUYIN_STATS_BUCKETS; i++) {
+        bucket[i] = g_atomic_int_get (&histograms[phase].bucket[i]);
+        summary->count += bucket[i];
+    }
+    summary->max = (gint64) g_atomic_int_get (&histograms[phase].max) * 1000;
+    summary->p50 = zhuyin_stats_percentile (bucket, summary->count, 50, summary->max);
+    summary->p99 = zhuyin_stats_percentile (bucket, summary->count, 99, summary->max);
+}
+
+/**
+ * Forget the times counted so far.
+ */
+void zhuyin_stats_reset (void)
+{
+    guint phase, i;
+
+    for (phase = 0; phase < ZHUYIN_STATS_NUMBER; phase++) {
+        for (i = 0; i < ZHUYIN_STATS_BUCKETS; i++)
+            g_atomic_int_set (&histograms[phase].bucket[i], 0);
+        g_atomic_int_set (&histograms[phase].max, 0);
+    }
+}
+
+/**
+ * Put the summary of every phase into a table, in microseconds.
+ *
+ * @return The table, to be freed with g_free()
+ */
+gchar* zhuyin_stats_report (void)
+{
+    GString *report = g_string_new ("# phase      count      p50 us      p99 us      max us\n");
+    guint phase;
+
+    for (phase = 0; phase < ZHUYIN_STATS_NUMBER; phase++) {
+        ZhuyinStatsSummary summary;
+
+        zhuyin_stats_summary (phase, &summary);
+        g_string_append_printf (report, "%-10s %7u %11.1f %11.1f %11.1f\n",
+                                phase_names[phase], summary.count,
+                                summary.p50 / 1000.0, summary.p99 / 1000.0, summary.max / 1000.0);
+    }
+    return g_string_free (report, FALSE);
+}
+
+/**
+ * Write zhuyin_stats_report() to a file, replacing it.
+ *
+ * @param path The file
+ * @param error Return location for why it could not be written
+ * @return TRUE if written
+ */
+gboolean zhuyin_stats_write (const gchar *path, GError **error)
+{
+    gchar *report = zhuyin_stats_report ();
+    gboolean retval = g_file_set_contents (path, report, -1, error);
+
+    g_free (report);
+    return retval;
+}
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
@@ -0,0 +1,242 @@
+/* -*- coding: utf-8; indent-tabs-mode: nil; tab-width: 4; c-basic-offset: 4; -*- */
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include <ibus.h>
+#include "zhuyin-trace.h"
+
+typedef struct {
+    gint stamp;                 /* 1 + the number of the event, 0 while written */
+    ZhuyinTraceEvent event;
+} ZhuyinTraceSlot;
+
+static ZhuyinTraceSlot ring[ZHUYIN_TRACE_SIZE];
+static gint head = 0;           /* events recorded so far */
+
+static gboolean redact = TRUE;
+static gint64 slow = 0;
+static gchar *slow_path = NULL;
+static gint dump_pending = FALSE;
+
+gint zhuyin_trace_enabled = FALSE;
+
+/**
+ * Start or stop recording keys.
+ *
+ * @param enable TRUE to record them
+ * @param redacted TRUE to leave out what was typed
+ */
+void zhuyin_trace_enable (gboolean enable, gboolean redacted)
+{
+    redact = redacted;
+    g_atomic_int_set (&zhuyin_trace_enabled, enable != FALSE);
+}
+
+/**
+ * Write the trace to a file soon after a slow key.  Keys slow one after
+ * the other are written once.
+ *
+ * @param ns How slow a key is to be written, in nanoseconds, 0 for never
+ * @param path The file
+ */
+void zhuyin_trace_dump_slow (gint64 ns, const gchar *path)
+{
+    g_free (slow_path);
+    slow_path = g_strdup (path);
+    slow = path != NULL ? ns : 0;
+}
+
+/* After the slow key is done with, not while handling it. */
+static gboolean
+zhuyin_trace_dump_idle (gpointer user_data)
+{
+    GError *error = NULL;
+
+    if (slow_path != NULL && !zhuyin_trace_write (slow_path, &error)) {
+        g_warning ("%s", error->message);
+        g_error_free (error);
+    }
+    g_atomic_int_set (&dump_pending, FALSE);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * What is left of a key once redacted: editing, moving and modifier keys
+ * tell nothing of what was typed.  Every other key, keypad digits and dead
+ * keys too, is redacted.
+ */
+static gboolean
+is_kept_key (guint keyval)
+{
+    switch (keyval) {
+        case IBUS_BackSpace:
+        case IBUS_Delete:
+        case IBUS_Return:
+        case IBUS_Escape:
+        case IBUS_Tab:
+        case IBUS_ISO_Left_Tab:
+        case IBUS_Left:
+        case IBUS_Up:
+        case IBUS_Right:
+        case IBUS_Down:
+        case IBUS_Page_Up:
+        case IBUS_Page_Down:
+        case IBUS_Home:
+        case IBUS_End:
+        case IBUS_Shift_L:
+        case IBUS_Shift_R:
+        case IBUS_Control_L:
+        case IBUS_Control_R:
+        case IBUS_Caps_Lock:
+        case IBUS_Shift_Lock:
+        case IBUS_Meta_L:
+        case IBUS_Meta_R:
+        case IBUS_Alt_L:
+        case IBUS_Alt_R:
+        case IBUS_Super_L:
+        case IBUS_Super_R:
+        case IBUS_Hyper_L:
+        case IBUS_Hyper_R:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * Put a key into the ring, over the oldest one once full.
+ *
+ * @param event The key
+ */
+void zhuyin_trace_record (const ZhuyinTraceEvent *event)
+{
+    guint n = (guint) g_atomic_int_add (&head, 1);
+    ZhuyinTraceSlot *slot = &ring[n % ZHUYIN_TRACE_SIZE];
+
+    g_atomic_int_set (&slot->stamp, 0);
+    slot->event = *event;
+    if (redact) {
+        if (!is_kept_key (event->keyval))
+            slot->event.keyval = ZHUYIN_TRACE_REDACTED;
+        slot->event.stanza = 0;
+        slot->event.candidates = 0;
+    }
+    g_atomic_int_set (&slot->stamp, (gint) (n + 1));
+
+    if (slow > 0 && event->duration >= slow &&
+        g_atomic_int_compare_and_exchange (&dump_pending, FALSE, TRUE))
+        g_idle_add (zhuyin_trace_dump_idle, NULL);
+}
+
+/**
+ * Copy the last keys out of the ring.  A key being recorded meanwhile is
+ * left out.
+ *
+ * @param events Where to put them, the oldest first
+ * @param number How many there is room for
+ * @return How many were copied
+ */
+guint zhuyin_trace_snapshot (ZhuyinTraceEvent *events, guint number)
+{
+    guint end = (guint) g_atomic_int_get (&head);
+    guint begin = end - MIN (MIN (end, ZHUYIN_TRACE_SIZE), number);
+    guint count = 0;
+    guint n;
+
+    for (n = begin; n != end; n++) {
+        ZhuyinTraceSlot *slot = &ring[n % ZHUYIN_TRACE_SIZE];
+
+        if ((guint) g_atomic_int_get (&slot->stamp) != n + 1)
+            continue;
+        events[count] = slot->event;
+        if ((guint) g_atomic_int_get (&slot->stamp) == n + 1)
+            count++;
+    }
+    return count;
+}
+
+/**
+ * Forget the keys recorded so far.
+ */
+void zhuyin_trace_reset (void)
+{
+    guint i;
+
+    for (i = 0; i < ZHUYIN_TRACE_SIZE; i++)
+        g_atomic_int_set (&ring[i].stamp, 0);
+    g_atomic_int_set (&head, 0);
+}
+
+/*
+ * The kinds of messages to IBus in the report, one letter a bit from
+ * ZHUYIN_TRACE_COMMIT on: commit, preedit, table shown, table hidden, aux.
+ */
+static const gchar call_letters[] = "cpsha";
+
+/**
+ * Put the last keys into a table, one a line, the oldest first.
+ *
+ * @return The table, to be freed with g_free()
+ */
+gchar* zhuyin_trace_report (void)
+{
+    ZhuyinTraceEvent *events = g_new (ZhuyinTraceEvent, ZHUYIN_TRACE_SIZE);
+    guint count = zhuyin_trace_snapshot (events, ZHUYIN_TRACE_SIZE);
+    GString *report = g_string_new ("# seconds     keyval   modifiers  mode stanza      candidates emitted calls         us\n");
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        const ZhuyinTraceEvent *event = &events[i];
+        gchar keyval[16];
+        gchar calls[sizeof (call_letters)];
+        guint j;
+
+        if (event->keyval == ZHUYIN_TRACE_REDACTED)
+            g_strlcpy (keyval, "*", sizeof (keyval));
+        else
+            g_snprintf (keyval, sizeof (keyval), "0x%04x", event->keyval);
+        for (j = 0; j < sizeof (calls) - 1; j++)
+            calls[j] = event->calls & (1 << j) ? call_letters[j] : '-';
+        calls[j] = '\0';
+        g_string_append_printf (report, "%13.6f %-8s 0x%08x %u>%u  0x%08x %10u %7u %-5s %10.1f%s\n",
+                                event->time / 1e9, keyval, event->modifiers,
+                                event->mode_before, event->mode_after, event->stanza,
+                                event->candidates, event->emitted, calls, event->duration / 1000.0,
+                                event->handled ? "" : " passed");
+    }
+    g_free (events);
+    return g_string_free (report, FALSE);
+}
+
+/**
+ * Write zhuyin_trace_report() to a file, replacing it.
+ *
+ * @param path The file
+ * @param error Return location for why it could not be written
+ * @return TRUE if written
+ */
+gboolean zhuyin_trace_write (const gchar *path, GError **error)
+{
+    gchar *report = zhuyin_trace_report ();
+    gboolean retval = g_file_set_contents (path, report, -1, error);
+
+    g_free (report);
+    return retval;
+}
+
+/* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
@@ -18,59 +18,403 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 #include "zhuyin.h"
-#include "phone.h"
+#include "zhuyin-backend.h"
+#include "zhuyin-dict.h"
 
-static guchar *initialized_flags = NULL;
+/* The backend every lookup goes to, the builtin one until told otherwise. */
+static ZhuyinBackend *zhuyin_backend = NULL;
+
+/* One bit per ZHUYIN_STANZA_KEY(), set if the backend has candidates for it. */
+static guint32 zhuyin_valid[(ZHUYIN_STANZA_NUMBER + 31) / 32];
+
+/*
+ * For a partial stanza and each slot left empty in it, the bit of every
+ * index that slot may take on the way to a valid stanza, bit 0 standing
+ * for leaving it empty.
+ */
+static guint32 zhuyin_next[ZHUYIN_STANZA_NUMBER][ZHUYIN_SLOT_NUMBER - 1];
+
+/* The tones each syllable is said in, indexed by the key of its toneless stanza. */
+static guint8 zhuyin_tone[ZHUYIN_STANZA_NUMBER / ZHUYIN_TONE_NUMBER];
+
+/* The fuzzy rules in use, ZHUYIN_FUZZY_* flags. */
+static guint zhuyin_fuzzy_rules = 0;
+
+/* The pair of symbols behind each fuzzy rule, in ZHUYIN_FUZZY_* bit order. */
+static const struct {
+    guint slot;
+    guint8 index[2];
+} zhuyin_fuzzy_pairs[ZHUYIN_FUZZY_NUMBER] = {
+    { ZHUYIN_SLOT_FINAL,   { 10, 12 } },    /* ㄣ ㄥ */
+    { ZHUYIN_SLOT_INITIAL, { 15, 19 } },    /* ㄓ ㄗ */
+    { ZHUYIN_SLOT_INITIAL, { 16, 20 } },    /* ㄔ ㄘ */
+    { ZHUYIN_SLOT_INITIAL, { 17, 21 } },    /* ㄕ ㄙ */
+};
+
+/*
+ * The candidates of every stanza the rules in use make equal to another
+ * syllable, its own first, compiled by zhuyin_update_fuzzy().  Stanzas the
+ * rules leave alone have no list here.
+ */
+static ZhuyinDictBuilder zhuyin_fuzzy_builder;
+static ZhuyinDictTable zhuyin_fuzzy;
+
+static void zhuyin_mark_valid(guint stanza, const ZhuyinCandidates* list, gpointer user_data)
+{
+    guint key = ZHUYIN_STANZA_KEY(stanza);
+    guint empty, slot;
+
+    zhuyin_valid[key / 32] |= 1u << (key % 32);
+    zhuyin_tone[ZHUYIN_STANZA_KEY(stanza & 0xffffff)] |= 1u << ZHUYIN_TONE(stanza);
+
+    /* every way of leaving some slots out is a prefix of this stanza */
+    for (empty = 1; empty < 1u << (ZHUYIN_SLOT_NUMBER - 1); empty++) {
+        guint prefix = stanza;
+
+        for (slot = 0; slot < ZHUYIN_SLOT_NUMBER - 1; slot++) {
+            if (empty & (1u << slot))
+                prefix &= ~(0xffu << (slot * 8));
+        }
+        key = ZHUYIN_STANZA_KEY(prefix);
+        for (slot = 0; slot < ZHUYIN_SLOT_NUMBER - 1; slot++) {
+            if (empty & (1u << slot))
+                zhuyin_next[key][slot] |= 1u << ((stanza >> (slot * 8)) & 0xff);
+        }
+    }
+}
+
+/*
+ * Merge the lists of each stanza and the stanzas the fuzzy rules make equal
+ * to it, each candidate once.  The strings are copied, so a lookup costs
+ * no more than zhuyin_candidate().
+ */
+static void zhuyin_update_fuzzy(void)
+{
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    GString *merged = g_string_new("");
+    guint8 partner[ZHUYIN_SLOT_NUMBER - 1][ZHUYIN_INITIAL_NUMBER];
+    guint rule, slot, key, number, i;
+
+    if (zhuyin_fuzzy.index != NULL)
+        zhuyin_dict_builder_clear(&zhuyin_fuzzy_builder);
+    memset(&zhuyin_fuzzy, 0, sizeof(zhuyin_fuzzy));
+    if (zhuyin_fuzzy_rules == 0) {
+        g_string_free(merged, TRUE);
+        g_hash_table_destroy(seen);
+        return;
+    }
+
+    /* each index stands for itself unless a rule pairs it */
+    for (slot = 0; slot < ZHUYIN_SLOT_NUMBER - 1; slot++) {
+        for (i = 0; i < ZHUYIN_INITIAL_NUMBER; i++)
+            partner[slot][i] = i;
+    }
+    for (rule = 0; rule < ZHUYIN_FUZZY_NUMBER; rule++) {
+        if (zhuyin_fuzzy_rules & (1u << rule)) {
+            slot = zhuyin_fuzzy_pairs[rule].slot - 1;
+            partner[slot][zhuyin_fuzzy_pairs[rule].index[0]] = zhuyin_fuzzy_pairs[rule].index[1];
+            partner[slot][zhuyin_fuzzy_pairs[rule].index[1]] = zhuyin_fuzzy_pairs[rule].index[0];
+        }
+    }
+
+    zhuyin_dict_builder_init(&zhuyin_fuzzy_builder, ZHUYIN_STANZA_NUMBER);
+    for (key = 0; key < ZHUYIN_STANZA_NUMBER; key++) {
+        guint stanza = ZHUYIN_KEY_STANZA(key);
+        guint initial = partner[ZHUYIN_SLOT_INITIAL - 1][ZHUYIN_INITIAL(stanza)];
+        guint final = partner[ZHUYIN_SLOT_FINAL - 1][ZHUYIN_FINAL(stanza)];
+        guint variant[4];
+        guint found = 0, u, v;
+
+        /* the stanza itself, then with its initial, final or both swapped */
+        variant[0] = stanza;
+        variant[1] = (stanza & ~0xffu) | initial;
+        variant[2] = (stanza & ~0xff0000u) | final << 16;
+        variant[3] = (variant[1] & ~0xff0000u) | final << 16;
+        if (variant[1] == stanza && variant[2] == stanza)
+            continue;
+
+        g_string_truncate(merged, 0);
+        for (v = 0; v < G_N_ELEMENTS(variant); v++) {
+            ZhuyinCandidates list;
+
+            for (u = 0; u < v && variant[u] != variant[v]; u++);
+            if (u < v)
+                continue;
+            number = zhuyin_backend_candidate(zhuyin_backend, variant[v], &list);
+            for (i = 0; i < number; i++) {
+                const gchar *candidate = zhuyin_candidates_get(&list, i);
+
+                if (g_hash_table_contains(seen, candidate))
+                    continue;
+                g_hash_table_add(seen, (gpointer) candidate);
+                if (v > 0)
+                    found++;
+                if (merged->len > 0)
+                    g_string_append_c(merged, ' ');
+                g_string_append(merged, candidate);
+            }
+        }
+        g_hash_table_remove_all(seen);
+
+        /* the keys are fresh and the candidates came from valid lists */
+        if (found > 0)
+            zhuyin_dict_builder_add(&zhuyin_fuzzy_builder, key, merged->str, &number, NULL);
+    }
+    zhuyin_dict_builder_finish(&zhuyin_fuzzy_builder, &zhuyin_fuzzy);
+
+    g_string_free(merged, TRUE);
+    g_hash_table_destroy(seen);
+}
+
+static void zhuyin_update_valid(void)
+{
+    guint key;
+
+    memset(zhuyin_valid, 0, sizeof(zhuyin_valid));
+    memset(zhuyin_next, 0, sizeof(zhuyin_next));
+    memset(zhuyin_tone, 0, sizeof(zhuyin_tone));
+    zhuyin_backend_foreach(zhuyin_backend, zhuyin_mark_valid, NULL);
+
+    /* a stanza the fuzzy rules give candidates is as good as a syllable */
+    zhuyin_update_fuzzy();
+    for (key = 0; key < zhuyin_fuzzy.index_number; key++) {
+        if (zhuyin_fuzzy.index[key] != 0)
+            zhuyin_mark_valid(ZHUYIN_KEY_STANZA(key), NULL, NULL);
+    }
+}
 
 /**
  * Initialize the Zhuyin input method data structures.
+ *
+ * The tables are generated and pre-split at build time, so all that is
+ * left is to fall back on the builtin backend if none is in use yet.
  */
 void zhuyin_init(void)
 {
-    if (initialized_flags == NULL) {
-        initialized_flags = g_new0(guchar, phone_length);
+    if (zhuyin_backend == NULL) {
+        zhuyin_backend = zhuyin_backend_open(&zhuyin_backend_builtin, NULL, NULL, NULL);
+        zhuyin_update_valid();
     }
 }
 
 /**
- * Get candidate characters for a given Zhuyin index.
+ * Send every later lookup to another backend.
+ *
+ * The backend in use so far is closed.  Call it before the first lookup,
+ * the views handed out before are gone with the old backend.
+ *
+ * @param backend An open backend, owned by zhuyin.c from now on
+ */
+void zhuyin_use(ZhuyinBackend* backend)
+{
+    ZhuyinBackend *old = zhuyin_backend;
+
+    zhuyin_backend = backend;
+    if (old != NULL)
+        zhuyin_backend_close(old);
+    zhuyin_update_valid();
+}
+
+/**
+ * Get the backend the lookups go to.
+ *
+ * @return The backend in use, still owned by zhuyin.c
+ */
+ZhuyinBackend* zhuyin_get_backend(void)
+{
+    zhuyin_init();
+    return zhuyin_backend;
+}
+
+/**
+ * Switch the lookups over to a dictionary compiled by zhuyin-dict-compile.
+ *
+ * The file is mapped read-only and used in place.  Call it before the
+ * first lookup; on failure the current backend stays in use.
+ *
+ * @param path Path of the compiled dictionary
+ * @param error Return location for the reason it could not be used
+ * @return TRUE if the dictionary is now in use
+ */
+gboolean zhuyin_load(const gchar* path, GError** error)
+{
+    ZhuyinBackend *backend = zhuyin_backend_open(&zhuyin_backend_mapped, path, NULL, error);
+
+    if (backend == NULL)
+        return FALSE;
+
+    zhuyin_use(backend);
+    return TRUE;
+}
+
+/**
+ * Tell whether a stanza is a syllable with candidates, without looking
+ * the candidates up.
  *
  * @param index The Zhuyin phonetic index
- * @param number Pointer to store the number of candidates
- * @return Array of candidate strings, NULL-terminated
+ * @return TRUE if zhuyin_fuzzy_candidate() would find candidates
  */
-gchar** zhuyin_candidate(unsigned int index, unsigned int* number)
+gboolean zhuyin_is_valid(unsigned int index)
 {
-    int low = 0;
-    int high = phone_length - 1;
+    guint key;
 
-    if (G_UNLIKELY(initialized_flags == NULL)) {
-        zhuyin_init();
-    }
+    if (!ZHUYIN_STANZA_IN_RANGE(index))
+        return FALSE;
 
-    while (low <= high) {
-        int mid = (low + high) / 2;
-        if (phone_table[mid].index > index) {
-            high = mid - 1;
-        } else if (phone_table[mid].index < index) {
-            low = mid + 1;
-        } else {
-            if (number != NULL) {
-                *number = phone_table[mid].number;
-            }
+    zhuyin_init();
+    key = ZHUYIN_STANZA_KEY(index);
+    return (zhuyin_valid[key / 32] >> (key % 32)) & 1;
+}
 
-            if (initialized_flags[mid] == 0) {
-                const gchar *raw = phone_table[mid].candidate.string;
-                phone_table[mid].candidate.member = g_strsplit(raw, " ", 0);
-                initialized_flags[mid] = 1;
-            }
-            return phone_table[mid].candidate.member;
-        }
+/**
+ * Tell which symbols of a slot keep a partial stanza on the way to a valid
+ * one.  Whatever the slot holds now is replaced, the other slots are kept
+ * and the empty ones may still be filled in.
+ *
+ * @param index The Zhuyin phonetic index typed so far
+ * @param slot ZHUYIN_SLOT_INITIAL to ZHUYIN_SLOT_TONE
+ * @return A mask with bit i set if the slot may take index i, bit 0 for empty
+ */
+guint32 zhuyin_reachable(unsigned int index, guint slot)
+{
+    if (slot < ZHUYIN_SLOT_INITIAL || slot > ZHUYIN_SLOT_TONE)
+        return 0;
+
+    index &= ~(0xffu << ((slot - 1) * 8));
+    if (!ZHUYIN_STANZA_IN_RANGE(index))
+        return 0;
+
+    zhuyin_init();
+    return zhuyin_next[ZHUYIN_STANZA_KEY(index)][slot - 1];
+}
+
+/**
+ * Tell which tones a syllable is said in, whatever tone the stanza holds.
+ *
+ * @param index The Zhuyin phonetic index
+ * @return A mask with bit t set if the syllable has candidates in tone t
+ */
+guint zhuyin_tones(unsigned int index)
+{
+    index &= 0xffffff;
+    if (!ZHUYIN_STANZA_IN_RANGE(index))
+        return 0;
+
+    zhuyin_init();
+    return zhuyin_tone[ZHUYIN_STANZA_KEY(index)];
+}
+
+/**
+ * Make some pairs of symbols stand for each other from now on.  The rules
+ * are compiled into merged lists right away, the views handed out before
+ * by zhuyin_fuzzy_candidate() are gone.
+ *
+ * @param rules ZHUYIN_FUZZY_* flags, 0 to match exactly
+ */
+void zhuyin_set_fuzzy(guint rules)
+{
+    rules &= (1u << ZHUYIN_FUZZY_NUMBER) - 1;
+    if (rules == zhuyin_fuzzy_rules)
+        return;
+
+    zhuyin_fuzzy_rules = rules;
+    if (zhuyin_backend != NULL)
+        zhuyin_update_valid();
+}
+
+/**
+ * Get the fuzzy rules in use.
+ *
+ * @return ZHUYIN_FUZZY_* flags
+ */
+guint zhuyin_get_fuzzy(void)
+{
+    return zhuyin_fuzzy_rules;
+}
+
+/**
+ * Get the candidates of a stanza and of every syllable the fuzzy rules
+ * make equal to it, its own first and each candidate once.  Without a
+ * rule that applies this is zhuyin_candidate().
+ *
+ * @param index The Zhuyin phonetic index
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, 0 if neither the stanza nor its equals have any
+ */
+guint zhuyin_fuzzy_candidate(unsigned int index, ZhuyinCandidates* list)
+{
+    guint number;
+
+    zhuyin_init();
+    if (zhuyin_fuzzy.index != NULL && ZHUYIN_STANZA_IN_RANGE(index)) {
+        number = zhuyin_dict_table_lookup(&zhuyin_fuzzy, ZHUYIN_STANZA_KEY(index), list);
+        if (number > 0)
+            return number;
     }
+    return zhuyin_candidate(index, list);
+}
+
+/**
+ * Get candidate characters for a given Zhuyin index.
+ *
+ * @param index The Zhuyin phonetic index
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, 0 if the index has none
+ */
+guint zhuyin_candidate(unsigned int index, ZhuyinCandidates* list)
+{
+    ZhuyinBackend *backend = zhuyin_get_backend();
+
+    return zhuyin_backend_candidate(backend, index, list);
+}
+
+/**
+ * Get the candidates of a syllable in all of its tones, for picking one
+ * before the tone is typed.  They come by tone, then in the order each
+ * tone lists them, so the lookup costs the same as zhuyin_candidate().
+ *
+ * @param index The Zhuyin phonetic index, its tone is ignored
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, 0 if the syllable has none in any tone
+ */
+guint zhuyin_toneless(unsigned int index, ZhuyinCandidates* list)
+{
+    ZhuyinBackend *backend = zhuyin_get_backend();
+
+    return zhuyin_backend_toneless(backend, index, list);
+}
+
+/**
+ * Get the best candidates of every syllable that starts with the slots
+ * typed so far, for picking one after a key or two.  The lists are ranked
+ * and capped at ZHUYIN_PREFIX_LIMIT when the dictionary is built.
+ *
+ * @param index The Zhuyin phonetic index of the typed slots, its tone is ignored
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, 0 if no syllable starts that way
+ */
+guint zhuyin_prefix(unsigned int index, ZhuyinCandidates* list)
+{
+    ZhuyinBackend *backend = zhuyin_get_backend();
+
+    return zhuyin_backend_prefix(backend, index, list);
+}
+
+/**
+ * Get association candidates for a committed character.
+ *
+ * @param text The committed text, a single character to match
+ * @param list View to fill in with the candidates, may be NULL
+ * @return Number of candidates, 0 if the text has none
+ */
+guint zhuyin_association(const gchar* text, ZhuyinCandidates* list)
+{
+    ZhuyinBackend *backend = zhuyin_get_backend();
 
-    return NULL;
+    return zhuyin_backend_association(backend, text, list);
 }
 
 /* vim:set fileencodings=utf-8 tabstop=4 expandtab shiftwidth=4 softtabstop=4: */
\ No newline at end of file
@@ -0,0 +1,822 @@
+#include <glib.h>
+/**
+ * Copyright (C) 2026 Shih-Yuan Lee (FourDollars) <fourdollars@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Correctness checks and benchmarks for the dictionary lookups.
+ *
+ * The checks always run.  The timings only run in perf mode:
+ *
+ *   $ make -C tests bench
+ */
+
+// Include source directly to access the generated tables
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "../src/zhuyin.c"
+#include "../src/zhuyin-backend.c"
+#include "phone.h"
+#include "phrases.h"
+
+#define BENCH_ROUNDS 2000
+
+/* The lookup zhuyin_candidate() used before the stanza index. */
+static gint
+binary_search (unsigned int index)
+{
+    int low = 0;
+    int high = phone_length - 1;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (phone_table[mid].index > index) {
+            high = mid - 1;
+        } else if (phone_table[mid].index < index) {
+            low = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+
+    return -1;
+}
+
+static void test_stanza_index() {
+    guint initial, medial, final, tone;
+
+    zhuyin_init();
+
+    // Every stanza in range, valid or not, must agree with the binary search.
+    for (tone = 0; tone < ZHUYIN_TONE_NUMBER; tone++)
+    for (final = 0; final < ZHUYIN_FINAL_NUMBER; final++)
+    for (medial = 0; medial < ZHUYIN_MEDIAL_NUMBER; medial++)
+    for (initial = 0; initial < ZHUYIN_INITIAL_NUMBER; initial++) {
+        guint stanza = initial | medial << 8 | final << 16 | tone << 24;
+        gint expected = binary_search(stanza);
+        guint number = zhuyin_candidate(stanza, NULL);
+
+        if (expected < 0) {
+            g_assert_cmpuint(number, ==, 0);
+        } else {
+            g_assert_cmpuint(number, ==, phone_table[expected].number);
+        }
+    }
+
+    // Stanzas outside the packed ranges are rejected, not probed.
+    g_assert_cmpuint(zhuyin_candidate(22, NULL), ==, 0);
+    g_assert_cmpuint(zhuyin_candidate(4 << 8, NULL), ==, 0);
+    g_assert_cmpuint(zhuyin_candidate(14 << 16, NULL), ==, 0);
+    g_assert_cmpuint(zhuyin_candidate(5 << 24, NULL), ==, 0);
+}
+
+static void test_candidate_pool() {
+    gint i;
+    guint j;
+
+    // The pre-split pool must hold exactly what splitting phone.h gives.
+    for (i = 0; i < phone_length; i++) {
+        ZhuyinCandidates list;
+        gchar **member = g_strsplit(phone_table[i].candidate.string, " ", 0);
+
+        g_assert_cmpuint(zhuyin_candidate(phone_table[i].index, &list), ==, g_strv_length(member));
+        g_assert_cmpuint(list.number, ==, g_strv_length(member));
+        for (j = 0; j < list.number; j++) {
+            g_assert_cmpstr(zhuyin_candidates_get(&list, j), ==, member[j]);
+        }
+        g_strfreev(member);
+    }
+}
+
+static void test_association() {
+    gint i;
+    guint j;
+
+    // Every phrase key resolves to its own list, split exactly like before.
+    for (i = 0; phrase_table[i].key != NULL; i++) {
+        ZhuyinCandidates list;
+        gchar **member = g_strsplit(phrase_table[i].candidates, " ", 0);
+
+        g_assert_cmpuint(zhuyin_association(phrase_table[i].key, &list), ==, g_strv_length(member));
+        for (j = 0; j < list.number; j++) {
+            g_assert_cmpstr(zhuyin_candidates_get(&list, j), ==, member[j]);
+        }
+        g_strfreev(member);
+    }
+
+    // Anything that is not a single known CJK character has no list.
+    g_assert_cmpuint(zhuyin_association(NULL, NULL), ==, 0);
+    g_assert_cmpuint(zhuyin_association("", NULL), ==, 0);
+    g_assert_cmpuint(zhuyin_association("a", NULL), ==, 0);
+    g_assert_cmpuint(zhuyin_association("ㄅ", NULL), ==, 0);
+    g_assert_cmpuint(zhuyin_association("，", NULL), ==, 0);
+    g_assert_cmpuint(zhuyin_association("一一", NULL), ==, 0);
+}
+
+static void assert_same_dict(const ZhuyinDict *a, const ZhuyinDict *b) {
+    guint key;
+
+    g_assert_cmpuint(a->syllable.index_number, ==, b->syllable.index_number);
+    g_assert_cmpuint(a->association.index_number, ==, b->association.index_number);
+    for (key = 0; key < a->syllable.index_number; key++) {
+        ZhuyinCandidates x, y;
+        guint j, number = zhuyin_dict_table_lookup(&a->syllable, key, &x);
+
+        g_assert_cmpuint(zhuyin_dict_table_lookup(&b->syllable, key, &y), ==, number);
+        for (j = 0; j < number; j++)
+            g_assert_cmpstr(zhuyin_candidates_get(&x, j), ==, zhuyin_candidates_get(&y, j));
+    }
+    for (key = 0; key < a->association.index_number; key++) {
+        ZhuyinCandidates x, y;
+        guint j, number = zhuyin_dict_table_lookup(&a->association, key, &x);
+
+        g_assert_cmpuint(zhuyin_dict_table_lookup(&b->association, key, &y), ==, number);
+        for (j = 0; j < number; j++)
+            g_assert_cmpstr(zhuyin_candidates_get(&x, j), ==, zhuyin_candidates_get(&y, j));
+    }
+    for (key = 0; key < ZHUYIN_TONELESS_NUMBER; key++) {
+        ZhuyinCandidates x, y;
+        guint j, number = zhuyin_dict_table_lookup(&a->toneless, key, &x);
+
+        g_assert_cmpuint(zhuyin_dict_table_lookup(&b->toneless, key, &y), ==, number);
+        for (j = 0; j < number; j++)
+            g_assert_cmpstr(zhuyin_candidates_get(&x, j), ==, zhuyin_candidates_get(&y, j));
+
+        number = zhuyin_dict_table_lookup(&a->prefix, key, &x);
+        g_assert_cmpuint(zhuyin_dict_table_lookup(&b->prefix, key, &y), ==, number);
+        for (j = 0; j < number; j++)
+            g_assert_cmpstr(zhuyin_candidates_get(&x, j), ==, zhuyin_candidates_get(&y, j));
+    }
+}
+
+static void test_mapped_dict() {
+    GError *error = NULL;
+    GMappedFile *file = g_mapped_file_new(ZHUYIN_DICT_FILE, FALSE, &error);
+    const gchar *data;
+    gchar *copy;
+    gsize length;
+    ZhuyinDict dict;
+    ZhuyinDictHeader *header;
+
+    g_assert_no_error(error);
+    data = g_mapped_file_get_contents(file);
+    length = g_mapped_file_get_length(file);
+
+    // The compiled file holds exactly the built-in tables.
+    g_assert_true(zhuyin_dict_parse(data, length, &dict, &error));
+    assert_same_dict(&zhuyin_builtin, &dict);
+
+    // Damaged files are refused up front instead of read out of bounds.
+    g_assert_false(zhuyin_dict_parse(data, sizeof(ZhuyinDictHeader) - 1, &dict, NULL));
+    g_assert_false(zhuyin_dict_parse(data, length / 2, &dict, NULL));
+
+    copy = g_malloc(length);
+    memcpy(copy, data, length);
+    header = (ZhuyinDictHeader *) copy;
+    header->version++;
+    g_assert_false(zhuyin_dict_parse(copy, length, &dict, NULL));
+    header->version--;
+    ((guint32 *) (copy + header->syllable.offset.offset))[0] = header->syllable.pool.length;
+    g_assert_false(zhuyin_dict_parse(copy, length, &dict, &error));
+    g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+    g_clear_error(&error);
+    g_free(copy);
+
+    g_mapped_file_unref(file);
+
+    // Once loaded, the public lookups read from the mapping.
+    g_assert_true(zhuyin_load(ZHUYIN_DICT_FILE, &error));
+    g_assert_no_error(error);
+    g_assert_true(zhuyin_get_backend()->klass == &zhuyin_backend_mapped);
+    assert_same_dict(&zhuyin_builtin, &((ZhuyinDictBackend *) zhuyin_get_backend())->dict);
+    g_assert_false(zhuyin_load("/nonexistent/zhuyin.dict", NULL));
+    g_assert_true(zhuyin_get_backend()->klass == &zhuyin_backend_mapped);
+}
+
+static gchar *write_overlay(const gchar *contents) {
+    GError *error = NULL;
+    gchar *path;
+    gint fd = g_file_open_tmp("zhuyin-overlay-XXXXXX.txt", &path, &error);
+
+    g_assert_no_error(error);
+    close(fd);
+    g_assert_true(g_file_set_contents(path, contents, -1, &error));
+    return path;
+}
+
+static ZhuyinBackend *open_overlay(const gchar *contents, ZhuyinBackend *base) {
+    GError *error = NULL;
+    gchar *path = write_overlay(contents);
+    ZhuyinBackend *backend = zhuyin_backend_open(&zhuyin_backend_overlay, path, base, &error);
+
+    g_assert_no_error(error);
+    g_remove(path);
+    g_free(path);
+    return backend;
+}
+
+static void assert_same_list(const ZhuyinCandidates *x, const ZhuyinCandidates *y, guint number) {
+    guint j;
+
+    for (j = 0; j < number; j++)
+        g_assert_cmpstr(zhuyin_candidates_get(x, j), ==, zhuyin_candidates_get(y, j));
+}
+
+static void collect_stanza(guint stanza, const ZhuyinCandidates *list, gpointer user_data) {
+    g_assert_cmpuint(list->number, >, 0);
+    g_array_append_val((GArray *) user_data, stanza);
+}
+
+static void test_backends() {
+    ZhuyinBackend *backend[4];
+    GArray *stanzas[G_N_ELEMENTS(backend)];
+    GError *error = NULL;
+    guint i, key;
+
+    // The same tables behind every backend, the overlays adding nothing.
+    backend[0] = zhuyin_backend_open(zhuyin_backend_find("builtin"), NULL, NULL, &error);
+    backend[1] = zhuyin_backend_open(zhuyin_backend_find("mapped"), ZHUYIN_DICT_FILE, NULL, &error);
+    g_assert_no_error(error);
+    backend[2] = open_overlay("# nothing to add\n", zhuyin_backend_open(&zhuyin_backend_builtin, NULL, NULL, NULL));
+    backend[3] = open_overlay("", zhuyin_backend_open(&zhuyin_backend_mapped, ZHUYIN_DICT_FILE, NULL, NULL));
+
+    // Every stanza in range and every association key answers alike.
+    for (key = 0; key < ZHUYIN_STANZA_NUMBER; key++) {
+        guint stanza = ZHUYIN_KEY_STANZA(key);
+        ZhuyinCandidates x, y;
+        guint number = zhuyin_backend_candidate(backend[0], stanza, &x);
+
+        g_assert_cmpuint(ZHUYIN_STANZA_KEY(stanza), ==, key);
+        for (i = 1; i < G_N_ELEMENTS(backend); i++) {
+            g_assert_cmpuint(zhuyin_backend_candidate(backend[i], stanza, &y), ==, number);
+            assert_same_list(&x, &y, number);
+        }
+
+        number = zhuyin_backend_toneless(backend[0], stanza, &x);
+        for (i = 1; i < G_N_ELEMENTS(backend); i++) {
+            g_assert_cmpuint(zhuyin_backend_toneless(backend[i], stanza, &y), ==, number);
+            assert_same_list(&x, &y, number);
+        }
+
+        number = zhuyin_backend_prefix(backend[0], stanza, &x);
+        for (i = 1; i < G_N_ELEMENTS(backend); i++) {
+            g_assert_cmpuint(zhuyin_backend_prefix(backend[i], stanza, &y), ==, number);
+            assert_same_list(&x, &y, number);
+        }
+    }
+    for (key = 0; key < ZHUYIN_ASSOCIATION_NUMBER; key++) {
+        gchar text[8] = { 0 };
+        ZhuyinCandidates x, y;
+        guint number;
+
+        g_unichar_to_utf8(ZHUYIN_ASSOCIATION_FIRST + key, text);
+        number = zhuyin_backend_association(backend[0], text, &x);
+        for (i = 1; i < G_N_ELEMENTS(backend); i++) {
+            g_assert_cmpuint(zhuyin_backend_association(backend[i], text, &y), ==, number);
+            assert_same_list(&x, &y, number);
+        }
+    }
+
+    // Iterating visits the same stanzas, one per phone.h entry.
+    for (i = 0; i < G_N_ELEMENTS(backend); i++) {
+        stanzas[i] = g_array_new(FALSE, FALSE, sizeof(guint));
+        zhuyin_backend_foreach(backend[i], collect_stanza, stanzas[i]);
+        g_assert_cmpuint(stanzas[i]->len, ==, phone_length);
+        g_assert_cmpint(memcmp(stanzas[i]->data, stanzas[0]->data, phone_length * sizeof(guint)), ==, 0);
+    }
+    for (i = 0; i < G_N_ELEMENTS(backend); i++) {
+        g_array_free(stanzas[i], TRUE);
+        zhuyin_backend_close(backend[i]);
+    }
+
+    g_assert_null(zhuyin_backend_find("sqlite"));
+    g_assert_null(zhuyin_backend_open(&zhuyin_backend_mapped, "/nonexistent/zhuyin.dict", NULL, NULL));
+}
+
+static void test_overlay() {
+    ZhuyinBackend *base = zhuyin_backend_open(&zhuyin_backend_builtin, NULL, NULL, NULL);
+    ZhuyinBackend *backend;
+    ZhuyinCandidates list, origin;
+    GError *error = NULL;
+    gchar *path;
+    guint stanza, number, origin_number, j;
+
+    g_assert_true(zhuyin_dict_parse_syllable("ㄅㄚ", &stanza));
+    origin_number = zhuyin_backend_candidate(base, stanza, &origin);
+    g_assert_cmpuint(origin_number, >, 2);
+
+    // User candidates go first, the rest follow once in their old order.
+    backend = open_overlay("ㄅㄚ 叭叭 八\n"
+                           "ㄇㄧㄠˋ 喵\n"
+                           "一 二三\n", base);
+    number = zhuyin_backend_candidate(backend, stanza, &list);
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 0), ==, "叭叭");
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 1), ==, "八");
+    for (j = 0; j < origin_number && strcmp(zhuyin_candidates_get(&origin, j), "八") != 0; j++);
+    g_assert_cmpuint(j, <, origin_number);
+    g_assert_cmpuint(number, ==, origin_number + 1);
+
+    g_assert_true(zhuyin_dict_parse_syllable("ㄇㄧㄠˋ", &stanza));
+    g_assert_cmpuint(zhuyin_backend_candidate(backend, stanza, &list), >, 1);
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 0), ==, "喵");
+    g_assert_cmpuint(zhuyin_backend_association(backend, "一", &list), >, 1);
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 0), ==, "二三");
+
+    // Keys the overlay leaves alone are served by the base.
+    g_assert_true(zhuyin_dict_parse_syllable("ㄆㄚ", &stanza));
+    number = zhuyin_backend_candidate(backend, stanza, &list);
+    g_assert_cmpuint(number, ==, zhuyin_backend_candidate(base, stanza, &origin));
+    assert_same_list(&list, &origin, number);
+    zhuyin_backend_close(backend);
+
+    // A broken line refuses the whole file, leaving the base to the caller.
+    base = zhuyin_backend_open(&zhuyin_backend_builtin, NULL, NULL, NULL);
+    path = write_overlay("ㄅㄚ 八\nabc 甲\n");
+    g_assert_null(zhuyin_backend_open(&zhuyin_backend_overlay, path, base, &error));
+    g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+    g_assert_nonnull(strstr(error->message, ":2: "));
+    g_clear_error(&error);
+    g_assert_null(zhuyin_backend_open(&zhuyin_backend_overlay, path, NULL, NULL));
+    g_remove(path);
+    g_free(path);
+    zhuyin_backend_close(base);
+}
+
+static void test_valid() {
+    ZhuyinCandidates list;
+    guint key, stanza;
+
+    // The bitmap agrees with a real lookup on every stanza.
+    for (key = 0; key < ZHUYIN_STANZA_NUMBER; key++) {
+        stanza = ZHUYIN_KEY_STANZA(key);
+        g_assert_cmpint(zhuyin_is_valid(stanza), ==, zhuyin_candidate(stanza, &list) > 0);
+    }
+    g_assert_false(zhuyin_is_valid(ZHUYIN_INITIAL_NUMBER));
+    g_assert_false(zhuyin_is_valid(ZHUYIN_TONE_NUMBER << 24));
+
+    // The tone mask of a syllable holds the tones it is valid in.
+    for (key = 0; key < ZHUYIN_STANZA_NUMBER; key++) {
+        guint tone = ZHUYIN_TONE(ZHUYIN_KEY_STANZA(key));
+
+        stanza = ZHUYIN_KEY_STANZA(key);
+        g_assert_cmpint((zhuyin_tones(stanza) >> tone) & 1, ==, zhuyin_is_valid(stanza));
+    }
+
+    // and follows the backend in use.
+    g_assert_true(zhuyin_dict_parse_syllable("ㄈㄧㄚ", &stanza));
+    g_assert_false(zhuyin_is_valid(stanza));
+    zhuyin_use(open_overlay("ㄈㄧㄚ 測\n", zhuyin_backend_open(&zhuyin_backend_builtin, NULL, NULL, NULL)));
+    g_assert_true(zhuyin_is_valid(stanza));
+    zhuyin_use(zhuyin_backend_open(&zhuyin_backend_builtin, NULL, NULL, NULL));
+    g_assert_false(zhuyin_is_valid(stanza));
+}
+
+static void test_reachable() {
+    guint slot, filled, index, key, other;
+
+    // Against a scan of every valid stanza, from prefixes with one slot typed.
+    for (filled = ZHUYIN_SLOT_INITIAL; filled <= ZHUYIN_SLOT_TONE; filled++) {
+        for (index = 0; index < ZHUYIN_INITIAL_NUMBER; index++) {
+            guint prefix = index << ((filled - 1) * 8);
+            guint32 mask[ZHUYIN_SLOT_NUMBER] = { 0 };
+
+            if (!ZHUYIN_STANZA_IN_RANGE(prefix))
+                continue;
+            for (key = 0; key < ZHUYIN_STANZA_NUMBER; key++) {
+                guint stanza = ZHUYIN_KEY_STANZA(key);
+
+                if (!zhuyin_is_valid(stanza) || (index != 0 && ((stanza >> ((filled - 1) * 8)) & 0xff) != index))
+                    continue;
+                for (other = ZHUYIN_SLOT_INITIAL; other <= ZHUYIN_SLOT_TONE; other++)
+                    mask[other] |= 1u << ((stanza >> ((other - 1) * 8)) & 0xff);
+            }
+            for (slot = ZHUYIN_SLOT_INITIAL; slot <= ZHUYIN_SLOT_TONE; slot++) {
+                if (slot != filled || index == 0)
+                    g_assert_cmphex(zhuyin_reachable(prefix, slot), ==, mask[slot]);
+            }
+        }
+    }
+
+    // A typed slot is replaced, and a medial typed later may still complete it.
+    g_assert_true(zhuyin_dict_parse_syllable("ㄐ", &key));
+    g_assert_true(zhuyin_reachable(key, ZHUYIN_SLOT_FINAL) & (1u << 9));     // ㄐㄧㄢ
+    g_assert_false(zhuyin_reachable(key, ZHUYIN_SLOT_FINAL) & (1u << 2));    // ㄛ
+    g_assert_true(zhuyin_dict_parse_syllable("ㄅㄩ", &key));
+    g_assert_cmphex(zhuyin_reachable(key, ZHUYIN_SLOT_TONE), ==, 0);
+    g_assert_true(zhuyin_reachable(key, ZHUYIN_SLOT_MEDIAL) & (1u << 1));
+    g_assert_cmphex(zhuyin_reachable(key, 0), ==, 0);
+    g_assert_cmphex(zhuyin_reachable(key, ZHUYIN_SLOT_NUMBER), ==, 0);
+}
+
+/* The tones of a syllable one after the other, each candidate once. */
+static GPtrArray *merge_tones(ZhuyinBackend *backend, guint stanza) {
+    GPtrArray *merged = g_ptr_array_new();
+    guint tone, i, j;
+
+    for (tone = 0; tone < ZHUYIN_TONE_NUMBER; tone++) {
+        ZhuyinCandidates list;
+        guint number = zhuyin_backend_candidate(backend, (stanza & 0xffffff) | tone << 24, &list);
+
+        for (i = 0; i < number; i++) {
+            const gchar *candidate = zhuyin_candidates_get(&list, i);
+
+            for (j = 0; j < merged->len && strcmp(merged->pdata[j], candidate) != 0; j++);
+            if (j == merged->len)
+                g_ptr_array_add(merged, (gpointer) candidate);
+        }
+    }
+    return merged;
+}
+
+static void assert_toneless(ZhuyinBackend *backend, guint stanza) {
+    GPtrArray *merged = merge_tones(backend, stanza);
+    ZhuyinCandidates list;
+    guint i;
+
+    g_assert_cmpuint(zhuyin_backend_toneless(backend, stanza, &list), ==, merged->len);
+    for (i = 0; i < merged->len; i++)
+        g_assert_cmpstr(zhuyin_candidates_get(&list, i), ==, merged->pdata[i]);
+    g_ptr_array_free(merged, TRUE);
+}
+
+static void test_toneless() {
+    ZhuyinBackend *backend = zhuyin_backend_open(&zhuyin_backend_builtin, NULL, NULL, NULL);
+    ZhuyinCandidates list, first;
+    guint key, stanza;
+
+    // Every syllable, whatever tone it is looked up with.
+    for (key = 0; key < ZHUYIN_STANZA_NUMBER; key++)
+        assert_toneless(backend, ZHUYIN_KEY_STANZA(key));
+
+    // The merged lists add no strings of their own.
+    g_assert_true(zhuyin_dict_parse_syllable("ㄅㄚ", &stanza));
+    g_assert_cmpuint(zhuyin_backend_toneless(backend, stanza, &list), >, zhuyin_backend_candidate(backend, stanza, &first));
+    g_assert_true(list.pool == first.pool);
+    g_assert_true(zhuyin_candidates_get(&list, 0) == zhuyin_candidates_get(&first, 0));
+
+    // An overlay entry of one tone shows up among the others.
+    backend = open_overlay("ㄅㄚˊ 叭叭\n", backend);
+    assert_toneless(backend, stanza);
+    zhuyin_backend_toneless(backend, stanza, &list);
+    g_assert_cmpstr(zhuyin_candidates_get(&list, zhuyin_backend_candidate(backend, stanza, NULL)), ==, "叭叭");
+    g_assert_true(zhuyin_dict_parse_syllable("ㄆㄚ", &stanza));
+    assert_toneless(backend, stanza);
+    zhuyin_backend_close(backend);
+
+    g_assert_cmpuint(zhuyin_toneless(ZHUYIN_INITIAL_NUMBER, NULL), ==, 0);
+}
+
+/*
+ * What a prefix lists, found by scanning every syllable of phone.h: the
+ * first candidate of each syllable it starts, those with the fewest slots
+ * left first, then the second ones and so on.
+ */
+static GPtrArray *scan_prefix(guint prefix) {
+    GPtrArray *best = g_ptr_array_new();
+    GArray *found = g_array_new(FALSE, FALSE, sizeof(gint));
+    guint mask = 0xff, rank, rest;
+    gint i, j;
+
+    while (prefix & ~mask)
+        mask = mask << 8 | 0xff;
+    for (i = 0; i < phone_length; i++) {
+        if ((phone_table[i].index & mask) == prefix)
+            g_array_append_val(found, i);
+    }
+
+    for (rank = 0; rank < ZHUYIN_PREFIX_LIMIT; rank++) {
+        for (rest = 0; rest < ZHUYIN_SLOT_TONE; rest++) {
+            for (i = 0; i < found->len; i++) {
+                guint index = phone_table[g_array_index(found, gint, i)].index;
+                ZhuyinCandidates list;
+                const gchar *candidate;
+                guint slots = 0, later;
+
+                for (later = 8; later < 24; later += 8) {
+                    if ((mask >> later & 0xff) == 0 && (index >> later & 0xff))
+                        slots++;
+                }
+                if (slots != rest || zhuyin_candidate(index, &list) <= rank)
+                    continue;
+                candidate = zhuyin_candidates_get(&list, rank);
+                for (j = 0; j < best->len && strcmp(best->pdata[j], candidate) != 0; j++);
+                if (j == best->len && best->len < ZHUYIN_PREFIX_LIMIT)
+                    g_ptr_array_add(best, (gpointer) candidate);
+            }
+        }
+    }
+    g_array_free(found, TRUE);
+    return best;
+}
+
+static void test_prefix() {
+    ZhuyinCandidates list, first;
+    guint key, stanza, i;
+
+    zhuyin_init();
+
+    // Every prefix lists what a scan of every syllable finds.
+    for (key = 1; key < ZHUYIN_TONELESS_NUMBER; key++) {
+        GPtrArray *best = scan_prefix(ZHUYIN_KEY_STANZA(key));
+
+        g_assert_cmpuint(zhuyin_prefix(ZHUYIN_KEY_STANZA(key), &list), ==, best->len);
+        for (i = 0; i < best->len; i++)
+            g_assert_cmpstr(zhuyin_candidates_get(&list, i), ==, best->pdata[i]);
+        g_ptr_array_free(best, TRUE);
+    }
+
+    // ㄐ lists two pages, the symbol itself and then what ㄐㄧ starts with.
+    g_assert_true(zhuyin_dict_parse_syllable("ㄐ", &stanza));
+    g_assert_cmpuint(zhuyin_prefix(stanza, &list), ==, ZHUYIN_PREFIX_LIMIT);
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 0), ==, "ㄐ");
+    g_assert_true(zhuyin_dict_parse_syllable("ㄐㄧ", &stanza));
+    zhuyin_candidate(stanza, &first);
+    g_assert_true(list.pool == first.pool);
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 1), ==, zhuyin_candidates_get(&first, 0));
+
+    // The tone is ignored, and nothing starts with ㄅㄩ.
+    g_assert_cmpuint(zhuyin_prefix(stanza | 3 << 24, NULL), ==, zhuyin_prefix(stanza, NULL));
+    g_assert_true(zhuyin_dict_parse_syllable("ㄅㄩ", &stanza));
+    g_assert_cmpuint(zhuyin_prefix(stanza, NULL), ==, 0);
+    g_assert_cmpuint(zhuyin_prefix(0, NULL), ==, 0);
+}
+
+/* Append the candidates of stanza that merged lacks. */
+static void merge_candidates(GPtrArray *merged, guint stanza) {
+    ZhuyinCandidates list;
+    guint i, j, number = zhuyin_candidate(stanza, &list);
+
+    for (i = 0; i < number; i++) {
+        const gchar *candidate = zhuyin_candidates_get(&list, i);
+
+        for (j = 0; j < merged->len && strcmp(merged->pdata[j], candidate) != 0; j++);
+        if (j == merged->len)
+            g_ptr_array_add(merged, (gpointer) candidate);
+    }
+}
+
+static void test_fuzzy() {
+    ZhuyinCandidates list;
+    guint key, stanza, i;
+
+    zhuyin_init();
+    zhuyin_set_fuzzy(ZHUYIN_FUZZY_EN_ENG | ZHUYIN_FUZZY_ZH_Z | ZHUYIN_FUZZY_CH_C | ZHUYIN_FUZZY_SH_S);
+
+    // Every stanza lists itself, then with its initial, final or both swapped.
+    for (key = 0; key < ZHUYIN_STANZA_NUMBER; key++) {
+        GPtrArray *merged = g_ptr_array_new();
+        guint initial, final, own;
+
+        stanza = ZHUYIN_KEY_STANZA(key);
+        initial = ZHUYIN_INITIAL(stanza);
+        final = ZHUYIN_FINAL(stanza);
+        if (initial >= 15 && initial <= 17)         // ㄓ ㄔ ㄕ
+            initial += 4;
+        else if (initial >= 19 && initial <= 21)    // ㄗ ㄘ ㄙ
+            initial -= 4;
+        if (final == 10 || final == 12)             // ㄣ ㄥ
+            final ^= 6;
+
+        merge_candidates(merged, stanza);
+        own = merged->len;
+        merge_candidates(merged, (stanza & ~0xffu) | initial);
+        merge_candidates(merged, (stanza & ~0xff0000u) | final << 16);
+        merge_candidates(merged, (stanza & ~0xff00ffu) | final << 16 | initial);
+
+        // A stanza no rule adds to keeps its list as it is.
+        if (merged->len == own) {
+            g_assert_cmpuint(zhuyin_fuzzy_candidate(stanza, &list), ==, zhuyin_candidate(stanza, NULL));
+            g_assert_cmpint(zhuyin_is_valid(stanza), ==, own > 0);
+            g_ptr_array_free(merged, TRUE);
+            continue;
+        }
+        g_assert_cmpuint(zhuyin_fuzzy_candidate(stanza, &list), ==, merged->len);
+        for (i = 0; i < merged->len; i++)
+            g_assert_cmpstr(zhuyin_candidates_get(&list, i), ==, merged->pdata[i]);
+        g_assert_cmpint(zhuyin_is_valid(stanza), ==, merged->len > 0);
+        g_ptr_array_free(merged, TRUE);
+    }
+
+    // One rule leaves the other pairs apart.
+    zhuyin_set_fuzzy(ZHUYIN_FUZZY_EN_ENG);
+    g_assert_cmpuint(zhuyin_get_fuzzy(), ==, ZHUYIN_FUZZY_EN_ENG);
+    g_assert_true(zhuyin_dict_parse_syllable("ㄓ", &stanza));
+    g_assert_cmpuint(zhuyin_fuzzy_candidate(stanza, NULL), ==, zhuyin_candidate(stanza, NULL));
+    g_assert_true(zhuyin_dict_parse_syllable("ㄅㄣ", &stanza));
+    g_assert_cmpuint(zhuyin_fuzzy_candidate(stanza, NULL), >, zhuyin_candidate(stanza, NULL));
+
+    // Without rules it is zhuyin_candidate().
+    zhuyin_set_fuzzy(0);
+    g_assert_cmpuint(zhuyin_fuzzy_candidate(stanza, &list), ==, zhuyin_candidate(stanza, NULL));
+    g_assert_true(list.pool == zhuyin_syllable_pool);
+    g_assert_cmpuint(zhuyin_fuzzy_candidate(ZHUYIN_INITIAL_NUMBER, NULL), ==, 0);
+}
+
+static void test_corpus() {
+    GHashTable *counts = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTable *single = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GString *corpus = g_string_new("");
+    ZhuyinDictBuilder builder;
+    ZhuyinDictTable table;
+    ZhuyinCandidates list;
+    GHashTableIter iter;
+    gpointer key, value;
+    guint number, i;
+
+    // Many threads count what one does, whatever slice a character falls in.
+    for (i = 0; i < 20000; i++)
+        g_string_append(corpus, i % 3 ? "丙乙\xff" : "丙𨉣 ");
+    zhuyin_dict_count(counts, corpus->str, corpus->len, 7);
+    zhuyin_dict_count(single, corpus->str, corpus->len, 1);
+    g_assert_cmpuint(g_hash_table_size(counts), ==, 4);
+    g_hash_table_iter_init(&iter, single);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        g_assert_cmpuint(GPOINTER_TO_UINT(g_hash_table_lookup(counts, key)), ==, GPOINTER_TO_UINT(value));
+    g_assert_cmpuint(GPOINTER_TO_UINT(g_hash_table_lookup(counts, GUINT_TO_POINTER(0x4E19))), ==, 20000);
+
+    // The frequent go first among the places of the counted; the unseen
+    // and phrases stay where they are, and ties keep their order.
+    zhuyin_dict_builder_init(&builder, ZHUYIN_STANZA_NUMBER);
+    g_assert_true(zhuyin_dict_builder_add(&builder, 1, "甲 乙乙 𨉣 丁 乙 丙", &number, NULL));
+    g_assert_true(zhuyin_dict_builder_add(&builder, 2, "戊 丙", &number, NULL));
+    g_assert_true(zhuyin_dict_builder_add(&builder, 3, "丁 甲", &number, NULL));
+    zhuyin_dict_builder_rank(&builder, counts);
+    zhuyin_dict_builder_finish(&builder, &table);
+    zhuyin_dict_table_lookup(&table, 1, &list);
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 0), ==, "甲");
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 1), ==, "乙乙");
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 2), ==, "丙");
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 3), ==, "丁");
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 4), ==, "乙");
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 5), ==, "𨉣");
+    for (i = 1; i < list.number; i++)
+        g_assert_cmpuint(list.offset[i - 1], <, list.offset[i]);      // the pool follows suit
+    zhuyin_dict_table_lookup(&table, 2, &list);
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 0), ==, "戊");
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 1), ==, "丙");
+    zhuyin_dict_table_lookup(&table, 3, &list);
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 0), ==, "丁");
+    g_assert_cmpstr(zhuyin_candidates_get(&list, 1), ==, "甲");
+    zhuyin_dict_builder_clear(&builder);
+
+    g_string_free(corpus, TRUE);
+    g_hash_table_destroy(counts);
+    g_hash_table_destroy(single);
+}
+
+static void bench_stanza_lookup() {
+    gint64 start, binary, dense;
+    guint round;
+    gint i;
+    volatile gintptr sink = 0;
+
+    if (!g_test_perf()) {
+        g_test_skip("run with -m perf");
+        return;
+    }
+
+    zhuyin_init();
+
+    start = g_get_monotonic_time();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < phone_length; i++) {
+            sink += binary_search(phone_table[i].index);
+        }
+    }
+    binary = g_get_monotonic_time() - start;
+
+    start = g_get_monotonic_time();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < phone_length; i++) {
+            sink += zhuyin_syllable_index[ZHUYIN_STANZA_KEY(phone_table[i].index)];
+        }
+    }
+    dense = g_get_monotonic_time() - start;
+
+    g_test_minimized_result(binary * 1000.0 / BENCH_ROUNDS / phone_length,
+                            "binary search: %.2f ns per stanza",
+                            binary * 1000.0 / BENCH_ROUNDS / phone_length);
+    g_test_minimized_result(dense * 1000.0 / BENCH_ROUNDS / phone_length,
+                            "stanza index: %.2f ns per stanza",
+                            dense * 1000.0 / BENCH_ROUNDS / phone_length);
+}
+
+/* The lookup ibus_zhuyin_lookup_phrase() used before the association index. */
+static guint
+linear_association (const gchar *text)
+{
+    gint i;
+
+    for (i = 0; phrase_table[i].key != NULL; i++) {
+        if (g_strcmp0(phrase_table[i].key, text) == 0) {
+            gchar **member = g_strsplit(phrase_table[i].candidates, " ", 0);
+            guint number = g_strv_length(member);
+            g_strfreev(member);
+            return number;
+        }
+    }
+
+    return 0;
+}
+
+static void bench_association_lookup() {
+    gint64 start, linear, indexed;
+    gint i, keys;
+    volatile guint sink = 0;
+
+    if (!g_test_perf()) {
+        g_test_skip("run with -m perf");
+        return;
+    }
+
+    start = g_get_monotonic_time();
+    for (i = 0; phrase_table[i].key != NULL; i++) {
+        sink += linear_association(phrase_table[i].key);
+    }
+    linear = g_get_monotonic_time() - start;
+    keys = i;
+
+    start = g_get_monotonic_time();
+    for (i = 0; phrase_table[i].key != NULL; i++) {
+        ZhuyinCandidates list;
+        sink += zhuyin_association(phrase_table[i].key, &list);
+    }
+    indexed = g_get_monotonic_time() - start;
+
+    g_test_minimized_result(linear * 1000.0 / keys,
+                            "linear scan + g_strsplit: %.2f ns per key",
+                            linear * 1000.0 / keys);
+    g_test_minimized_result(indexed * 1000.0 / keys,
+                            "association index: %.2f ns per key",
+                            indexed * 1000.0 / keys);
+}
+
+static void bench_prefix_lookup() {
+    gint64 start, scan, indexed;
+    guint key;
+    volatile guint sink = 0;
+
+    if (!g_test_perf()) {
+        g_test_skip("run with -m perf");
+        return;
+    }
+
+    zhuyin_init();
+
+    start = g_get_monotonic_time();
+    for (key = 1; key < ZHUYIN_TONELESS_NUMBER; key++) {
+        GPtrArray *best = scan_prefix(ZHUYIN_KEY_STANZA(key));
+        sink += best->len;
+        g_ptr_array_free(best, TRUE);
+    }
+    scan = g_get_monotonic_time() - start;
+
+    start = g_get_monotonic_time();
+    for (key = 1; key < ZHUYIN_TONELESS_NUMBER; key++) {
+        ZhuyinCandidates list;
+        sink += zhuyin_prefix(ZHUYIN_KEY_STANZA(key), &list);
+    }
+    indexed = g_get_monotonic_time() - start;
+
+    g_test_minimized_result(scan * 1000.0 / (ZHUYIN_TONELESS_NUMBER - 1),
+                            "phone.h scan: %.2f ns per prefix",
+                            scan * 1000.0 / (ZHUYIN_TONELESS_NUMBER - 1));
+    g_test_minimized_result(indexed * 1000.0 / (ZHUYIN_TONELESS_NUMBER - 1),
+                            "prefix index: %.2f ns per prefix",
+                            indexed * 1000.0 / (ZHUYIN_TONELESS_NUMBER - 1));
+}
+
+int main(int argc, char **argv) {
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/zhuyin/stanza_index", test_stanza_index);
+    g_test_add_func("/zhuyin/candidate_pool", test_candidate_pool);
+    g_test_add_func("/zhuyin/association", test_association);
+    g_test_add_func("/zhuyin/mapped_dict", test_mapped_dict);
+    g_test_add_func("/zhuyin/backends", test_backends);
+    g_test_add_func("/zhuyin/overlay", test_overlay);
+    g_test_add_func("/zhuyin/valid", test_valid);
+    g_test_add_func("/zhuyin/toneless", test_toneless);
+    g_test_add_func("/zhuyin/reachable", test_reachable);
+    g_test_add_func("/zhuyin/prefix", test_prefix);
+    g_test_add_func("/zhuyin/fuzzy", test_fuzzy);
+    g_test_add_func("/zhuyin/corpus", test_corpus);
+    g_test_add_func("/bench/stanza_lookup", bench_stanza_lookup);
+    g_test_add_func("/bench/association_lookup", bench_association_lookup);
+    g_test_add_func("/bench/prefix_lookup", bench_prefix_lookup);
+
+    return g_test_run();
+}
@@ -16,11 +16,54 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <ibus.h>
 #include "engine.h"
 #include "zhuyin.h"
 
+#ifdef IBUS_ZHUYIN_ALLOC_TEST
+#ifndef __GLIBC__
+#error "the allocation test needs the allocator of glibc"
+#endif
+/*
+ * Count what the main thread takes from the heap while a key is handled,
+ * GLib and GObject included, by standing in for the allocator of libc.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static __thread gboolean alloc_counting = FALSE;
+static guint alloc_count = 0;
+
+void *malloc(size_t size) {
+    if (alloc_counting) alloc_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (alloc_counting) alloc_count++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    if (alloc_counting) alloc_count++;
+    return __libc_realloc(p, size);
+}
+
+// What the mocks keep for the checks is not the engine's to count
+#define UNCOUNTED(stmt) do { \
+    gboolean counting = alloc_counting; \
+    alloc_counting = FALSE; \
+    stmt; \
+    alloc_counting = counting; \
+} while (0)
+#else
+#define UNCOUNTED(stmt) stmt
+#endif
+
 // Mocking IBus functions
 static gchar *committed_text = NULL;
 static gchar *current_preedit = NULL;
@@ -41,12 +84,12 @@ guint g_idle_add(GSourceFunc function, gpointer data) {
 
 void ibus_engine_commit_text(IBusEngine *engine, IBusText *text) {
     if (committed_text) g_free(committed_text);
-    committed_text = g_strdup(text->text);
+    UNCOUNTED(committed_text = g_strdup(text->text));
 }
 
 void ibus_engine_update_preedit_text(IBusEngine *engine, IBusText *text, guint cursor_pos, gboolean visible) {
     if (current_preedit) g_free(current_preedit);
-    current_preedit = g_strdup(text->text);
+    UNCOUNTED(current_preedit = g_strdup(text->text));
 }
 
 static gboolean lookup_table_visible = FALSE;
@@ -58,7 +101,7 @@ void ibus_engine_update_lookup_table(IBusEngine *engine, IBusLookupTable *table,
 }
 void ibus_engine_update_auxiliary_text(IBusEngine *engine, IBusText *text, gboolean visible) {
     if (current_aux_text) g_free(current_aux_text);
-    current_aux_text = visible ? g_strdup(text->text) : NULL;
+    UNCOUNTED(current_aux_text = visible ? g_strdup(text->text) : NULL);
 }
 void ibus_engine_hide_preedit_text(IBusEngine *engine) {}
 void ibus_engine_show_preedit_text(IBusEngine *engine) {}
@@ -107,6 +150,48 @@ static void test_hsu_layout() {
     g_object_unref(engine);
 }
 
+static void type_keys(IBusEngine *engine, const gchar *keys) {
+    for (; *keys; keys++)
+        IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, *keys, 0, 0);
+}
+
+static void test_hsu_resolution() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.Hsu", PROP_STATE_CHECKED);
+
+    // The shared keys are read right away, without waiting for Space.
+    type_keys(engine, "m");
+    g_assert_cmpstr(current_preedit, ==, "ㄇ");
+    type_keys(engine, "m");
+    g_assert_cmpstr(current_preedit, ==, "ㄇㄢ");
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // A final after a medial alone.
+    type_keys(engine, "en");
+    g_assert_cmpstr(current_preedit, ==, "ㄧㄣ");
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    type_keys(engine, "bh");
+    g_assert_cmpstr(current_preedit, ==, "ㄅㄛ");
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // A final is kept when the medial typed after it completes the syllable,
+    type_keys(engine, "jm");
+    g_assert_cmpstr(current_preedit, ==, "ㄐㄢ");
+    type_keys(engine, "e");
+    g_assert_cmpstr(current_preedit, ==, "ㄐㄧㄢ");
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // but an initial replaces one that leads nowhere with the final.
+    type_keys(engine, "jh");
+    g_assert_cmpstr(current_preedit, ==, "ㄏ");
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    g_object_unref(engine);
+}
+
 static void test_h_9_space() {
     IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
     
@@ -591,6 +676,107 @@ static void test_candidate_selection() {
     g_object_unref(engine);
 }
 
+static void test_keyboard_tables() {
+    const ZhuyinKeyboard *standard = zhuyin_keyboard_find("standard");
+    const ZhuyinKeyboard *hsu = zhuyin_keyboard_find("hsu");
+    const gchar *broken[] = { "1qaz2wsxedcrfv5tgbyhn", "ujm", "8ik,9ol.0p;/-", "634" };
+    const gchar *clash[] = { "1qaz2wsxedcrfv5tgbyhn", "ujm", "8ik,9ol.0p;/-", "634u" };
+    ZhuyinKeyboard keyboard;
+    GError *error = NULL;
+
+    g_assert_nonnull(standard);
+    g_assert_nonnull(zhuyin_keyboard_find("eten"));
+    g_assert_null(zhuyin_keyboard_find("dvorak"));
+
+    // Standard: every key types one symbol, whatever came before.
+    g_assert_false(standard->ambiguous);
+    g_assert_cmpstr(zhuyin_keyboard_key(standard, '1', FALSE)->symbol, ==, "ㄅ");
+    g_assert_cmpstr(zhuyin_keyboard_key(standard, '1', TRUE)->symbol, ==, "ㄅ");
+    g_assert_cmpuint(zhuyin_keyboard_index(standard, '-', ZHUYIN_SLOT_FINAL), ==, 13);
+    g_assert_null(zhuyin_keyboard_key(standard, '=', FALSE)->symbol);
+    g_assert_null(zhuyin_keyboard_key(standard, IBUS_BackSpace, FALSE));
+
+    // Hsu: 'm' is ㄇ on its own and ㄢ after an initial.
+    g_assert_true(hsu->ambiguous);
+    g_assert_cmpstr(zhuyin_keyboard_key(hsu, 'm', FALSE)->symbol, ==, "ㄇ");
+    g_assert_cmpuint(zhuyin_keyboard_key(hsu, 'm', FALSE)->slot, ==, ZHUYIN_SLOT_INITIAL);
+    g_assert_cmpstr(zhuyin_keyboard_key(hsu, 'm', TRUE)->symbol, ==, "ㄢ");
+    g_assert_cmpuint(zhuyin_keyboard_key(hsu, 'm', TRUE)->slot, ==, ZHUYIN_SLOT_FINAL);
+    g_assert_cmpuint(zhuyin_keyboard_index(hsu, 'm', ZHUYIN_SLOT_INITIAL), ==, 3);
+    g_assert_cmpuint(zhuyin_keyboard_index(hsu, 'm', ZHUYIN_SLOT_FINAL), ==, 9);
+    g_assert_cmpstr(zhuyin_keyboard_key(hsu, 'e', TRUE)->symbol, ==, "ㄧ");
+
+    // Layouts missing a key or reusing one outside initial/final are refused.
+    g_assert_false(zhuyin_keyboard_compile("broken", broken, &keyboard, &error));
+    g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+    g_clear_error(&error);
+    g_assert_false(zhuyin_keyboard_compile("clash", clash, &keyboard, &error));
+    g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+    g_clear_error(&error);
+}
+
+static void test_keyboard_file() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    // Not counting the IBM layout of a run before, the allocation test runs it twice
+    guint number = zhuyin_keyboard_get_number() - (zhuyin_keyboard_find("ibm") != NULL);
+    GError *error = NULL;
+    gchar *path;
+    gint fd;
+
+    fd = g_file_open_tmp("zhuyin-XXXXXX.layout", &path, &error);
+    g_assert_no_error(error);
+    g_close(fd, NULL);
+
+    // The IBM layout, loaded from a file.
+    g_assert_true(g_file_set_contents(path,
+        "[Layout]\n"
+        "Name=ibm\n"
+        "Label=IBM\n"
+        "Initials=1234567890-qwertyuiop\n"
+        "Medials=asd\n"
+        "Finals=fghjkl;zxcvbn\n"
+        "Tones=m,./\n", -1, NULL));
+    g_assert_true(zhuyin_keyboard_load(path, &error));
+    g_assert_no_error(error);
+    g_assert_cmpuint(zhuyin_keyboard_get_number(), ==, number + 1);
+    g_assert_cmpstr(zhuyin_keyboard_get_nth(number)->label, ==, "IBM");
+
+    // It shows up as a menu entry like the built-in ones.
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.Ibm", PROP_STATE_CHECKED);
+    g_assert_true(zhuyin->keyboard == zhuyin_keyboard_find("ibm"));
+
+    if (current_preedit) { g_free(current_preedit); current_preedit = NULL; }
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, '1', 0, 0);
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, 'f', 0, 0);
+    g_assert_cmpstr(current_preedit, ==, "ㄅㄚ");
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // Loading it again updates the same entry in place.
+    g_assert_true(zhuyin_keyboard_load(path, NULL));
+    g_assert_cmpuint(zhuyin_keyboard_get_number(), ==, number + 1);
+    g_assert_true(zhuyin->keyboard == zhuyin_keyboard_find("ibm"));
+
+    // Built-in names and incomplete layouts are refused.
+    g_assert_true(g_file_set_contents(path, "[Layout]\nName=hsu\nInitials=\nMedials=\nFinals=\nTones=\n", -1, NULL));
+    g_assert_false(zhuyin_keyboard_load(path, &error));
+    g_assert_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE);
+    g_clear_error(&error);
+    g_assert_true(g_file_set_contents(path, "[Layout]\nName=half\nInitials=1234567890\n", -1, NULL));
+    g_assert_false(zhuyin_keyboard_load(path, &error));
+    g_assert_nonnull(error);
+    g_clear_error(&error);
+    g_assert_cmpuint(zhuyin_keyboard_get_number(), ==, number + 1);
+
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.Standard", PROP_STATE_CHECKED);
+    g_assert_true(zhuyin->keyboard == zhuyin_keyboard_find("standard"));
+
+    g_unlink(path);
+    g_free(path);
+    g_object_unref(engine);
+}
+
 static void test_eten_layout() {
     IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
     IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
@@ -841,20 +1027,488 @@ static void test_invalid_combination_aux() {
     // Should have aux text
     g_assert_nonnull(current_aux_text);
 
-    // 2. Type '1' -> Replaces 'v' with '1' (ㄅ) -> biang (likely invalid in standard dict)
-    // Even if it's valid, we want to test the case where it becomes NULL.
-    // If 'v' 'u' ';' '1' is indeed invalid as user says:
-    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, '1', 0, 0);
-    
+    g_assert_cmpstr(current_preedit, ==, "ㄒㄧㄤ");
+    gchar *aux = g_strdup(current_aux_text);
+
+    // 2. '1' would make ㄅㄧㄤ, which no character has, so it is swallowed
+    // and what was typed stays as it was, aux text and all.
+    g_assert_true(IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, '1', 0, 0));
+    g_assert_true(((IBusZhuyinEngine *)engine)->valid);
+    g_assert_cmpstr(current_preedit, ==, "ㄒㄧㄤ");
+    g_assert_cmpstr(current_aux_text, ==, aux);
+
+    g_free(aux);
+    g_object_unref(engine);
+}
+
+static void test_impossible_key() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+
+    // 1 (ㄅ) can go on with 8 (ㄚ) but not with m (ㄩ).
+    type_keys(engine, "1");
+    g_assert_true(is_zhuyin_key_reachable(zhuyin, '8'));
+    g_assert_false(is_zhuyin_key_reachable(zhuyin, 'm'));
+
+    // so m is eaten and the preedit stays as it was.
+    g_assert_true(IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, 'm', 0, 0));
+    g_assert_cmpstr(current_preedit, ==, "ㄅ");
+    type_keys(engine, "8");
+    g_assert_cmpstr(current_preedit, ==, "ㄅㄚ");
+    g_assert_true(zhuyin->valid);
+
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+    g_object_unref(engine);
+}
+
+static void test_tone_inference() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+
+    if (committed_text) { g_free(committed_text); committed_text = NULL; }
+
+    // Off by default: ㄘㄜ waits for its tone.
+    type_keys(engine, "hk");
+    g_assert_cmpstr(current_preedit, ==, "ㄘㄜ");
+    g_assert_cmpint(zhuyin->mode, ==, IBUS_ZHUYIN_MODE_NORMAL);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.ToneInference", PROP_STATE_CHECKED);
+    g_assert_true(zhuyin->enable_tone_inference);
+
+    // ㄘㄜ is only said in ˋ, so the candidates show up at once.
+    type_keys(engine, "hk");
+    g_assert_cmpstr(current_preedit, ==, "ㄘㄜˋ");
+    g_assert_cmpint(zhuyin->mode, ==, IBUS_ZHUYIN_MODE_CANDIDATE);
+    g_assert_cmpuint(zhuyin->candidate_number, >, 1);
+
+    // The ˋ typed anyway picks nothing.
+    type_keys(engine, "4");
+    g_assert_null(committed_text);
+    g_assert_cmpint(zhuyin->mode, ==, IBUS_ZHUYIN_MODE_CANDIDATE);
+    type_keys(engine, "1");
+    g_assert_cmpstr(committed_text, ==, zhuyin_candidates_get(&zhuyin->candidates, 0));
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // A single candidate commits right away, before the tone key.
+    type_keys(engine, "zul");
+    g_assert_cmpstr(committed_text, ==, "覅");
+    type_keys(engine, "4");
+    g_assert_cmpuint(zhuyin->preedit->len, ==, 0);
+
+    // Syllables that may still grow or take several tones are left alone.
+    type_keys(engine, "1u");
+    g_assert_cmpstr(current_preedit, ==, "ㄅㄧ");
+    g_assert_cmpint(zhuyin->mode, ==, IBUS_ZHUYIN_MODE_NORMAL);
+    type_keys(engine, "l");
+    g_assert_cmpstr(current_preedit, ==, "ㄅㄧㄠ");
+    g_assert_cmpint(zhuyin->mode, ==, IBUS_ZHUYIN_MODE_NORMAL);
+
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.ToneInference", PROP_STATE_UNCHECKED);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+    g_object_unref(engine);
+}
+
+static void test_toneless_quick_match() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    guint stanza = 1 | 1 << 16;  // ㄅㄚ
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_CHECKED);
+
+    if (committed_text) { g_free(committed_text); committed_text = NULL; }
+
+    // Before the tone, ㄅㄚ offers 八 and 拔 and the rest of its tones.
+    type_keys(engine, "18");
+    g_assert_cmpuint(zhuyin->candidate_number, ==, zhuyin_toneless(stanza, NULL));
+    g_assert_cmpuint(zhuyin->candidate_number, >, zhuyin_candidate(stanza, NULL));
+    g_assert_cmpstr(zhuyin_candidates_get(&zhuyin->candidates, 0), ==, "八");
+
+    // Shift picks from the merged list without a tone.
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, '1', 0, IBUS_SHIFT_MASK);
+    g_assert_cmpstr(committed_text, ==, "八");
+
+    // Space narrows it down to the first tone, a tone key to its own.
+    type_keys(engine, "18 ");
+    g_assert_cmpint(zhuyin->mode, ==, IBUS_ZHUYIN_MODE_CANDIDATE);
+    g_assert_cmpuint(zhuyin->candidate_number, ==, zhuyin_candidate(stanza, NULL));
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+    type_keys(engine, "186");
+    g_assert_cmpuint(zhuyin->candidate_number, ==, zhuyin_candidate(stanza | 1 << 24, NULL));
+
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_UNCHECKED);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+    g_object_unref(engine);
+}
+
+static void test_prefix_quick_match() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    ZhuyinCandidates list;
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_CHECKED);
+
+    if (committed_text) { g_free(committed_text); committed_text = NULL; }
+
+    // ㄐ and ㄐㄧ may still grow, so they offer the best of what they may become.
+    type_keys(engine, "r");
+    g_assert_cmpuint(zhuyin->candidate_number, ==, zhuyin_prefix(12, NULL));
+    g_assert_cmpuint(zhuyin->page_max, ==, 1);
+    type_keys(engine, "u");
+    g_assert_cmpuint(zhuyin->candidate_number, ==, zhuyin_prefix(12 | 1 << 8, &list));
+    g_assert_cmpstr(zhuyin_candidates_get(&zhuyin->candidates, 0), ==, zhuyin_candidates_get(&list, 0));
+
+    // Shift picks from the prefix list.
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, '2', 0, IBUS_SHIFT_MASK);
+    g_assert_cmpstr(committed_text, ==, zhuyin_candidates_get(&list, 1));
+
+    // Once the final is typed, the whole syllable is offered again.
+    type_keys(engine, "ru0");
+    g_assert_cmpuint(zhuyin->candidate_number, ==, zhuyin_toneless(12 | 1 << 8 | 9 << 16, NULL));
+
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_UNCHECKED);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+    g_object_unref(engine);
+}
+
+static void test_fuzzy() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    guint shen = 17 | 10 << 16;     // ㄕㄣ
+    guint sen = 21 | 10 << 16;      // ㄙㄣ
+    guint shong = 17 | 2 << 8 | 12 << 16;   // ㄕㄨㄥ, no syllable
+    ZhuyinCandidates list;
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+
+    // Without the rule ㄕㄨ goes nowhere with ㄥ.
+    type_keys(engine, "gj/");
+    g_assert_cmpstr(zhuyin->display[2], ==, NULL);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // ㄕ = ㄙ: ㄕㄣ lists its own candidates, then those of ㄙㄣ.
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "Fuzzy.ShS", PROP_STATE_CHECKED);
+    g_assert_cmpuint(zhuyin_get_fuzzy(), ==, ZHUYIN_FUZZY_SH_S);
+    type_keys(engine, "gp ");
+    g_assert_cmpuint(zhuyin->candidate_number, >, zhuyin_candidate(shen, NULL));
+    g_assert_cmpuint(zhuyin->candidate_number, <=, zhuyin_candidate(shen, NULL) + zhuyin_candidate(sen, NULL));
+    zhuyin_candidate(shen, &list);
+    g_assert_cmpstr(zhuyin_candidates_get(&zhuyin->candidates, 0), ==, zhuyin_candidates_get(&list, 0));
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // ㄕㄨㄥ is typed as ㄙㄨㄥ.
+    g_assert_true(zhuyin_is_valid(shong));
+    type_keys(engine, "gj/ ");
+    g_assert_cmpstr(zhuyin->display[2], ==, "ㄥ");
+    g_assert_cmpuint(zhuyin->candidate_number, ==, zhuyin_candidate(21 | 2 << 8 | 12 << 16, NULL));
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "Fuzzy.ShS", PROP_STATE_UNCHECKED);
+    g_assert_cmpuint(zhuyin_get_fuzzy(), ==, 0);
+    g_assert_false(zhuyin_is_valid(shong));
+    g_object_unref(engine);
+}
+
+static void test_learn() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
     IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
-    if (!zhuyin->valid) {
-        // If invalid, aux text MUST be NULL
-        g_assert_null(current_aux_text);
+    guint ma3;
+    guint today = zhuyin_learn_today();
+    ZhuyinCandidates list;
+    gchar *path = NULL;
+    gint fd = g_file_open_tmp("ibus-zhuyin-XXXXXX.learn", &path, NULL);
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    zhuyin->learn = zhuyin_learn_open(path, NULL);
+    g_assert_nonnull(zhuyin->learn);
+    ma3 = get_zhuyin_index(zhuyin, 'a', 1) | get_zhuyin_index(zhuyin, '8', 3) << 16 | get_zhuyin_index(zhuyin, '3', 4) << 24;
+    g_assert_cmpuint(zhuyin_candidate(ma3, &list), >, 3);
+
+    // Picking the third candidate of ㄇㄚˇ moves it to the front.
+    for (gint i = 0; i < 2; i++) {
+        type_keys(engine, "a83");
+        g_assert_cmpstr(zhuyin_candidates_get(&zhuyin->candidates, 0), ==, zhuyin_candidates_get(&list, i == 0 ? 0 : 2));
+        type_keys(engine, i == 0 ? "3" : "1");
+        g_assert_cmpstr(committed_text, ==, zhuyin_candidates_get(&list, 2));
+    }
+    g_assert_cmpuint(zhuyin_learn_count(zhuyin->learn, ma3, zhuyin_candidates_get(&list, 2), today), ==, 2);
+    type_keys(engine, "a83");
+    g_assert_cmpstr(zhuyin_candidates_get(&zhuyin->candidates, 0), ==, zhuyin_candidates_get(&list, 2));
+    g_assert_cmpstr(zhuyin_candidates_get(&zhuyin->candidates, 1), ==, zhuyin_candidates_get(&list, 0));
+    g_assert_cmpstr(zhuyin_candidates_get(&zhuyin->candidates, 3), ==, zhuyin_candidates_get(&list, 3));
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // What was learned follows the text wherever another dictionary puts it.
+    ZhuyinCandidates moved = list;
+    guint32 *reversed = g_new(guint32, list.number);
+    guint32 *sorted = g_new(guint32, list.number);
+    for (guint i = 0; i < list.number; i++)
+        reversed[i] = list.offset[list.number - 1 - i];
+    moved.offset = reversed;
+    zhuyin_learn_sort(zhuyin->learn, ma3, &moved, sorted, today);
+    g_assert_cmpstr(zhuyin_candidates_get(&moved, 0), ==, zhuyin_candidates_get(&list, 2));
+    g_assert_cmpstr(zhuyin_candidates_get(&moved, 1), ==, zhuyin_candidates_get(&list, list.number - 1));
+    g_free(reversed);
+    g_free(sorted);
+
+    // Counts halve every half-life and survive reopening the file.
+    g_assert_cmpuint(zhuyin_learn_count(zhuyin->learn, ma3, zhuyin_candidates_get(&list, 2), today + ZHUYIN_LEARN_HALF_LIFE), ==, 1);
+    g_assert_cmpuint(zhuyin_learn_count(zhuyin->learn, ma3, zhuyin_candidates_get(&list, 2), today + 2 * ZHUYIN_LEARN_HALF_LIFE), ==, 0);
+    zhuyin_learn_close(zhuyin->learn);
+    zhuyin->learn = zhuyin_learn_open(path, NULL);
+    g_assert_cmpuint(zhuyin_learn_count(zhuyin->learn, ma3, zhuyin_candidates_get(&list, 2), today), ==, 2);
+    zhuyin_learn_close(zhuyin->learn);
+    zhuyin->learn = NULL;
+    g_object_unref(engine);
+
+    g_unlink(path);
+    g_free(path);
+}
+
+static void test_learn_journal() {
+    const ZhuyinLearnEntry torn = { { 1, 0, 1, 0 }, 0 };
+    guint today = zhuyin_learn_today();
+    guint picks = ZHUYIN_LEARN_JOURNAL_LIMIT / sizeof(ZhuyinLearnEntry) + 1;
+    ZhuyinLearn *learn;
+    gchar *path = NULL;
+    gchar *contents = NULL;
+    gsize length = 0;
+    gint fd = g_file_open_tmp("ibus-zhuyin-XXXXXX.learn", &path, NULL);
+
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    learn = zhuyin_learn_open(path, NULL);
+    g_assert_nonnull(learn);
+    zhuyin_learn_pick(learn, 1, "甲", today);
+    zhuyin_learn_pick(learn, 1, "甲", today);
+    zhuyin_learn_close(learn);
+
+    // Each pick is one entry after the header.
+    g_assert_true(g_file_get_contents(path, &contents, &length, NULL));
+    g_assert_cmpuint(length, ==, sizeof(ZhuyinLearnHeader) + 2 * sizeof(ZhuyinLearnEntry));
+    g_free(contents);
+
+    // A torn or garbled entry at the end is dropped and cut off.
+    fd = open(path, O_WRONLY | O_APPEND);
+    g_assert_true(write(fd, &torn, sizeof(torn)) == sizeof(torn));
+    g_assert_true(write(fd, &torn, 5) == 5);
+    close(fd);
+    learn = zhuyin_learn_open(path, NULL);
+    g_assert_cmpuint(zhuyin_learn_count(learn, 1, "甲", today), ==, 2);
+    g_assert_true(g_file_get_contents(path, &contents, &length, NULL));
+    g_assert_cmpuint(length, ==, sizeof(ZhuyinLearnHeader) + 2 * sizeof(ZhuyinLearnEntry));
+    g_free(contents);
+
+    // Past the limit the journal is rewritten as one entry per candidate.
+    for (guint i = 0; i < picks; i++)
+        zhuyin_learn_pick(learn, 1, i % 2 ? "乙" : "甲", today);
+    zhuyin_learn_pick(learn, 1, "丙丁", today);
+    zhuyin_learn_close(learn);
+    g_assert_true(g_file_get_contents(path, &contents, &length, NULL));
+    g_assert_cmpuint(length, <, ZHUYIN_LEARN_JOURNAL_LIMIT);
+    g_free(contents);
+    learn = zhuyin_learn_open(path, NULL);
+    g_assert_cmpuint(zhuyin_learn_count(learn, 1, "甲", today), ==, 2 + (picks + 1) / 2);
+    g_assert_cmpuint(zhuyin_learn_count(learn, 1, "乙", today), ==, picks / 2);
+    g_assert_cmpuint(zhuyin_learn_count(learn, 1, "丙丁", today), ==, 1);
+    zhuyin_learn_close(learn);
+
+    g_unlink(path);
+    g_free(path);
+}
+
+static void test_learn_shared() {
+    guint today = zhuyin_learn_today();
+    guint picks = ZHUYIN_LEARN_JOURNAL_LIMIT / sizeof(ZhuyinLearnEntry) + 1;
+    ZhuyinLearn *first, *second, *learn;
+    gchar *path = NULL;
+    gchar *contents = NULL;
+    gsize length = 0;
+    gint fd = g_file_open_tmp("ibus-zhuyin-XXXXXX.learn", &path, NULL);
+
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+
+    // Two engines opening the journal share one store.
+    first = zhuyin_learn_open(path, NULL);
+    second = zhuyin_learn_open(path, NULL);
+    g_assert_true(first == second);
+
+    // Their picks pass the limit together, and the rewrite keeps both.
+    for (guint i = 0; i < picks; i++)
+        zhuyin_learn_pick(i % 2 ? second : first, 1, i % 2 ? "乙" : "甲", today);
+    zhuyin_learn_close(first);
+    zhuyin_learn_pick(second, 1, "丙", today);
+    zhuyin_learn_close(second);
+    g_assert_true(g_file_get_contents(path, &contents, &length, NULL));
+    g_free(contents);
+    g_assert_cmpuint(length, <, ZHUYIN_LEARN_JOURNAL_LIMIT);
+
+    learn = zhuyin_learn_open(path, NULL);
+    g_assert_cmpuint(zhuyin_learn_count(learn, 1, "甲", today), ==, MIN((picks + 1) / 2, G_MAXUINT16));
+    g_assert_cmpuint(zhuyin_learn_count(learn, 1, "乙", today), ==, MIN(picks / 2, G_MAXUINT16));
+    g_assert_cmpuint(zhuyin_learn_count(learn, 1, "丙", today), ==, 1);
+    zhuyin_learn_close(learn);
+
+    g_unlink(path);
+    g_free(path);
+}
+
+static void test_config_writer() {
+    gchar *dir = g_build_filename(g_get_tmp_dir(), "ibus-zhuyin-config-test", NULL);
+    gchar *path = g_build_filename(dir, "ibus", "ibus-zhuyin.conf", NULL);
+    gchar *ibus_dir = g_path_get_dirname(path);
+    gchar *contents = NULL;
+    ZhuyinConfigWriter *writer;
+
+    g_unlink(path);
+    g_rmdir(ibus_dir);
+    g_rmdir(dir);
+
+    // A burst of saves is written once, as the last of them, when flushed.
+    writer = zhuyin_config_writer_new(path, 60 * 1000);
+    zhuyin_config_writer_save(writer, g_strdup("a"), 1);
+    zhuyin_config_writer_save(writer, g_strdup("b"), 1);
+    g_usleep(20 * 1000);
+    g_assert_false(g_file_test(path, G_FILE_TEST_EXISTS));
+    zhuyin_config_writer_flush(writer);
+    g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "b");
+    g_free(contents);
+
+    // Freeing the writer writes what is still waiting.
+    zhuyin_config_writer_save(writer, g_strdup("c"), 1);
+    zhuyin_config_writer_free(writer);
+    g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+    g_assert_cmpstr(contents, ==, "c");
+    g_free(contents);
+
+    // Otherwise it is written after the quiet period.
+    writer = zhuyin_config_writer_new(path, 10);
+    zhuyin_config_writer_save(writer, g_strdup("d"), 1);
+    for (gint i = 0; i < 100; i++) {
+        g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+        if (g_strcmp0(contents, "d") == 0)
+            break;
+        g_free(contents);
+        contents = NULL;
+        g_usleep(10 * 1000);
     }
+    g_assert_cmpstr(contents, ==, "d");
+    g_free(contents);
+    zhuyin_config_writer_free(writer);
+
+    g_unlink(path);
+    g_rmdir(ibus_dir);
+    g_rmdir(dir);
+    g_free(ibus_dir);
+    g_free(path);
+    g_free(dir);
+}
 
+static void test_config_snapshot() {
+    const gchar *data = "[engine]\nlayout=hsu\nquick_match=true\npunctuation_window_x=12\n";
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    ZhuyinConfig *config = zhuyin_config_parse(data, strlen(data), NULL);
+
+    // What the file does not say is left unset.
+    g_assert_nonnull(config);
+    g_assert_cmpstr(config->layout, ==, "hsu");
+    g_assert_cmpint(config->quick_match, ==, TRUE);
+    g_assert_cmpint(config->association, ==, ZHUYIN_CONFIG_UNSET);
+    g_assert_null(config->fuzzy);
+    g_assert_cmpint(config->punctuation_window_x, ==, 12);
+    g_assert_cmpint(config->punctuation_window_y, ==, ZHUYIN_CONFIG_UNSET);
+    g_assert_null(zhuyin_config_parse("layout", 6, NULL));
+
+    // Enabling applies a config once; a later enable keeps what was changed since.
+    zhuyin_config_set(zhuyin_config_ref(config));
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    g_assert_cmpstr(zhuyin->keyboard->name, ==, "hsu");
+    g_assert_true(zhuyin->enable_quick_match);
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_UNCHECKED);
+    IBUS_ENGINE_GET_CLASS(engine)->disable(engine);
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    g_assert_false(zhuyin->enable_quick_match);
+
+    // A reload is swapped in; whoever holds the old config still reads it.
+    data = "[engine]\nlayout=standard\n";
+    zhuyin_config_set(zhuyin_config_parse(data, strlen(data), NULL));
+    g_assert_cmpstr(config->layout, ==, "hsu");
+    zhuyin_config_unref(config);
+
+    // It takes effect with the next key, without another enable.
+    g_assert_cmpstr(zhuyin->keyboard->name, ==, "hsu");
+    type_keys(engine, "a");
+    g_assert_cmpstr(zhuyin->keyboard->name, ==, "standard");
+    g_assert_false(zhuyin->enable_quick_match);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // Or once the engine gets the focus back.
+    data = "[engine]\nquick_match=true\n";
+    zhuyin_config_set(zhuyin_config_parse(data, strlen(data), NULL));
+    IBUS_ENGINE_GET_CLASS(engine)->focus_in(engine);
+    g_assert_true(zhuyin->enable_quick_match);
+
+    // Leave a config that sets nothing for the other tests.
+    zhuyin_config_set(zhuyin_config_parse("[engine]\n", 9, NULL));
     g_object_unref(engine);
 }
 
+static void test_config_reload() {
+    const gchar *older = "[engine]\nlayout=hsu\n";
+    const gchar *newer = "[engine]\nlayout=eten\n";
+    const gchar *edited = "[engine]\nlayout=standard\n";
+    gchar *path = NULL;
+    gint fd = g_file_open_tmp("ibus-zhuyin-XXXXXX.conf", &path, NULL);
+    ZhuyinConfigWriter *writer = zhuyin_config_writer_new(path, 60 * 1000);
+    ZhuyinConfig *config;
+    guint generation;
+
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+
+    // An older save is on disk, a newer one is current and waiting
+    zhuyin_config_writer_save(writer, g_strdup(older), strlen(older));
+    zhuyin_config_writer_flush(writer);
+    zhuyin_config_set(zhuyin_config_parse(newer, strlen(newer), NULL));
+    zhuyin_config_writer_save(writer, g_strdup(newer), strlen(newer));
+    config = zhuyin_config_get();
+    generation = config->generation;
+    zhuyin_config_unref(config);
+
+    // The event of the older write, late, does not bring it back
+    g_assert_true(zhuyin_config_reload(path, NULL));
+    config = zhuyin_config_get();
+    g_assert_cmpstr(config->layout, ==, "eten");
+    g_assert_cmpuint(config->generation, ==, generation);
+    zhuyin_config_unref(config);
+
+    // Nor is the newer one loaded again once written
+    zhuyin_config_writer_flush(writer);
+    g_assert_true(zhuyin_config_reload(path, NULL));
+    config = zhuyin_config_get();
+    g_assert_cmpuint(config->generation, ==, generation);
+    zhuyin_config_unref(config);
+
+    // An edit made elsewhere is loaded
+    g_assert_true(g_file_set_contents(path, edited, -1, NULL));
+    g_assert_true(zhuyin_config_reload(path, NULL));
+    config = zhuyin_config_get();
+    g_assert_cmpstr(config->layout, ==, "standard");
+    g_assert_cmpuint(config->generation, >, generation);
+    zhuyin_config_unref(config);
+
+    zhuyin_config_writer_free(writer);
+    zhuyin_config_set(zhuyin_config_parse("[engine]\n", 9, NULL));
+    g_unlink(path);
+    g_free(path);
+}
+
 static void test_normal_mode_navigation() {
     IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
     IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
@@ -932,22 +1586,23 @@ static void test_ui_click_paging() {
     
     // Check we have enough candidates
     IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
-    guint count = ibus_lookup_table_get_number_of_candidates(zhuyin->table);
-    g_assert_cmpint(count, >, 9);
+    g_assert_cmpint(zhuyin->candidate_number, >, 9);
+
+    // Only the first page goes into the table
+    g_assert_cmpint(ibus_lookup_table_get_number_of_candidates(zhuyin->table), ==, 9);
 
     // Get candidate 0 and 9 for comparison
-    IBusText *cand0_text = ibus_lookup_table_get_candidate(zhuyin->table, 0);
-    gchar *cand0 = g_strdup(cand0_text->text);
-    IBusText *cand9_text = ibus_lookup_table_get_candidate(zhuyin->table, 9);
-    gchar *cand9 = g_strdup(cand9_text->text);
+    gchar *cand0 = g_strdup(zhuyin_candidates_get(&zhuyin->candidates, 0));
+    gchar *cand9 = g_strdup(zhuyin_candidates_get(&zhuyin->candidates, 9));
+    g_assert_cmpstr(ibus_lookup_table_get_candidate(zhuyin->table, 0)->text, ==, cand0);
     
     // Page Down
     IBUS_ENGINE_GET_CLASS(engine)->page_down(engine);
     
-    // Verify we are on page 2 (cursor at 9?)
-    // ibus_lookup_table_page_down moves cursor to start of next page.
-    guint pos = ibus_lookup_table_get_cursor_pos(zhuyin->table);
-    g_assert_cmpint(pos, ==, 9);
+    // Verify we are on page 2, the table now holds that page
+    g_assert_cmpint(zhuyin->cursor, ==, 9);
+    g_assert_cmpint(ibus_lookup_table_get_cursor_pos(zhuyin->table), ==, 0);
+    g_assert_cmpstr(ibus_lookup_table_get_candidate(zhuyin->table, 0)->text, ==, cand9);
 
     // Click index 0 (relative to page 2)
     // This simulates UI clicking the first item on the current page.
@@ -963,36 +1618,408 @@ static void test_ui_click_paging() {
     g_object_unref(engine);
 }
 
+static void test_table_cache() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_CHECKED);
+
+    // ㄐㄧ builds its first page once
+    type_keys(engine, "ru");
+    IBusLookupTable *first = zhuyin->table;
+    g_assert_cmpint(ibus_lookup_table_get_number_of_candidates(first), ==, 9);
+
+    // Going back to it, or typing it again, shows the same table
+    IBUS_ENGINE_GET_CLASS(engine)->page_down(engine);
+    g_assert_true(zhuyin->table != first);
+    IBUS_ENGINE_GET_CLASS(engine)->page_up(engine);
+    g_assert_true(zhuyin->table == first);
+
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_Escape, 0, 0);
+    type_keys(engine, "ru");
+    g_assert_true(zhuyin->table == first);
+    g_assert_cmpint(ibus_lookup_table_get_cursor_pos(zhuyin->table), ==, 0);
+
+    // A page that no longer matches its key is built again
+    IBusText *text = ibus_lookup_table_get_candidate(first, 0);
+    g_free(text->text);
+    text->text = g_strdup("x");
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_Escape, 0, 0);
+    type_keys(engine, "ru");
+    g_assert_cmpstr(ibus_lookup_table_get_candidate(zhuyin->table, 0)->text, ==, zhuyin_candidates_get(&zhuyin->candidates, 0));
+
+    g_assert_cmpuint(table_cache_size, >, 0);
+    g_assert_cmpuint(table_cache_size, <=, TABLE_CACHE_LIMIT);
+
+    g_object_unref(engine);
+}
+
+static void test_coalesced_updates() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+
+    // ㄇ only changes the preedit
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, 'a', 0, 0);
+    g_assert_cmpuint(zhuyin->emitted, ==, 1);
+    g_assert_cmpstr(current_preedit, ==, "ㄇ");
+
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_Escape, 0, 0);
+    g_assert_cmpuint(zhuyin->emitted, ==, 1);
+    g_assert_cmpstr(current_preedit, ==, "");
+
+    // With quick match, one of each however often the key updates them
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_CHECKED);
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, 'r', 0, 0);
+    g_assert_cmpuint(zhuyin->emitted, ==, 3);
+    g_assert_true(lookup_table_visible);
+
+    // Moving in the page sends the table alone
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_Right, 0, 0);
+    g_assert_cmpuint(zhuyin->emitted, ==, 1);
+
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_Escape, 0, 0);
+    g_assert_cmpuint(zhuyin->emitted, ==, 3);
+    g_assert_false(lookup_table_visible);
+
+    // Nothing to hide again
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+    g_assert_cmpuint(zhuyin->dirty, ==, 0);
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_Escape, 0, 0);
+    g_assert_cmpuint(zhuyin->emitted, ==, 0);
+
+    g_object_unref(engine);
+}
+
+// Types keys and gives the messages the engine sent for them.
+static guint type_counted(IBusEngine *engine, const gchar *keys, guint repeat) {
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    guint emitted = 0;
+    const gchar *p;
+
+    for (p = keys; *p; p++) {
+        guint keyval = *p == '>' ? IBUS_Right : (guint)*p;
+        guint i;
+
+        for (i = 0; i < (*p == '>' ? repeat : 1); i++) {
+            IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, keyval, 0, 0);
+            emitted += zhuyin->emitted;
+        }
+    }
+    return emitted;
+}
+
+static void test_burst_updates() {
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_CHECKED);
+
+    // One key at a time
+    guint steady = type_counted(engine, "ru>", 20);
+    gchar *preedit = g_strdup(current_preedit);
+    guint cursor = zhuyin->cursor;
+    IBusText *candidate = ibus_lookup_table_get_candidate(zhuyin->table, ibus_lookup_table_get_cursor_pos(zhuyin->table));
+    gchar *text = g_strdup(candidate->text);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // The same keys as a flood, every one closer than a frame to the last
+    zhuyin->burst_time = 60 * G_USEC_PER_SEC;
+    zhuyin->key_time = 0;
+    guint burst = type_counted(engine, "ru>", 20);
+
+    // Only the first key was sent, the state of the rest is there at once
+    // and their UI waits for the frame
+    g_assert_cmpuint(zhuyin->cursor, ==, cursor);
+    g_assert_cmpint(g_source_get_ready_time(zhuyin->flush_source), !=, -1);
+    g_assert_cmpuint(zhuyin->dirty, !=, 0);
+    g_assert_cmpuint(burst, ==, 3);
+
+    zhuyin->emitted = 0;
+    ibus_zhuyin_engine_flush_timeout(zhuyin);
+    burst += zhuyin->emitted;
+    g_assert_cmpint(g_source_get_ready_time(zhuyin->flush_source), ==, -1);
+    g_assert_cmpuint(zhuyin->dirty, ==, 0);
+
+    // And ends up where the keys one at a time did, with less sent
+    g_assert_cmpstr(current_preedit, ==, preedit);
+    g_assert_true(lookup_table_visible);
+    candidate = ibus_lookup_table_get_candidate(zhuyin->table, ibus_lookup_table_get_cursor_pos(zhuyin->table));
+    g_assert_cmpstr(candidate->text, ==, text);
+    g_assert_cmpuint(burst * 4, <, steady);
+
+    // A key that commits sends the preedit it emptied along with the text
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_UNCHECKED);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+    type_counted(engine, "a83", 0);
+    g_assert_cmpint(g_source_get_ready_time(zhuyin->flush_source), !=, -1);
+    g_assert_cmpstr(current_preedit, !=, "ㄇㄚˇ");
+    if (committed_text) { g_free(committed_text); committed_text = NULL; }
+    type_counted(engine, "1", 0);
+    g_assert_nonnull(committed_text);
+    g_assert_true(current_preedit == NULL || current_preedit[0] == '\0');
+    g_assert_cmpint(g_source_get_ready_time(zhuyin->flush_source), ==, -1);
+    g_assert_cmpuint(zhuyin->dirty, ==, 0);
+
+    g_free(preedit);
+    g_free(text);
+    g_object_unref(engine);
+}
+
+static void test_stats() {
+    ZhuyinStatsSummary summary;
+    guint i;
+
+    zhuyin_stats_reset();
+    for (i = 0; i < 99; i++)
+        zhuyin_stats_add(ZHUYIN_STATS_LOOKUP, 1000);
+    zhuyin_stats_add(ZHUYIN_STATS_LOOKUP, 1000000);
+
+    // The percentiles are as fine as the power of two above them
+    zhuyin_stats_summary(ZHUYIN_STATS_LOOKUP, &summary);
+    g_assert_cmpuint(summary.count, ==, 100);
+    g_assert_cmpint(summary.p50, >=, 1000);
+    g_assert_cmpint(summary.p50, <=, 1024);
+    g_assert_cmpint(summary.p99, <=, 1024);
+    g_assert_cmpint(summary.max, ==, 1000000);
+
+    // A stall of seconds is not cut short
+    zhuyin_stats_add(ZHUYIN_STATS_LOOKUP, G_GINT64_CONSTANT(3000000000));
+    zhuyin_stats_summary(ZHUYIN_STATS_LOOKUP, &summary);
+    g_assert_cmpint(summary.max, ==, G_GINT64_CONSTANT(3000000000));
+    gchar *report = zhuyin_stats_report();
+    g_assert_nonnull(strstr(report, " 3000000.0\n"));
+    g_free(report);
+
+    // Nothing is timed until asked to
+    zhuyin_stats_reset();
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    type_keys(engine, "ru");
+    zhuyin_stats_summary(ZHUYIN_STATS_KEY, &summary);
+    g_assert_cmpuint(summary.count, ==, 0);
+
+    zhuyin_stats_enable(TRUE);
+    type_keys(engine, "3");
+    zhuyin_stats_summary(ZHUYIN_STATS_KEY, &summary);
+    g_assert_cmpuint(summary.count, ==, 1);
+    g_assert_cmpint(summary.max, >, 0);
+    zhuyin_stats_summary(ZHUYIN_STATS_PREEDIT, &summary);
+    g_assert_cmpuint(summary.count, ==, 1);
+    zhuyin_stats_summary(ZHUYIN_STATS_LOOKUP, &summary);
+    g_assert_cmpuint(summary.count, >, 0);
+    zhuyin_stats_summary(ZHUYIN_STATS_CANDIDATE, &summary);
+    g_assert_cmpuint(summary.count, ==, 0);
+    zhuyin_stats_enable(FALSE);
+    g_object_unref(engine);
+
+    gchar *path = NULL;
+    gchar *contents = NULL;
+    gint fd = g_file_open_tmp("ibus-zhuyin-XXXXXX.stats", &path, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    g_assert_true(zhuyin_stats_write(path, NULL));
+    g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+    g_assert_nonnull(strstr(contents, "\npreedit          1 "));
+    g_assert_nonnull(strstr(contents, "\nlookup "));
+
+    g_free(contents);
+    g_unlink(path);
+    g_free(path);
+    zhuyin_stats_reset();
+}
+
+static void test_trace() {
+    ZhuyinTraceEvent events[ZHUYIN_TRACE_SIZE];
+    IBusEngine *engine = g_object_new(ibus_zhuyin_engine_get_type(), NULL);
+    IBUS_ENGINE_GET_CLASS(engine)->enable(engine);
+    IBUS_ENGINE_GET_CLASS(engine)->property_activate(engine, "InputMode.QuickMatch", PROP_STATE_CHECKED);
+
+    // Nothing is recorded until asked to
+    zhuyin_trace_reset();
+    type_keys(engine, "r");
+    g_assert_cmpuint(zhuyin_trace_snapshot(events, ZHUYIN_TRACE_SIZE), ==, 0);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    zhuyin_trace_enable(TRUE, FALSE);
+    type_keys(engine, "ru");
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_Down, 0, 0);
+    g_assert_cmpuint(zhuyin_trace_snapshot(events, ZHUYIN_TRACE_SIZE), ==, 3);
+    g_assert_cmpuint(events[0].keyval, ==, 'r');
+    g_assert_cmpuint(events[0].mode_before, ==, IBUS_ZHUYIN_MODE_NORMAL);
+    g_assert_cmpuint(events[0].emitted, >, 0);
+    g_assert_cmpuint(events[0].calls & ZHUYIN_TRACE_PREEDIT, !=, 0);
+    g_assert_cmpuint(events[0].calls & ZHUYIN_TRACE_COMMIT, ==, 0);
+    g_assert_true(events[0].handled);
+    g_assert_cmpuint(events[1].keyval, ==, 'u');
+    g_assert_cmpuint(events[1].stanza, !=, 0);
+    g_assert_cmpuint(events[1].candidates, >, 0);
+    g_assert_cmpuint(events[1].calls & ZHUYIN_TRACE_TABLE_SHOW, !=, 0);
+    g_assert_cmpint(events[1].time, >, events[0].time);
+    g_assert_cmpint(events[1].duration, >, 0);
+    g_assert_cmpuint(events[2].keyval, ==, IBUS_Down);
+
+    // Only the last ones, when asked for fewer
+    g_assert_cmpuint(zhuyin_trace_snapshot(events, 1), ==, 1);
+    g_assert_cmpuint(events[0].keyval, ==, IBUS_Down);
+
+    // What kinds of messages a key sent
+    type_keys(engine, "1");
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_Return, 0, 0);
+    g_assert_cmpuint(zhuyin_trace_snapshot(events, 1), ==, 1);
+    g_assert_cmpuint(events[0].keyval, ==, IBUS_Return);
+    g_assert_cmpuint(events[0].calls & (ZHUYIN_TRACE_COMMIT | ZHUYIN_TRACE_PREEDIT), ==, ZHUYIN_TRACE_COMMIT | ZHUYIN_TRACE_PREEDIT);
+    g_assert_cmpuint(events[0].calls & ZHUYIN_TRACE_TABLE_SHOW, ==, 0);
+    IBUS_ENGINE_GET_CLASS(engine)->reset(engine);
+
+    // Redacted, what was typed is gone and the editing keys are left
+    zhuyin_trace_reset();
+    zhuyin_trace_enable(TRUE, TRUE);
+    type_keys(engine, "ru");
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_BackSpace, 0, 0);
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_KP_1, 0, 0);
+    IBUS_ENGINE_GET_CLASS(engine)->process_key_event(engine, IBUS_Shift_L, 0, 0);
+    g_assert_cmpuint(zhuyin_trace_snapshot(events, ZHUYIN_TRACE_SIZE), ==, 5);
+    g_assert_cmpuint(events[1].keyval, ==, ZHUYIN_TRACE_REDACTED);
+    g_assert_cmpuint(events[1].stanza, ==, 0);
+    g_assert_cmpuint(events[1].candidates, ==, 0);
+    g_assert_cmpuint(events[2].keyval, ==, IBUS_BackSpace);
+    g_assert_cmpuint(events[3].keyval, ==, ZHUYIN_TRACE_REDACTED);
+    g_assert_cmpuint(events[4].keyval, ==, IBUS_Shift_L);
+    zhuyin_trace_enable(FALSE, TRUE);
+    g_object_unref(engine);
+
+    gchar *path = NULL;
+    gchar *contents = NULL;
+    gint fd = g_file_open_tmp("ibus-zhuyin-XXXXXX.trace", &path, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    g_assert_true(zhuyin_trace_write(path, NULL));
+    g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+    g_assert_nonnull(strstr(contents, " *  "));
+    g_assert_nonnull(strstr(contents, " 0xff08 "));
+    g_assert_nonnull(strstr(contents, " 2 -ps-- "));
+    g_assert_null(strstr(contents, " 0x0072 "));
+    g_free(contents);
+    g_unlink(path);
+    g_free(path);
+
+    // Once full, the oldest keys make room
+    ZhuyinTraceEvent event = { 0 };
+    guint i;
+    zhuyin_trace_reset();
+    for (i = 0; i < ZHUYIN_TRACE_SIZE + 10; i++) {
+        event.time = i;
+        zhuyin_trace_record(&event);
+    }
+    g_assert_cmpuint(zhuyin_trace_snapshot(events, ZHUYIN_TRACE_SIZE), ==, ZHUYIN_TRACE_SIZE);
+    g_assert_cmpint(events[0].time, ==, 10);
+    g_assert_cmpint(events[ZHUYIN_TRACE_SIZE - 1].time, ==, ZHUYIN_TRACE_SIZE + 9);
+    zhuyin_trace_reset();
+}
+
+#ifdef IBUS_ZHUYIN_ALLOC_TEST
+static gboolean (*engine_process_key_event)(IBusEngine *, guint, guint, guint);
+static gboolean alloc_check = FALSE;
+
+/*
+ * Every key goes through here, and once the scenarios have all run to warm
+ * up, a key may allocate only to build a page of candidates not cached yet
+ * or to show the menus a config that changed.
+ */
+static gboolean counted_process_key_event(IBusEngine *engine, guint keyval, guint keycode, guint modifiers) {
+    IBusZhuyinEngine *zhuyin = (IBusZhuyinEngine *)engine;
+    guint count = alloc_count;
+    guint built = table_cache_built;
+    guint generation = zhuyin->config_generation;
+    gboolean retval;
+
+    alloc_counting = alloc_check;
+    retval = engine_process_key_event(engine, keyval, keycode, modifiers);
+    alloc_counting = FALSE;
+
+    if (alloc_check && table_cache_built == built && zhuyin->config_generation == generation)
+        g_assert_cmpuint(alloc_count - count, ==, 0);
+    return retval;
+}
+
+static void run_counted(gconstpointer test) {
+    alloc_check = TRUE;
+    ((GTestFunc)test)();
+    alloc_check = FALSE;
+}
+#endif
+
+// The allocation test runs every scenario once to warm up, then again counting
+static void add_test(const gchar *path, GTestFunc test) {
+#ifdef IBUS_ZHUYIN_ALLOC_TEST
+    gchar *warm = g_strconcat("/warm-up", path, NULL);
+    gchar *counted = g_strconcat("/alloc", path, NULL);
+
+    g_test_add_func(warm, test);
+    g_test_add_data_func(counted, (gconstpointer)test, run_counted);
+    g_free(warm);
+    g_free(counted);
+#else
+    g_test_add_func(path, test);
+#endif
+}
+
 int main(int argc, char **argv) {
     g_test_init(&argc, &argv, NULL);
     ibus_init();
 
-    g_test_add_func("/engine/h_9_space", test_h_9_space);
-    g_test_add_func("/engine/w_8_7", test_w_8_7);
-    g_test_add_func("/engine/punctuation_window_m", test_punctuation_window_m);
-    g_test_add_func("/engine/ctrl_grave_h_1", test_ctrl_grave_h_1);
-    g_test_add_func("/engine/shift_period", test_shift_period);
-    g_test_add_func("/engine/zhu_yin", test_zhu_yin);
-    g_test_add_func("/engine/hsu_layout", test_hsu_layout);
-    g_test_add_func("/engine/eten_layout", test_eten_layout);
-    g_test_add_func("/engine/phrase_lookup", test_phrase_lookup);
-    g_test_add_func("/engine/phrase_return", test_phrase_return);
-    g_test_add_func("/engine/phrase_navigation_and_shortcuts", test_phrase_navigation_and_shortcuts);
-    g_test_add_func("/engine/phrase_cursor_navigation", test_phrase_cursor_navigation);
-    g_test_add_func("/engine/preedit_editing", test_preedit_editing);
-    g_test_add_func("/engine/punctuation_symbols", test_punctuation_symbols);
-    g_test_add_func("/engine/candidate_selection", test_candidate_selection);
-    g_test_add_func("/engine/normal_return_with_candidates", test_normal_return_with_candidates);
-    g_test_add_func("/engine/immediate_selection", test_immediate_selection);
-    g_test_add_func("/engine/arrow_keys_normal_mode", test_arrow_keys_normal_mode);
-    g_test_add_func("/engine/ctrl_key_pass_through", test_ctrl_key_pass_through);
-    g_test_add_func("/engine/normal_typing_handled", test_normal_typing_handled);
-    g_test_add_func("/engine/quick_match_toggle", test_quick_match_toggle);
-    g_test_add_func("/engine/ji3_aux_text", test_ji3_aux_text);
-    g_test_add_func("/engine/invalid_combination_aux", test_invalid_combination_aux);
-    g_test_add_func("/engine/normal_mode_navigation", test_normal_mode_navigation);
-    g_test_add_func("/engine/page_down_icon", test_page_down_icon);
-    g_test_add_func("/engine/ui_click_paging", test_ui_click_paging);
+#ifdef IBUS_ZHUYIN_ALLOC_TEST
+    IBusEngineClass *klass = g_type_class_ref(ibus_zhuyin_engine_get_type());
+    engine_process_key_event = klass->process_key_event;
+    klass->process_key_event = counted_process_key_event;
+#endif
+
+    add_test("/engine/h_9_space", test_h_9_space);
+    add_test("/engine/w_8_7", test_w_8_7);
+    add_test("/engine/punctuation_window_m", test_punctuation_window_m);
+    add_test("/engine/ctrl_grave_h_1", test_ctrl_grave_h_1);
+    add_test("/engine/shift_period", test_shift_period);
+    add_test("/engine/zhu_yin", test_zhu_yin);
+    add_test("/engine/hsu_layout", test_hsu_layout);
+    add_test("/engine/hsu_resolution", test_hsu_resolution);
+    add_test("/engine/eten_layout", test_eten_layout);
+    add_test("/engine/keyboard_tables", test_keyboard_tables);
+    add_test("/engine/keyboard_file", test_keyboard_file);
+    add_test("/engine/phrase_lookup", test_phrase_lookup);
+    add_test("/engine/phrase_return", test_phrase_return);
+    add_test("/engine/phrase_navigation_and_shortcuts", test_phrase_navigation_and_shortcuts);
+    add_test("/engine/phrase_cursor_navigation", test_phrase_cursor_navigation);
+    add_test("/engine/preedit_editing", test_preedit_editing);
+    add_test("/engine/punctuation_symbols", test_punctuation_symbols);
+    add_test("/engine/candidate_selection", test_candidate_selection);
+    add_test("/engine/normal_return_with_candidates", test_normal_return_with_candidates);
+    add_test("/engine/immediate_selection", test_immediate_selection);
+    add_test("/engine/arrow_keys_normal_mode", test_arrow_keys_normal_mode);
+    add_test("/engine/ctrl_key_pass_through", test_ctrl_key_pass_through);
+    add_test("/engine/normal_typing_handled", test_normal_typing_handled);
+    add_test("/engine/quick_match_toggle", test_quick_match_toggle);
+    add_test("/engine/ji3_aux_text", test_ji3_aux_text);
+    add_test("/engine/invalid_combination_aux", test_invalid_combination_aux);
+    add_test("/engine/impossible_key", test_impossible_key);
+    add_test("/engine/tone_inference", test_tone_inference);
+    add_test("/engine/toneless_quick_match", test_toneless_quick_match);
+    add_test("/engine/prefix_quick_match", test_prefix_quick_match);
+    add_test("/engine/fuzzy", test_fuzzy);
+    add_test("/engine/learn", test_learn);
+    add_test("/engine/learn_journal", test_learn_journal);
+    add_test("/engine/learn_shared", test_learn_shared);
+    add_test("/engine/config_writer", test_config_writer);
+    add_test("/engine/config_reload", test_config_reload);
+    add_test("/engine/config_snapshot", test_config_snapshot);
+    add_test("/engine/normal_mode_navigation", test_normal_mode_navigation);
+    add_test("/engine/page_down_icon", test_page_down_icon);
+    add_test("/engine/ui_click_paging", test_ui_click_paging);
+    add_test("/engine/table_cache", test_table_cache);
+    add_test("/engine/coalesced_updates", test_coalesced_updates);
+    add_test("/engine/burst_updates", test_burst_updates);
+    add_test("/engine/stats", test_stats);
+    add_test("/engine/trace", test_trace);
 
     return g_test_run();
 }
\ No newline at end of file